@@ -0,0 +1,66 @@
+#include "mysync.h"
+
+// A C file that hands out memory from large blocks, so the metadata of a sync (which all lives until the end of the sync) costs one malloc per block rather than one per entry
+// Nothing in an arena is freed on its own: the whole arena is freed at once when the sync is finished
+
+Arena *create_arena(void) {
+    // A function that returns an empty arena (its first block is allocated with the first allocation)
+    Arena *arena = malloc_data(sizeof(Arena));
+    arena->head = NULL;
+    arena->last = NULL;
+    arena->next_block_size = ARENA_FIRST_BLOCK_SIZE;
+    return arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    // A function that takes an arena and a size, and returns that many bytes from the arena (aligned for any type)
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1); // Round the size up, so the next allocation is aligned too
+    if (arena->head == NULL || arena->head->used + size > arena->head->size) {
+        // If the current block is full, start a new one (each twice the size of the last, up to a limit, so a large sync needs few blocks)
+        size_t block_size = arena->next_block_size;
+        if (block_size < size) {
+            // If the allocation is bigger than a block, give it a block of its own
+            block_size = size;
+        }
+        Arena_block *block = malloc_data(sizeof(Arena_block) + block_size);
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+        if (arena->next_block_size < ARENA_MAX_BLOCK_SIZE) {
+            arena->next_block_size *= 2;
+        }
+    }
+    void *memory = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    arena->last = memory;
+    return memory;
+}
+
+char *arena_strdup(Arena *arena, char *string) {
+    // A function that takes an arena and a string, and returns a copy of the string in the arena
+    size_t length = strlen(string) + 1;
+    char *copy = arena_alloc(arena, length);
+    memcpy(copy, string, length);
+    return copy;
+}
+
+void arena_undo(Arena *arena, void *memory) {
+    // A function that takes an arena and the memory it handed out most recently, and gives the memory back (used for a string that turned out not to be needed)
+    if (memory != NULL && memory == arena->last) {
+        arena->head->used = (char *)memory - arena->head->data;
+        arena->last = NULL; // Only the most recent allocation can be given back
+    }
+}
+
+void free_arena(Arena *arena) {
+    // A function that takes an arena, and frees it along with everything allocated from it
+    Arena_block *block = arena->head;
+    while (block != NULL) {
+        // Loop through the blocks (there are only a handful, however much was allocated)
+        Arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
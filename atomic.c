@@ -0,0 +1,279 @@
+#include "mysync.h"
+
+// A C file that replaces copies of files atomically (with the --atomic flag): each copy is written to a new file next to it and renamed over it once complete, so a crash or a full disk never leaves a half written copy behind
+// Rather than an fsync per file, the filesystems written to are flushed with one syncfs each every --flush-interval milliseconds (and at the end of every sync), and the copies written since the last flush are only renamed into place once that syncfs has put their data on disk
+
+Flush_target *flush_targets = NULL; // An array of the filesystems copies have been written to
+int num_flush_targets = 0;
+int flush_targets_capacity = 0;
+Pending_replica *pending_replicas = NULL; // An array of the new copies waiting for the next flush to be put in place
+int num_pending_replicas = 0;
+int pending_replicas_capacity = 0;
+pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the flush targets and the pending copies (files are copied on several threads)
+struct timespec last_flush = {0, 0}; // The time the filesystems were last flushed
+
+mode_t creation_mask = 0; // The process's umask (read once, as reading it means setting it)
+pthread_once_t creation_mask_once = PTHREAD_ONCE_INIT;
+bool proc_fds_available = false; // A bool that represents whether /proc/self/fd is mounted (an O_TMPFILE file can only be given a name through it)
+_Atomic unsigned int temp_counter = 0; // A counter that keeps the temporary names made at the same time apart
+
+void read_creation_mask(void) {
+    // A function that reads the process's umask and whether /proc/self/fd can be used (run once)
+    creation_mask = umask(0);
+    umask(creation_mask);
+    proc_fds_available = access("/proc/self/fd", X_OK) == 0;
+}
+
+char *temp_name(char *filepath) {
+    // A function that takes the path of a copy, and returns a new temporary path next to it (which must be freed), hidden and marked as mysync's ("dir/.name.mysync-<pid>-<n>") so a scan never syncs it, even one that was left behind
+    char *slash = strrchr(filepath, '/');
+    int directory_length = slash == NULL ? 0 : slash - filepath + 1; // The length of the copy's directory, up to and including the last '/'
+    char *temp_path = malloc_data(strlen(filepath) + 1 + strlen(TEMP_NAME_MARKER) + 2 * sizeof(unsigned int) * 2 + 2);
+    sprintf(temp_path, "%.*s.%s" TEMP_NAME_MARKER "%x-%x", directory_length, filepath, filepath + directory_length, (unsigned int)getpid(), temp_counter++);
+    return temp_path;
+}
+
+bool is_temp_name(char *filename) {
+    // A function that takes the name of a file, and returns true if it is a temporary name made by temp_name
+    if (filename[0] != '.') {
+        return false;
+    }
+    char *marker = NULL; // The last marker in the name (the copy's own name may contain one too)
+    for (char *found = strstr(filename + 1, TEMP_NAME_MARKER); found != NULL; found = strstr(found + 1, TEMP_NAME_MARKER)) {
+        marker = found;
+    }
+    if (marker == NULL) {
+        return false;
+    }
+    char *pid = marker + strlen(TEMP_NAME_MARKER); // The name must end with "<pid>-<n>" in hexadecimal
+    size_t pid_length = strspn(pid, "0123456789abcdef");
+    if (pid_length == 0 || pid[pid_length] != '-') {
+        return false;
+    }
+    char *counter = pid + pid_length + 1;
+    size_t counter_length = strspn(counter, "0123456789abcdef");
+    return counter_length > 0 && counter[counter_length] == '\0';
+}
+
+int open_atomic_replica(char *filepath, char **temp_path) {
+    // A function that takes the path of a copy, and returns a new file to write the copy into before it replaces the old one (with the old copy's permissions, or the permissions a new file would get), setting *temp_path to its temporary path (NULL if the file has no name yet), or -1 if it couldn't be created
+    pthread_once(&creation_mask_once, read_creation_mask);
+    struct stat old_info; // The old copy's info (if there is one, its permissions are kept)
+    mode_t mode = stat(filepath, &old_info) == 0 ? old_info.st_mode & 07777 : 0666 & ~creation_mask;
+    char *directory = strdup(filepath); // The directory the copy is in
+    char *slash = strrchr(directory, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    int fd = -1;
+    if (proc_fds_available && slash != NULL) {
+        // If the filesystem supports it, write the copy into an unnamed file, which disappears by itself if the program dies before the copy is complete
+        fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    free(directory);
+    *temp_path = NULL;
+    if (fd == -1) {
+        // Otherwise write the copy into a temporary file next to it
+        *temp_path = temp_name(filepath);
+        fd = open(*temp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    if (fd != -1 && fchmod(fd, mode) == -1) {
+        // If the permissions can't be set, give up on the file
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1 && *temp_path != NULL) {
+        free(*temp_path);
+        *temp_path = NULL;
+    }
+    return fd;
+}
+
+bool name_unnamed_replica(int fd, char *filepath, char **temp_path) {
+    // A function that takes an unnamed file, and the path of the copy it replaces, and links the file into the copy's directory, setting *temp_path to the name it was given (NULL if it took the copy's own name, as there was no old copy), returning false if it couldn't be linked
+    char fd_path[64]; // The file's path under /proc (the only way to name a file that was opened without one, without extra privileges)
+    sprintf(fd_path, "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, fd_path, AT_FDCWD, filepath, AT_SYMLINK_FOLLOW) == 0) {
+        // If there was no old copy, the file can take its name straight away
+        return true;
+    }
+    while (errno == EEXIST) {
+        // Otherwise give the file a temporary name, to be renamed over the old copy (trying another name if one is taken)
+        *temp_path = temp_name(filepath);
+        if (linkat(AT_FDCWD, fd_path, AT_FDCWD, *temp_path, AT_SYMLINK_FOLLOW) == 0) {
+            return true;
+        }
+        free(*temp_path);
+        *temp_path = NULL;
+    }
+    return false;
+}
+
+int find_flush_target(int fd, char *filepath) {
+    // A function that takes a file that was just written and its path, and returns the index of its filesystem in the flush targets, adding the filesystem if it is new (the flush lock must be held), or -1 if the file's filesystem can't be found
+    struct stat file_info;
+    if (fstat(fd, &file_info) == -1) {
+        return -1;
+    }
+    int i = 0;
+    while (i < num_flush_targets && flush_targets[i].device != file_info.st_dev) {
+        // Look for the file's filesystem among the ones already written to
+        i++;
+    }
+    if (i == num_flush_targets) {
+        // If the filesystem is new, keep a handle on it to call syncfs with (the directory of the file, which stays open for the rest of the run)
+        if (num_flush_targets == flush_targets_capacity) {
+            // If the array is full, double its size
+            flush_targets_capacity = flush_targets_capacity == 0 ? 4 : flush_targets_capacity * 2;
+            flush_targets = realloc(flush_targets, flush_targets_capacity * sizeof(Flush_target));
+            if (flush_targets == NULL) {
+                // If realloc fails, print an error message and exit the program
+                fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        char *directory = strdup(filepath);
+        char *slash = strrchr(directory, '/');
+        flush_targets[i].fd = open(slash == NULL ? "." : (*slash = '\0', directory), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        free(directory);
+        flush_targets[i].device = file_info.st_dev;
+        flush_targets[i].dirty = false;
+        num_flush_targets++;
+    }
+    return i;
+}
+
+void verify_atomic_replica(int fd, char *filepath, char *master_path, Flags *flags) {
+    // A function that takes a new copy that hasn't been put in place yet, its path, its master file's path, and a flags struct, and hashes the copy and checks it matches the master file (for the --verify flag, as the copy can't be read at its path until the next flush)
+    Digest master_digest, digest;
+    set_direct_io(fd, false); // The digest is read through the page cache, whatever the copy was written with
+    if (!file_digest(master_path, true, &master_digest) || !hash_fd(fd, &digest) || digest.low != master_digest.low || digest.high != master_digest.high) {
+        // If the copy doesn't match the master file, print an error message and exit the program (the old copy is untouched)
+        fprintf(stderr, "Error: file \"%s\" does not match master file \"%s\" after copying\n", filepath, master_path);
+        exit(EXIT_FAILURE);
+    }
+    VERBOSE_PRINT("Verified file \"%s\" against master file \"%s\"\n", filepath, master_path);
+}
+
+void commit_atomic_replica(int fd, char *filepath, char *temp_path, char *master_path, Flags *flags) {
+    // A function that takes a file a copy was written into, the path of the copy, the file's temporary path (NULL if it has no name yet), the master file's path (to check the copy against with the --verify flag), and a flags struct, and queues the file to be put in place of the copy at the next flush (once its data is on disk, so the copy's path never leads to data that isn't)
+    if (flags->verify_flag) {
+        verify_atomic_replica(fd, filepath, master_path, flags);
+    }
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE); // Start writing the data back now, so little is left for the flush
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&flush_lock);
+    int target = find_flush_target(fd, filepath);
+    if (target == -1) {
+        // If the copy's filesystem can't be found, print an error message and exit the program (the old copy is untouched)
+        pthread_mutex_unlock(&flush_lock);
+        fprintf(stderr, "Error: could not replace file \"%s\"\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    if (num_pending_replicas == pending_replicas_capacity) {
+        // If the array is full, double its size
+        pending_replicas_capacity = pending_replicas_capacity == 0 ? 16 : pending_replicas_capacity * 2;
+        pending_replicas = realloc(pending_replicas, pending_replicas_capacity * sizeof(Pending_replica));
+        if (pending_replicas == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Pending_replica *pending = &pending_replicas[num_pending_replicas++];
+    pending->fd = fd; // Kept open, so a file without a name yet can be linked in once it is flushed
+    pending->filepath = strdup(filepath);
+    pending->temp_path = temp_path;
+    pending->target = target;
+    flush_targets[target].dirty = true;
+    if (last_flush.tv_sec == 0) {
+        last_flush = now; // The interval is counted from the first write
+    }
+    long long int elapsed_ms = (now.tv_sec - last_flush.tv_sec) * 1000LL + (now.tv_nsec - last_flush.tv_nsec) / 1000000;
+    bool due = (flags->flush_interval_ms > 0 && elapsed_ms >= flags->flush_interval_ms) || num_pending_replicas >= ATOMIC_MAX_PENDING;
+    pthread_mutex_unlock(&flush_lock);
+    if (due) {
+        flush_replicas(flags, false);
+    }
+}
+
+void flush_replicas(Flags *flags, bool final) {
+    // A function that takes a flags struct and whether this is the last flush of the sync, and flushes every filesystem copies have been written to since the last flush with one syncfs each (the group commit of every copy written in between), then puts each of those copies in place (with a second syncfs on the last flush, so the new names are on disk too, as no later flush will carry them)
+    struct timespec start; // The time the flush started (for the --stats flag)
+    start_stat_timer(&start);
+    pthread_mutex_lock(&flush_lock);
+    int *fds = malloc_data((num_flush_targets + 1) * sizeof(int)); // The filesystems to flush (flushed without holding the lock, so the copies can carry on)
+    int num_fds = 0;
+    for (int i = 0; i < num_flush_targets; i++) {
+        if (flush_targets[i].dirty && flush_targets[i].fd != -1) {
+            fds[num_fds++] = flush_targets[i].fd;
+        }
+        flush_targets[i].dirty = false;
+    }
+    Pending_replica *pending = pending_replicas; // The copies to put in place once their data is flushed (taken as a batch, so copies committed during the flush wait for the next one)
+    int num_pending = num_pending_replicas;
+    pending_replicas = NULL;
+    num_pending_replicas = pending_replicas_capacity = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    pthread_mutex_unlock(&flush_lock);
+    for (int i = 0; i < num_fds; i++) {
+        // Loop through the filesystems and flush each of them, putting the data of every new copy on disk before any of them takes its copy's name
+        if (syncfs(fds[i]) == -1) {
+            // If a filesystem can't be flushed, the copies on it aren't safe, so print an error message and exit the program
+            fprintf(stderr, "Error: could not flush the copies written\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_pending; i++) {
+        // Loop through the new copies, putting each in place of its old copy (readers see either the old copy or the new one, never a mix, and never a name without its data)
+        bool success = true;
+        if (pending[i].temp_path == NULL) {
+            // If the file has no name yet, link it into the directory
+            success = name_unnamed_replica(pending[i].fd, pending[i].filepath, &pending[i].temp_path);
+        }
+        if (success && pending[i].temp_path != NULL) {
+            // If the file has a temporary name, rename it over the old copy
+            success = rename(pending[i].temp_path, pending[i].filepath) == 0;
+            if (!success) {
+                unlink(pending[i].temp_path);
+            }
+        }
+        if (!success) {
+            // If the copy couldn't be put in place, print an error message and exit the program (the old copy is untouched)
+            fprintf(stderr, "Error: could not replace file \"%s\"\n", pending[i].filepath);
+            exit(EXIT_FAILURE);
+        }
+        close(pending[i].fd);
+        free(pending[i].temp_path);
+        free(pending[i].filepath);
+    }
+    if (num_pending > 0) {
+        // If any copies were put in place, their directories have changed since the flush, so their filesystems are flushed again by the next flush
+        pthread_mutex_lock(&flush_lock);
+        for (int i = 0; i < num_pending; i++) {
+            flush_targets[pending[i].target].dirty = true;
+        }
+        pthread_mutex_unlock(&flush_lock);
+    }
+    if (num_fds > 0) {
+        VERBOSE_PRINT("Flushed %d filesystem%s\n", num_fds, num_fds == 1 ? "" : "s");
+    }
+    free(pending);
+    free(fds);
+    stop_stat_timer(STAT_TIME_FLUSH, &start);
+    if (final && num_pending > 0) {
+        // If this is the last flush of the sync, flush again now, so the new names are on disk too (no later flush will carry them)
+        flush_replicas(flags, true);
+    }
+}
+
+void place_pending_replicas(Flags *flags) {
+    // A function that takes a flags struct, and flushes early if any new copies are waiting to be put in place (for the stages that read or link to copies by their paths)
+    pthread_mutex_lock(&flush_lock);
+    bool pending = num_pending_replicas > 0;
+    pthread_mutex_unlock(&flush_lock);
+    if (pending) {
+        flush_replicas(flags, false);
+    }
+}
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Benchmarks the splice/tee fan-out against the buffered read/write loop when copying one master root to 2, 4, 8 and 16 roots
+# Usage: bench/fanout.sh [mysync binary] [work directory] [MiB per file] [number of files]
+# METHODS and ROOT_COUNTS can be set in the environment to compare other methods or root counts
+# Prints one line per method and root count with the wall time and throughput (MiB/s of data written to the copies)
+
+MYSYNC=${1:-./mysync}
+WORK=${2:-/tmp/mysync-fanout}
+FILE_MIB=${3:-16}
+NUM_FILES=${4:-8}
+METHODS=${METHODS:-"readwrite splice"}
+ROOT_COUNTS=${ROOT_COUNTS:-"2 4 8 16"}
+
+rm -rf "$WORK" && mkdir -p "$WORK/master"
+for i in $(seq 1 "$NUM_FILES"); do
+    # Fill the master root with incompressible files
+    head -c $((FILE_MIB * 1024 * 1024)) /dev/urandom > "$WORK/master/file$i.bin"
+done
+cat "$WORK"/master/* > /dev/null # Warm the page cache so every run reads the master from memory
+
+printf "%-10s %6s %10s %10s\n" method roots seconds MiB/s
+for roots in $ROOT_COUNTS; do
+    for method in $METHODS; do
+        # Create empty copies of every root but the first, then time one sync
+        rm -rf "$WORK/copies" && mkdir -p "$WORK/copies"
+        dirs="$WORK/master"
+        for r in $(seq 2 "$roots"); do
+            mkdir "$WORK/copies/root$r"
+            dirs="$dirs $WORK/copies/root$r"
+        done
+        sync
+        start=$(date +%s.%N)
+        "$MYSYNC" -m "$method" $dirs || exit 1
+        end=$(date +%s.%N)
+        written=$(( FILE_MIB * NUM_FILES * (roots - 1) ))
+        awk -v m="$method" -v r="$roots" -v s="$start" -v e="$end" -v w="$written" 'BEGIN { printf "%-10s %6d %10.3f %10.1f\n", m, r, e - s, w / (e - s) }'
+    done
+done
+rm -rf "$WORK"
@@ -0,0 +1,200 @@
+#include "../mysync.h"
+#include <malloc.h>
+
+// A microbenchmark that compares the open addressed hashtable in hashtable.c with the chained hashtable it replaced
+// Both tables are filled with the same relative paths (deep ones by default, as a large tree would have), then every path is looked up, a path that isn't there is looked up for each, and every path is deleted
+// Usage: bench/hashtable_bench [number of paths] [directory depth]
+// Prints the nanoseconds per operation of each phase and the heap used by each table when full
+
+typedef struct old_node {
+    // A struct that represents a node in the old hashtable
+    char *name;
+    void *data;
+    struct old_node *next;
+} Old_node;
+
+typedef struct old_hashtable {
+    // A struct that represents the old hashtable
+    int size;
+    int num_elements;
+    Old_node **table;
+} Old_hashtable;
+
+// The old hashtable, as it was (the data is freed with free_node_data like the new one)
+
+void free_node_data(void *);
+
+Old_hashtable *old_create_hashtable(size_t size) {
+    Old_hashtable *hashtable = malloc_data(sizeof(Old_hashtable));
+    hashtable->size = size;
+    hashtable->num_elements = 0;
+    hashtable->table = calloc(size, sizeof(Old_node *));
+    return hashtable;
+}
+
+unsigned int old_hash(char *key, int size) {
+    unsigned int hash = 5381;
+    for (int i = 0; i < strlen(key); i++) {
+        hash = ((hash << 5) + hash) + key[i];
+    }
+    return hash % size;
+}
+
+void old_put(Old_hashtable **hashtable, char *key, void *data);
+
+void old_resize(Old_hashtable **hashtable, size_t size) {
+    Old_hashtable *new_hashtable = old_create_hashtable(size);
+    for (int i = 0; i < (*hashtable)->size; i++) {
+        Old_node *current_node = (*hashtable)->table[i];
+        while (current_node != NULL) {
+            old_put(&new_hashtable, current_node->name, current_node->data);
+            free(current_node->name);
+            Old_node *temp = current_node;
+            current_node = current_node->next;
+            free(temp);
+        }
+    }
+    free((*hashtable)->table);
+    free(*hashtable);
+    *hashtable = new_hashtable;
+}
+
+void old_put(Old_hashtable **hashtable, char *key, void *data) {
+    unsigned int index = old_hash(key, (*hashtable)->size);
+    for (Old_node *current_node = (*hashtable)->table[index]; current_node != NULL; current_node = current_node->next) {
+        if (strcmp(current_node->name, key) == 0) {
+            free_node_data(current_node->data);
+            current_node->data = data;
+            return;
+        }
+    }
+    Old_node *new_node = malloc_data(sizeof(Old_node));
+    new_node->name = strdup(key);
+    new_node->data = data;
+    new_node->next = (*hashtable)->table[index];
+    (*hashtable)->table[index] = new_node;
+    (*hashtable)->num_elements++;
+    if ((*hashtable)->num_elements > 0.75 * (*hashtable)->size) {
+        old_resize(hashtable, (*hashtable)->size * 2);
+    }
+}
+
+void *old_get(Old_hashtable *hashtable, char *key) {
+    unsigned int index = old_hash(key, hashtable->size);
+    for (Old_node *current_node = hashtable->table[index]; current_node != NULL; current_node = current_node->next) {
+        if (strcmp(current_node->name, key) == 0) {
+            return current_node->data;
+        }
+    }
+    return NULL;
+}
+
+void old_delete(Old_hashtable **hashtable, char *key) {
+    unsigned int index = old_hash(key, (*hashtable)->size);
+    Old_node *previous_node = NULL;
+    for (Old_node *current_node = (*hashtable)->table[index]; current_node != NULL; current_node = current_node->next) {
+        if (strcmp(current_node->name, key) == 0) {
+            free_node_data(current_node->data);
+            free(current_node->name);
+            if (previous_node == NULL) {
+                (*hashtable)->table[index] = current_node->next;
+            } else {
+                previous_node->next = current_node->next;
+            }
+            free(current_node);
+            (*hashtable)->num_elements--;
+            if ((*hashtable)->num_elements < 0.25 * (*hashtable)->size && (*hashtable)->size > DEFAULT_HASHTABLE_SIZE) {
+                old_resize(hashtable, (*hashtable)->size / 2);
+            }
+            return;
+        }
+        previous_node = current_node;
+    }
+}
+
+// The benchmark
+
+double seconds_since(struct timespec start) {
+    // A function that returns the seconds since a time
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void *new_data(void) {
+    // A function that returns a small piece of data for the tables to own (a Dir_indexes with no indexes, so free_node_data can free it)
+    Dir_indexes *data = calloc(1, sizeof(Dir_indexes));
+    return data;
+}
+
+int main(int argc, char **argv) {
+    int num_paths = argc > 1 ? atoi(argv[1]) : 1000000;
+    int depth = argc > 2 ? atoi(argv[2]) : 6;
+    char **paths = malloc_data(num_paths * sizeof(char *)); // The keys, shaped like relative paths in a deep tree
+    char **missing = malloc_data(num_paths * sizeof(char *)); // Keys that are never put in the tables
+    for (int i = 0; i < num_paths; i++) {
+        char path[1024];
+        int length = 0;
+        for (int level = 0, n = i; level < depth; level++, n /= 10) {
+            length += sprintf(path + length, "directory_%d/", n % 10 + level * 10);
+        }
+        sprintf(path + length, "file_%d.txt", i);
+        paths[i] = strdup(path);
+        sprintf(path + length, "file_%d.bak", i);
+        missing[i] = strdup(path);
+    }
+    printf("%d paths, %zu bytes long on average\n", num_paths, strlen(paths[num_paths / 2]));
+    printf("%-10s %10s %10s %10s %10s %12s\n", "table", "put ns", "get ns", "miss ns", "delete ns", "heap MiB");
+    for (int round = 0; round < 2; round++) {
+        // Run the old table, then the new one
+        bool old = round == 0;
+        Old_hashtable *old_table = old ? old_create_hashtable(DEFAULT_HASHTABLE_SIZE) : NULL;
+        Hashtable *new_table = old ? NULL : create_hashtable(DEFAULT_HASHTABLE_SIZE);
+        size_t heap_before = mallinfo2().uordblks;
+        double times[4];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_paths; i++) {
+            if (old) {
+                old_put(&old_table, paths[i], new_data());
+            } else {
+                put(&new_table, paths[i], new_data());
+            }
+        }
+        times[0] = seconds_since(start);
+        size_t heap_used = mallinfo2().uordblks - heap_before; // The data is the same for both tables, so the difference between them is the table itself
+        long long int found = 0; // Summed so the lookups can't be optimised away
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_paths; i++) {
+            found += (old ? old_get(old_table, paths[i]) : get(new_table, paths[i])) != NULL;
+        }
+        times[1] = seconds_since(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_paths; i++) {
+            found += (old ? old_get(old_table, missing[i]) : get(new_table, missing[i])) != NULL;
+        }
+        times[2] = seconds_since(start);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < num_paths; i++) {
+            if (old) {
+                old_delete(&old_table, paths[i]);
+            } else {
+                delete(&new_table, paths[i]);
+            }
+        }
+        times[3] = seconds_since(start);
+        if (found != num_paths) {
+            fprintf(stderr, "Error: %s table found %lld of %d paths\n", old ? "old" : "new", found, num_paths);
+            return 1;
+        }
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f %12.1f\n", old ? "chained" : "open", times[0] * 1e9 / num_paths, times[1] * 1e9 / num_paths,
+               times[2] * 1e9 / num_paths, times[3] * 1e9 / num_paths, heap_used / 1048576.0);
+        if (old) {
+            free(old_table->table);
+            free(old_table);
+        } else {
+            free_hashtable(new_table);
+        }
+    }
+    return 0;
+}
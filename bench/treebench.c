@@ -0,0 +1,509 @@
+#include "../mysync.h"
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// A benchmark that generates a reproducible synthetic tree in several roots, syncs it with mysync, and records how long each phase took
+// The tree is a full tree of directories (the depth and fan-out are set), with the files spread over it at random and their sizes drawn log-uniformly between a smallest and largest size
+// The first root has every file, and every other root has the same files except for a fraction of them, half of which are missing and half of which are stale (older, with other contents)
+// Each repetition times four runs of mysync (each passed -r, -p and the flags after "--"), each on its own so their costs don't mix:
+//     scan:   -n on the generated roots (the scan and merge, with nothing written)
+//     mkdir:  a sync of a skeleton of the tree, with one empty file per directory in the first root and nothing in the others (so it is dominated by creating directories)
+//     copy:   the sync of the generated roots (every missing and stale copy is written)
+//     resync: the same sync again, with nothing left to do (the cost of checking a tree that is already in sync)
+// Usage: bench/treebench [-m mysync] [-w work directory] [-o results file] [-l label] [-n files] [-s size or min-max] [-d depth] [-f fan-out] [-r roots] [-x fraction that differs] [-S seed] [-R repetitions] [-C] [-k] [-g] [-- mysync flags]
+//     -C drops the page cache before each run (needs root), -k keeps the work directory, -g only generates the tree
+// Prints one line per phase (the median of the repetitions) and appends the results to the results file as one line of JSON, so runs of different versions can be compared
+
+#define BENCH_BASE_TIME 1600000000 // The modification time of the first root's copy of file 0 (file i is i seconds later)
+#define BENCH_STALE_AGE 100000 // How much older a stale copy is than the first root's copy
+#define BENCH_NUM_PHASES 4
+
+typedef struct bench_options {
+    // A struct that represents the options of a benchmark
+    char *mysync; // The mysync binary to time
+    char *work_dir; // The directory the trees are generated in
+    char *results_path; // The file the results are appended to
+    char *label; // A label saved with the results (the version being timed)
+    int num_files; // The number of files in the tree
+    long long int min_size; // The smallest and largest size of a file
+    long long int max_size;
+    int depth; // The number of levels of directories below the root
+    int fan_out; // The number of subdirectories of every directory above the deepest level
+    int num_roots; // The number of roots
+    double differ; // The fraction of files that differ in each root but the first
+    uint64_t seed; // The seed the tree is generated from
+    int repetitions; // The number of times each phase is timed
+    bool drop_caches; // A bool that represents whether the page cache is dropped before each run
+    bool keep; // A bool that represents whether the work directory is kept afterwards
+    bool generate_only; // A bool that represents whether the tree is only generated
+    char **sync_args; // The flags passed to every run of mysync
+    int num_sync_args;
+} Bench_options;
+
+typedef struct bench_tree {
+    // A struct that represents a generated tree
+    char **dirs; // The relative paths of its directories ("" for the root)
+    int num_dirs;
+    long long int bytes; // The total size of the files
+    long long int copies; // The number of copies the first sync has to write
+    long long int copy_bytes; // The number of bytes the first sync has to write
+} Bench_tree;
+
+typedef struct bench_run {
+    // A struct that represents one timed run of mysync
+    double seconds; // The wall time of the run
+    long int peak_rss_kib; // The peak resident set size of the run
+} Bench_run;
+
+char *phase_names[BENCH_NUM_PHASES] = {"scan", "mkdir", "copy", "resync"};
+
+uint64_t next_random(uint64_t *state) {
+    // A function that takes the state of a random number generator, and returns the next random number (splitmix64, so a seed always gives the same tree)
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+double random_fraction(uint64_t *state) {
+    // A function that takes the state of a random number generator, and returns a random number in [0, 1)
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+char *join_path(char *directory, char *name) {
+    // A function that takes a directory and a name, and returns the path of the name in the directory (which must be freed)
+    char *path = malloc_data(strlen(directory) + strlen(name) + 2);
+    sprintf(path, name[0] == '\0' ? "%s%s" : "%s/%s", directory, name);
+    return path;
+}
+
+void run_command(char **argv) {
+    // A function that takes the arguments of a command, and runs it, exiting the program if it fails
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        // If the command failed, print an error message and exit the program
+        fprintf(stderr, "Error: \"%s\" failed\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void remove_tree(char *path) {
+    // A function that takes a path, and removes it and everything in it
+    char *argv[] = {"rm", "-rf", path, NULL};
+    run_command(argv);
+}
+
+void make_directory(char *path) {
+    // A function that takes a path, and creates a directory there, exiting the program if it can't
+    if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: could not create directory %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void build_dirs(Bench_tree *tree, Bench_options *options) {
+    // A function that takes a tree and the options of the benchmark, and fills in the relative paths of the tree's directories (level by level, so every directory comes after the one it is in)
+    int capacity = 1;
+    for (int level = 0, width = 1; level < options->depth; level++) {
+        width *= options->fan_out;
+        capacity += width;
+    }
+    tree->dirs = malloc_data(capacity * sizeof(char *));
+    tree->dirs[0] = strdup("");
+    tree->num_dirs = 1;
+    int level_start = 0; // The first directory of the level being expanded
+    for (int level = 0; level < options->depth; level++) {
+        // Loop through the levels, giving every directory of the level fan_out subdirectories
+        int level_end = tree->num_dirs;
+        for (int i = level_start; i < level_end; i++) {
+            for (int j = 0; j < options->fan_out; j++) {
+                char name[32];
+                sprintf(name, "dir%d", j);
+                tree->dirs[tree->num_dirs++] = join_path(tree->dirs[i], name);
+            }
+        }
+        level_start = level_end;
+    }
+}
+
+void write_file(char *path, long long int size, uint64_t seed, time_t edit_time, char *buffer, size_t buffer_size) {
+    // A function that takes a path, a size, a seed, a modification time, and a buffer, and writes a file of that size filled with random bytes from the seed, with that modification time
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Error: could not create file %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t state = seed;
+    for (long long int written = 0; written < size;) {
+        // Loop through the file a buffer at a time, filling the buffer with random bytes
+        size_t length = size - written < (long long int)buffer_size ? size - written : buffer_size;
+        for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+            uint64_t value = next_random(&state);
+            memcpy(buffer + i, &value, sizeof(uint64_t));
+        }
+        if (write(fd, buffer, length) != (ssize_t)length) {
+            fprintf(stderr, "Error: could not write file %s\n", path);
+            exit(EXIT_FAILURE);
+        }
+        written += length;
+    }
+    struct timespec times[2] = {{edit_time, 0}, {edit_time, 0}};
+    futimens(fd, times);
+    close(fd);
+}
+
+void generate_tree(Bench_tree *tree, char *trees_dir, Bench_options *options) {
+    // A function that takes a tree, the directory to generate it in, and the options of the benchmark, and writes root1 to rootN and the skeleton (skeleton1 to skeletonN) of the tree, counting the copies the first sync of each has to write
+    remove_tree(trees_dir);
+    make_directory(trees_dir);
+    size_t buffer_size = 1 << 20;
+    char *buffer = malloc_data(buffer_size + sizeof(uint64_t));
+    char **roots = malloc_data(options->num_roots * sizeof(char *));
+    for (int r = 0; r < options->num_roots; r++) {
+        // Loop through the roots, creating every directory of the tree in each of them (and an empty skeleton root)
+        char name[32];
+        sprintf(name, "root%d", r + 1);
+        roots[r] = join_path(trees_dir, name);
+        for (int i = 0; i < tree->num_dirs; i++) {
+            char *path = join_path(roots[r], tree->dirs[i]);
+            make_directory(path);
+            free(path);
+        }
+        sprintf(name, "skeleton%d", r + 1);
+        char *skeleton = join_path(trees_dir, name);
+        make_directory(skeleton);
+        for (int i = 0; r == 0 && i < tree->num_dirs; i++) {
+            // Give every directory of the first skeleton root one empty file, so every directory has to be created in the others
+            char *path = join_path(skeleton, tree->dirs[i]);
+            make_directory(path);
+            char *file_path = join_path(path, "keep");
+            write_file(file_path, 0, 0, BENCH_BASE_TIME, buffer, buffer_size);
+            free(file_path);
+            free(path);
+        }
+        free(skeleton);
+    }
+    uint64_t state = options->seed;
+    tree->bytes = tree->copies = tree->copy_bytes = 0;
+    double log_min = log((double)options->min_size + 1);
+    double log_max = log((double)options->max_size + 1);
+    for (int i = 0; i < options->num_files; i++) {
+        // Loop through the files, picking each one's directory and size, and writing it to every root
+        int dir = next_random(&state) % tree->num_dirs;
+        long long int size = (long long int)(exp(log_min + (log_max - log_min) * random_fraction(&state)) - 1);
+        uint64_t file_seed = next_random(&state);
+        char name[32];
+        sprintf(name, "file%d.dat", i);
+        tree->bytes += size;
+        for (int r = 0; r < options->num_roots; r++) {
+            // Loop through the roots, writing the first root's copy, and an identical, stale or no copy to the others
+            int kind = 0; // 0 for an identical copy, 1 for a stale one, 2 for none
+            if (r > 0 && random_fraction(&state) < options->differ) {
+                kind = random_fraction(&state) < 0.5 ? 1 : 2;
+                tree->copies++;
+                tree->copy_bytes += size;
+            }
+            if (kind == 2) {
+                continue;
+            }
+            char *dir_path = join_path(roots[r], tree->dirs[dir]);
+            char *path = join_path(dir_path, name);
+            if (kind == 0) {
+                write_file(path, size, file_seed, BENCH_BASE_TIME + i, buffer, buffer_size);
+            } else {
+                write_file(path, size, ~file_seed, BENCH_BASE_TIME + i - BENCH_STALE_AGE, buffer, buffer_size);
+            }
+            free(path);
+            free(dir_path);
+        }
+    }
+    for (int r = 0; r < options->num_roots; r++) {
+        free(roots[r]);
+    }
+    free(roots);
+    free(buffer);
+}
+
+void drop_page_cache(void) {
+    // A function that writes back and drops the page cache (warning once if it can't be dropped)
+    static bool warned = false;
+    sync();
+    FILE *file = fopen("/proc/sys/vm/drop_caches", "w");
+    if (file == NULL || fputs("3\n", file) == EOF || fclose(file) == EOF) {
+        if (!warned) {
+            fprintf(stderr, "Warning: could not drop the page cache, so runs may be warm\n");
+            warned = true;
+        }
+    }
+}
+
+Bench_run time_sync(char *trees_dir, char *root_prefix, bool dry_run, Bench_options *options) {
+    // A function that takes the directory the trees are in, the prefix of the roots to sync, whether to pass -n, and the options of the benchmark, and runs mysync on the roots, returning its wall time and peak memory
+    int argc = 0;
+    char **argv = malloc_data((options->num_sync_args + options->num_roots + 4) * sizeof(char *));
+    argv[argc++] = options->mysync;
+    argv[argc++] = dry_run ? "-rpn" : "-rp"; // -p keeps the copies' modification times, so the tree is in sync after one run (without it, every run copies the newest copies back the other way)
+    for (int i = 0; i < options->num_sync_args; i++) {
+        argv[argc++] = options->sync_args[i];
+    }
+    for (int r = 0; r < options->num_roots; r++) {
+        char name[64];
+        sprintf(name, "%s%d", root_prefix, r + 1);
+        argv[argc++] = join_path(trees_dir, name);
+    }
+    argv[argc] = NULL;
+    if (options->drop_caches) {
+        drop_page_cache();
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // In the child, throw away mysync's output and run it
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (pid == -1 || wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        // If mysync failed, print an error message and exit the program
+        fprintf(stderr, "Error: \"%s\" failed on %s\n", options->mysync, trees_dir);
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (int i = argc - options->num_roots; i < argc; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+    Bench_run run = {(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, usage.ru_maxrss};
+    return run;
+}
+
+int compare_runs(const void *a, const void *b) {
+    // A function that compares two runs by their wall time (for sorting)
+    double difference = ((Bench_run *)a)->seconds - ((Bench_run *)b)->seconds;
+    return difference < 0 ? -1 : difference > 0;
+}
+
+void phase_rates(int phase, Bench_run *run, Bench_tree *tree, Bench_options *options, double *items_per_second, double *mb_per_second) {
+    // A function that takes a phase, its run, the tree, and the options of the benchmark, and works out the phase's rate of items (entries checked, directories created or copies written) and of megabytes written
+    double items = 0;
+    double bytes = 0;
+    if (phase == 0 || phase == 3) {
+        items = (double)options->num_files * options->num_roots; // Every copy of every file is checked
+    } else if (phase == 1) {
+        items = (double)(tree->num_dirs - 1) * (options->num_roots - 1); // Every directory but the root is created in every root but the first
+    } else {
+        items = tree->copies;
+        bytes = tree->copy_bytes;
+    }
+    *items_per_second = run->seconds > 0 ? items / run->seconds : 0;
+    *mb_per_second = run->seconds > 0 ? bytes / 1e6 / run->seconds : 0;
+}
+
+void write_results(Bench_run medians[], Bench_tree *tree, Bench_options *options) {
+    // A function that takes the median run of each phase, the tree, and the options of the benchmark, and appends the results to the results file as one line of JSON
+    FILE *file = fopen(options->results_path, "a");
+    if (file == NULL) {
+        fprintf(stderr, "Error: could not open results file %s\n", options->results_path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "{\"label\": \"%s\", \"time\": %lld, \"files\": %d, \"dirs\": %d, \"bytes\": %lld, \"min_size\": %lld, \"max_size\": %lld, \"depth\": %d, \"fan_out\": %d, \"roots\": %d, \"differ\": %g, \"seed\": %llu, \"repetitions\": %d, \"cold\": %s, \"args\": \"",
+            options->label, (long long int)time(NULL), options->num_files, tree->num_dirs, tree->bytes, options->min_size, options->max_size, options->depth, options->fan_out, options->num_roots,
+            options->differ, (unsigned long long int)options->seed, options->repetitions, options->drop_caches ? "true" : "false");
+    for (int i = 0; i < options->num_sync_args; i++) {
+        fprintf(file, "%s%s", i == 0 ? "" : " ", options->sync_args[i]);
+    }
+    fprintf(file, "\", \"copies\": %lld, \"copy_bytes\": %lld, \"phases\": {", tree->copies, tree->copy_bytes);
+    for (int phase = 0; phase < BENCH_NUM_PHASES; phase++) {
+        double items_per_second, mb_per_second;
+        phase_rates(phase, &medians[phase], tree, options, &items_per_second, &mb_per_second);
+        fprintf(file, "%s\"%s\": {\"seconds\": %.6f, \"items_per_second\": %.1f, \"mb_per_second\": %.2f, \"peak_rss_kib\": %ld}", phase == 0 ? "" : ", ", phase_names[phase],
+                medians[phase].seconds, items_per_second, mb_per_second, medians[phase].peak_rss_kib);
+    }
+    fprintf(file, "}}\n");
+    fclose(file);
+}
+
+void usage_error(char *message, char *value) {
+    // A function that takes an error message and the value it is about, and prints them and exits the program
+    fprintf(stderr, "Error: %s \"%s\"\n", message, value);
+    exit(EXIT_FAILURE);
+}
+
+long long int parse_bench_size(char *size_string) {
+    // A function that takes a size with an optional K, M or G suffix, and returns it in bytes (or -1 if it isn't a valid size)
+    char *end;
+    long long int size = strtoll(size_string, &end, 10);
+    if (end == size_string || size < 0) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size <<= 20;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        size <<= 30;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+int main(int argc, char **argv) {
+    Bench_options options = {"./mysync", "/tmp/mysync-bench", "bench/results.jsonl", "", 10000, 512, 64 << 10, 3, 8, 2, 0.5, 1, 3, false, false, false, NULL, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:o:l:n:s:d:f:r:x:S:R:Ckg")) != -1) {
+        // Loop through the options
+        switch (opt) {
+            case 'm':
+                // Set the mysync binary to time
+                options.mysync = optarg;
+                break;
+            case 'w':
+                // Set the directory to generate the trees in
+                options.work_dir = optarg;
+                break;
+            case 'o':
+                // Set the file to append the results to
+                options.results_path = optarg;
+                break;
+            case 'l':
+                // Set the label saved with the results
+                options.label = optarg;
+                break;
+            case 'n':
+                // Set the number of files
+                options.num_files = atoi(optarg);
+                if (options.num_files < 1) {
+                    usage_error("invalid number of files", optarg);
+                }
+                break;
+            case 's': {
+                // Set the size of the files (either one size, or the smallest and largest sizes separated by a '-')
+                char *dash = strchr(optarg, '-');
+                if (dash != NULL) {
+                    *dash = '\0';
+                }
+                options.min_size = parse_bench_size(optarg);
+                options.max_size = dash == NULL ? options.min_size : parse_bench_size(dash + 1);
+                if (options.min_size < 0 || options.max_size < options.min_size) {
+                    usage_error("invalid file size", optarg);
+                }
+                break;
+            }
+            case 'd':
+                // Set the number of levels of directories
+                options.depth = atoi(optarg);
+                if (options.depth < 0) {
+                    usage_error("invalid depth", optarg);
+                }
+                break;
+            case 'f':
+                // Set the number of subdirectories of each directory
+                options.fan_out = atoi(optarg);
+                if (options.fan_out < 1) {
+                    usage_error("invalid fan-out", optarg);
+                }
+                break;
+            case 'r':
+                // Set the number of roots
+                options.num_roots = atoi(optarg);
+                if (options.num_roots < 2) {
+                    usage_error("invalid number of roots", optarg);
+                }
+                break;
+            case 'x':
+                // Set the fraction of files that differ in each root but the first
+                options.differ = atof(optarg);
+                if (options.differ < 0 || options.differ > 1) {
+                    usage_error("invalid fraction", optarg);
+                }
+                break;
+            case 'S':
+                // Set the seed the tree is generated from
+                options.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'R':
+                // Set the number of repetitions
+                options.repetitions = atoi(optarg);
+                if (options.repetitions < 1) {
+                    usage_error("invalid number of repetitions", optarg);
+                }
+                break;
+            case 'C':
+                // Drop the page cache before each run
+                options.drop_caches = true;
+                break;
+            case 'k':
+                // Keep the work directory
+                options.keep = true;
+                break;
+            case 'g':
+                // Only generate the tree
+                options.generate_only = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-m mysync] [-w dir] [-o results] [-l label] [-n files] [-s size or min-max] [-d depth] [-f fan-out] [-r roots] [-x fraction] [-S seed] [-R repetitions] [-C] [-k] [-g] [-- mysync flags]\n", argv[0]);
+                return 1;
+        }
+    }
+    options.sync_args = argv + optind; // Everything after the options (and after "--") is passed to mysync
+    options.num_sync_args = argc - optind;
+    if (!options.generate_only && access(options.mysync, X_OK) == -1) {
+        usage_error("cannot run mysync binary", options.mysync);
+    }
+    make_directory(options.work_dir);
+    char *trees_dir = join_path(options.work_dir, "trees");
+    Bench_tree tree;
+    build_dirs(&tree, &options);
+    if (options.generate_only) {
+        // If -g was passed, only generate the tree (once) and leave it for another tool
+        generate_tree(&tree, trees_dir, &options);
+        printf("Generated %d files (%.1f MB) in %d directories in each of %d roots in %s (the first sync writes %lld copies, %.1f MB)\n", options.num_files, tree.bytes / 1e6, tree.num_dirs, options.num_roots, trees_dir,
+               tree.copies, tree.copy_bytes / 1e6);
+        return 0;
+    }
+    Bench_run *runs = malloc_data(BENCH_NUM_PHASES * options.repetitions * sizeof(Bench_run)); // The runs of each phase (phase-major)
+    for (int rep = 0; rep < options.repetitions; rep++) {
+        // Loop through the repetitions, generating the tree afresh for each (the copy phase changes it) and timing each phase
+        generate_tree(&tree, trees_dir, &options);
+        runs[0 * options.repetitions + rep] = time_sync(trees_dir, "root", true, &options);
+        runs[1 * options.repetitions + rep] = time_sync(trees_dir, "skeleton", false, &options);
+        runs[2 * options.repetitions + rep] = time_sync(trees_dir, "root", false, &options);
+        runs[3 * options.repetitions + rep] = time_sync(trees_dir, "root", false, &options);
+    }
+    Bench_run medians[BENCH_NUM_PHASES];
+    printf("%d files (%.1f MB) in %d directories, %d roots, %.0f%% differing, %d repetitions%s\n", options.num_files, tree.bytes / 1e6, tree.num_dirs, options.num_roots, options.differ * 100, options.repetitions,
+           options.drop_caches ? ", cold cache" : "");
+    printf("%-8s %10s %14s %10s %14s\n", "phase", "seconds", "items/s", "MB/s", "peak RSS KiB");
+    for (int phase = 0; phase < BENCH_NUM_PHASES; phase++) {
+        // Loop through the phases, printing the median run of each
+        qsort(runs + phase * options.repetitions, options.repetitions, sizeof(Bench_run), compare_runs);
+        medians[phase] = runs[phase * options.repetitions + options.repetitions / 2];
+        double items_per_second, mb_per_second;
+        phase_rates(phase, &medians[phase], &tree, &options, &items_per_second, &mb_per_second);
+        printf("%-8s %10.3f %14.0f %10.1f %14ld\n", phase_names[phase], medians[phase].seconds, items_per_second, mb_per_second, medians[phase].peak_rss_kib);
+    }
+    write_results(medians, &tree, &options);
+    printf("Results appended to %s\n", options.results_path);
+    if (!options.keep) {
+        remove_tree(trees_dir);
+    }
+    free(runs);
+    for (int i = 0; i < tree.num_dirs; i++) {
+        free(tree.dirs[i]);
+    }
+    free(tree.dirs);
+    free(trees_dir);
+    return 0;
+}
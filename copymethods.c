@@ -0,0 +1,320 @@
+#include "mysync.h"
+
+// A C file that copies file data inside the kernel where the filesystems allow it
+// The fastest method for each pair of filesystems is found the first time a file is copied between them, and remembered for the rest of the run
+
+Copy_probe *copy_probes = NULL; // An array of the methods found for each pair of filesystems
+int num_copy_probes = 0;
+int copy_probes_capacity = 0;
+pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the probe array (files are copied on several threads)
+
+char *copy_method_names[] = {"auto", "reflink", "copy_file_range", "splice", "sendfile", "readwrite", "io_uring"}; // The names of the copy methods (indexed by method)
+
+int parse_copy_method(char *name) {
+    // A function that takes the name of a copy method, and returns the method (or -1 if there is no method with that name)
+    for (int i = COPY_AUTO; i <= COPY_READ_WRITE; i++) {
+        // Loop through the method names
+        if (strcmp(name, copy_method_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+char *copy_method_name(int method) {
+    // A function that takes a copy method, and returns its name
+    return copy_method_names[method];
+}
+
+int probe_copy_method(dev_t src_dev, dev_t dst_dev) {
+    // A function that takes the devices of a source and destination file, and returns the fastest method that hasn't been ruled out between their filesystems
+    pthread_mutex_lock(&probe_lock);
+    for (int i = 0; i < num_copy_probes; i++) {
+        // Loop through the pairs of filesystems that have already been probed
+        if (copy_probes[i].src_dev == src_dev && copy_probes[i].dst_dev == dst_dev) {
+            int method = copy_probes[i].method;
+            pthread_mutex_unlock(&probe_lock);
+            return method;
+        }
+    }
+    if (num_copy_probes == copy_probes_capacity) {
+        // If the probe array is full, double its size
+        copy_probes_capacity = copy_probes_capacity == 0 ? 4 : copy_probes_capacity * 2;
+        copy_probes = realloc(copy_probes, copy_probes_capacity * sizeof(Copy_probe));
+        if (copy_probes == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The pair hasn't been seen before, so start by trying the fastest method (a reflink)
+    copy_probes[num_copy_probes].src_dev = src_dev;
+    copy_probes[num_copy_probes].dst_dev = dst_dev;
+    copy_probes[num_copy_probes].method = COPY_REFLINK;
+    num_copy_probes++;
+    pthread_mutex_unlock(&probe_lock);
+    return COPY_REFLINK;
+}
+
+void rule_out_copy_method(dev_t src_dev, dev_t dst_dev, int method) {
+    // A function that takes the devices of a source and destination file and a method that failed between them, and moves the pair on to the next fastest method
+    pthread_mutex_lock(&probe_lock);
+    for (int i = 0; i < num_copy_probes; i++) {
+        // Loop through the probed pairs and find this one
+        if (copy_probes[i].src_dev == src_dev && copy_probes[i].dst_dev == dst_dev && copy_probes[i].method == method) {
+            copy_probes[i].method = method + 1; // The methods are ordered from fastest to slowest, ending with the buffered loop that always works
+        }
+    }
+    pthread_mutex_unlock(&probe_lock);
+}
+
+bool copy_method_unsupported(int error) {
+    // A function that takes an errno value from a copy method, and returns true if it means the method isn't supported for these files (rather than a real I/O error)
+    return error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == ENOTSUP || error == ENOSYS || error == ENOTTY || error == EBADF || error == ETXTBSY;
+}
+
+bool write_all(int fd, char *buffer, size_t length, off_t offset) {
+    // A function that takes a file descriptor, a buffer, a length, and an offset, and writes the whole buffer at that offset (retrying short writes), returning false if a write fails
+    while (length > 0) {
+        ssize_t bytes_written = pwrite(fd, buffer, length, offset);
+        if (bytes_written == -1) {
+            if (errno == EINTR) {
+                // If the write was interrupted, try it again
+                continue;
+            }
+            return false;
+        }
+        // Move past the bytes that were written
+        buffer += bytes_written;
+        length -= bytes_written;
+        offset += bytes_written;
+    }
+    return true;
+}
+
+long long int copy_range(int method, int src_fd, int dst_fd, off_t offset, long long int length) {
+    // A function that takes a copy method, a source and destination file descriptor, an offset, and a length, and copies that range of the source to the same offset in the destination (stopping early at the end of the source), returning the number of bytes copied or -1 if the method failed
+    if (method == COPY_REFLINK) {
+        // Share the source's blocks with the destination (only works within one btrfs/XFS style filesystem)
+        if (offset == 0 && length == LLONG_MAX) {
+            // If the whole file is being copied, clone all of it
+            if (ioctl(dst_fd, FICLONE, src_fd) == -1) {
+                return -1;
+            }
+            struct stat file_info;
+            return fstat(dst_fd, &file_info) == -1 ? -1 : file_info.st_size;
+        }
+        struct file_clone_range range = {.src_fd = src_fd, .src_offset = offset, .src_length = length, .dest_offset = offset}; // A range of the source to clone
+        return ioctl(dst_fd, FICLONERANGE, &range) == -1 ? -1 : length;
+    }
+    long long int copied = 0; // The number of bytes copied so far
+    while (copied < length) {
+        // Loop until the range is copied or the end of the source is reached
+        size_t chunk = length - copied > 0x40000000 ? 0x40000000 : length - copied; // Copy at most 1GiB per call
+        ssize_t result;
+        if (method == COPY_FILE_RANGE) {
+            // Copy the range inside the kernel (which may also share or offload the blocks)
+            off_t src_offset = offset + copied;
+            off_t dst_offset = offset + copied;
+            result = copy_file_range(src_fd, &src_offset, dst_fd, &dst_offset, chunk, 0);
+        } else if (method == COPY_SENDFILE) {
+            // Copy the range through the page cache without going through user space
+            off_t src_offset = offset + copied;
+            if (lseek(dst_fd, offset + copied, SEEK_SET) == -1) {
+                return -1;
+            }
+            result = sendfile(dst_fd, src_fd, &src_offset, chunk);
+        } else {
+            // Copy the range through a buffer in user space
+            char buffer[65536];
+            result = pread(src_fd, buffer, chunk < sizeof(buffer) ? chunk : sizeof(buffer), offset + copied);
+            if (result > 0 && !write_all(dst_fd, buffer, result, offset + copied)) {
+                return -1;
+            }
+        }
+        if (result == -1) {
+            if (errno == EINTR) {
+                // If the call was interrupted, try it again
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0) {
+            // If the end of the source has been reached, stop copying
+            break;
+        }
+        copied += result;
+    }
+    return copied;
+}
+
+bool has_holes(struct stat *file_info) {
+    // A function that takes a file's info, and returns true if the file has holes (fewer blocks are allocated to it than its size needs)
+    return (long long int)file_info->st_blocks * 512 < (long long int)file_info->st_size;
+}
+
+bool next_data_extent(int fd, long long int offset, long long int size, long long int *start, long long int *end) {
+    // A function that takes a file descriptor, an offset, and the size of the file, and finds the next range of data at or after the offset (skipping any hole), returning false if there is no more data before the end of the file
+    off_t data = lseek(fd, offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO) {
+        // If there is only a hole left, there is no more data
+        return false;
+    }
+    if (data == -1) {
+        // If the filesystem can't find holes, treat the rest of the file as data
+        *start = offset;
+        *end = size;
+        return offset < size;
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE); // The end of the data (every file ends with a hole, so this is the size at most)
+    *start = data;
+    *end = hole == -1 || hole > size ? size : hole;
+    return *start < *end;
+}
+
+long long int copy_extents(int method, int src_fd, int dst_fd, long long int size) {
+    // A function that takes a copy method, a source file descriptor with holes, a destination file descriptor, and the size of the source, and copies only the ranges of data in the source, leaving holes in the destination where the source has them, returning the number of bytes copied or -1 if the method failed
+    if (method == COPY_REFLINK) {
+        // A reflink shares the source's blocks as they are, so it keeps the holes by itself
+        return copy_range(method, src_fd, dst_fd, 0, LLONG_MAX);
+    }
+    long long int copied = 0; // The number of bytes of data copied
+    long long int start, end;
+    for (long long int offset = 0; next_data_extent(src_fd, offset, size, &start, &end); offset = end) {
+        // Loop through the ranges of data in the source, copying each to the same offset in the destination
+        long long int result = copy_range(method, src_fd, dst_fd, start, end - start);
+        if (result == -1) {
+            return -1;
+        }
+        copied += result;
+    }
+    if (ftruncate(dst_fd, size) == -1) {
+        // Extend the destination to the size of the source (so a hole at the end is kept too)
+        return -1;
+    }
+    return copied;
+}
+
+size_t zero_run_end(char *buffer, size_t start, size_t length) {
+    // A function that takes a buffer, a block-aligned offset in it, and its length, and returns the end of the run of blocks of zeros starting at the offset (the offset itself if its block isn't all zeros)
+    size_t position = start;
+    while (position < length) {
+        // Loop through the blocks, stopping at the first that has data in it
+        size_t block = length - position < SPARSE_BLOCK_SIZE ? length - position : SPARSE_BLOCK_SIZE;
+        if (buffer[position] != 0 || (block > 1 && memcmp(buffer + position, buffer + position + 1, block - 1) != 0)) {
+            // A block is all zeros if its first byte is zero and every byte equals the one after it
+            break;
+        }
+        position += block;
+    }
+    return position;
+}
+
+size_t data_run_end(char *buffer, size_t start, size_t length) {
+    // A function that takes a buffer, an offset in it, and its length, and returns the end of the run of blocks with data in them from the block holding the offset (the start of the next block of zeros, or the length)
+    size_t position = start - start % SPARSE_BLOCK_SIZE;
+    while (position < length && zero_run_end(buffer, position, length) == position) {
+        // Loop through the blocks until one is all zeros
+        position += SPARSE_BLOCK_SIZE;
+    }
+    return position < length ? position : length;
+}
+
+bool write_sparse(int fd, char *buffer, size_t length, off_t offset, long long int *written) {
+    // A function that takes a file descriptor, a buffer, a length, an offset, and a count of bytes written, and writes the buffer at that offset except for its blocks of zeros, which are left as holes (the file must be extended to its full size once it is written), adding the bytes it writes to the count, returning false if a write fails
+    size_t position = 0;
+    while (position < length) {
+        // Loop through the buffer, skipping each run of zero blocks and writing each run of blocks with data
+        size_t zeros_end = zero_run_end(buffer, position, length);
+        if (zeros_end > position) {
+            position = zeros_end;
+            continue;
+        }
+        size_t data_end = data_run_end(buffer, position, length);
+        if (!write_all(fd, buffer + position, data_end - position, offset + position)) {
+            return false;
+        }
+        *written += data_end - position;
+        position = data_end;
+    }
+    return true;
+}
+
+bool splice_to_file(int pipe_fd, int dst_fd, off_t offset, size_t length) {
+    // A function that takes the read end of a pipe, a destination file descriptor, an offset, and a length, and splices that many bytes out of the pipe to the offset in the destination, returning false if a splice fails
+    while (length > 0) {
+        ssize_t result = splice(pipe_fd, NULL, dst_fd, &offset, length, SPLICE_F_MOVE | SPLICE_F_MORE); // Splice updates the offset itself
+        if (result == -1 && errno == EINTR) {
+            // If the splice was interrupted, try it again
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        length -= result;
+    }
+    return true;
+}
+
+bool splice_fanout(int src_fd, int *dst_fds, int num_dst_fds) {
+    // A function that takes a source file descriptor and an array of destination file descriptors, and copies the source to every destination by splicing it into a pipe once and teeing the pipe to the others, returning false if splicing isn't supported (errno is set)
+    int (*pipes)[2] = malloc_data(num_dst_fds * sizeof(int[2])); // Allocate memory for one pipe per destination (the first pipe is fed from the source, the rest are tees of it)
+    int num_pipes = 0;
+    bool success = true;
+    for (; num_pipes < num_dst_fds; num_pipes++) {
+        // Loop through the destinations and create a pipe for each of them
+        if (pipe(pipes[num_pipes]) == -1) {
+            success = false;
+            break;
+        }
+        fcntl(pipes[num_pipes][1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // Ask for a bigger pipe so each round moves more data (the kernel may give less, which is fine)
+    }
+    // The chunk moved each round can't be more than the smallest pipe holds, or a tee could come up short
+    size_t chunk = SPLICE_PIPE_SIZE;
+    for (int i = 0; success && i < num_pipes; i++) {
+        int pipe_size = fcntl(pipes[i][1], F_GETPIPE_SZ);
+        if (pipe_size > 0 && (size_t)pipe_size < chunk) {
+            chunk = pipe_size;
+        }
+    }
+    loff_t src_offset = 0; // The offset reached in the source
+    while (success) {
+        // Loop through the source a pipe's worth at a time
+        ssize_t bytes_spliced = splice(src_fd, &src_offset, pipes[0][1], NULL, chunk, SPLICE_F_MORE); // Move the next chunk of the source into the first pipe (only the page references are copied)
+        if (bytes_spliced == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_spliced <= 0) {
+            // If the end of the source was reached the copy is done, otherwise splicing failed
+            success = bytes_spliced == 0;
+            break;
+        }
+        off_t offset = src_offset - bytes_spliced; // The offset of the chunk in the source (and every destination)
+        for (int i = 1; success && i < num_dst_fds; i++) {
+            // Loop through the other pipes and tee the chunk into each of them (without consuming it from the first pipe)
+            ssize_t bytes_teed;
+            do {
+                bytes_teed = tee(pipes[0][0], pipes[i][1], bytes_spliced, 0);
+            } while (bytes_teed == -1 && errno == EINTR);
+            if (bytes_teed != bytes_spliced) {
+                // If the tee came up short the chunk can't be fanned out, so give up on splicing
+                success = false;
+                if (bytes_teed >= 0) {
+                    errno = EINVAL;
+                }
+                break;
+            }
+            success = splice_to_file(pipes[i][0], dst_fds[i], offset, bytes_spliced); // Drain the tee into its destination
+        }
+        success = success && splice_to_file(pipes[0][0], dst_fds[0], offset, bytes_spliced); // Finally drain the first pipe into the first destination
+    }
+    int saved_errno = errno; // Closing the pipes mustn't hide why splicing failed
+    for (int i = 0; i < num_pipes; i++) {
+        // Loop through the pipes and close them
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+    errno = saved_errno;
+    return success;
+}
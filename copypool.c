@@ -0,0 +1,124 @@
+#include "mysync.h"
+
+// A C file that syncs files on a bounded pool of worker threads
+// The file loop in sync_directories submits one job per file, and blocks while too many jobs (or too many bytes) are already waiting or being copied
+
+Copy_job *job_head = NULL; // A queue of files waiting to be synced (taken from the head so files are started in the order they were submitted)
+Copy_job *job_tail = NULL;
+int queued_jobs = 0; // The number of jobs waiting in the queue
+int running_jobs = 0; // The number of jobs being synced by a worker
+long long int inflight_bytes = 0; // The total size of the master files of every queued and running job
+bool pool_closing = false; // A bool that represents whether every job has been submitted (so idle workers can exit)
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the queue and the counters above
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER; // A condition that is signalled when a job is queued or the pool is closing
+pthread_cond_t job_done = PTHREAD_COND_INITIALIZER; // A condition that is signalled when a job finishes (making room for more)
+
+pthread_t *copy_workers = NULL; // The worker threads (NULL if the files are synced on the calling thread)
+int num_copy_workers = 0;
+char **pool_directories = NULL; // The array of directory names every job is synced across
+int pool_num_directories = 0;
+Flags *pool_flags = NULL;
+
+void *copy_worker(void *arg) {
+    // A function that is run by each worker thread, syncing files from the queue until the pool is closed and the queue is empty
+    while (true) {
+        pthread_mutex_lock(&pool_lock);
+        while (job_head == NULL && !pool_closing) {
+            // Wait until a job is queued or the pool is closing
+            pthread_cond_wait(&job_ready, &pool_lock);
+        }
+        if (job_head == NULL) {
+            // If the queue is empty and the pool is closing, there is nothing left to do
+            pthread_mutex_unlock(&pool_lock);
+            release_thread_uring(); // Free the worker's io_uring (if it had one)
+            return NULL;
+        }
+        Copy_job *job = job_head; // Take the job at the head of the queue
+        job_head = job->next;
+        if (job_head == NULL) {
+            job_tail = NULL;
+        }
+        queued_jobs--;
+        running_jobs++;
+        pthread_mutex_unlock(&pool_lock);
+        // Sync the file (the -p steps are run by sync_master once the data has been copied, so they are still applied after each file is complete)
+        sync_master(job->file, job->relpath, pool_directories, pool_num_directories, pool_flags);
+        pthread_mutex_lock(&pool_lock);
+        running_jobs--;
+        inflight_bytes -= job->file->size; // The job's bytes are no longer in flight
+        pthread_cond_broadcast(&job_done); // Wake the submitter (and anyone waiting for the pool to drain)
+        pthread_mutex_unlock(&pool_lock);
+        free(job);
+    }
+}
+
+void start_copy_pool(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and starts flags->num_threads workers to sync files across the directories
+    pool_directories = directories;
+    pool_num_directories = num_directories;
+    pool_flags = flags;
+    pool_closing = false;
+    if (flags->num_threads <= 1) {
+        // If only one thread was asked for, files are synced on the calling thread as they are submitted
+        return;
+    }
+    num_copy_workers = flags->num_threads;
+    copy_workers = malloc_data(num_copy_workers * sizeof(pthread_t)); // Allocate memory for the worker threads
+    for (int i = 0; i < num_copy_workers; i++) {
+        // Loop through the workers and start each of them
+        if (pthread_create(&copy_workers[i], NULL, copy_worker, NULL) != 0) {
+            // If a thread could not be created, print an error message and exit the program
+            fprintf(stderr, "Error: could not create copy thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void submit_copy(File *file, char *relpath) {
+    // A function that takes a master file and its relative path, and queues it to be synced, waiting while the pool is full
+    if (copy_workers == NULL) {
+        // If there are no workers, sync the file straight away
+        sync_master(file, relpath, pool_directories, pool_num_directories, pool_flags);
+        return;
+    }
+    Copy_job *job = malloc_data(sizeof(Copy_job) + strlen(relpath) + 1); // Allocate memory for the job and its copy of the relative path
+    job->file = file;
+    strcpy(job->relpath, relpath);
+    job->next = NULL;
+    pthread_mutex_lock(&pool_lock);
+    while (queued_jobs + running_jobs > 0 && (queued_jobs >= MAX_QUEUED_JOBS || inflight_bytes + file->size > MAX_INFLIGHT_BYTES)) {
+        // Wait while the queue is full or the job would put too many bytes in flight (a job bigger than the cap is still let through once the pool is empty)
+        pthread_cond_wait(&job_done, &pool_lock);
+    }
+    if (job_tail == NULL) {
+        // If the queue is empty, the job becomes the head and tail of the queue
+        job_head = job;
+    } else {
+        // Otherwise add the job to the end of the queue
+        job_tail->next = job;
+    }
+    job_tail = job;
+    queued_jobs++;
+    inflight_bytes += file->size;
+    pthread_cond_signal(&job_ready); // Wake an idle worker
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void finish_copy_pool(void) {
+    // A function that waits for every submitted file to be synced, and stops the workers
+    if (copy_workers == NULL) {
+        // If there are no workers, every file has already been synced
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    pool_closing = true; // No more jobs are coming, so workers exit once the queue is empty
+    pthread_cond_broadcast(&job_ready);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < num_copy_workers; i++) {
+        // Loop through the workers and wait for each of them to finish
+        pthread_join(copy_workers[i], NULL);
+    }
+    free(copy_workers);
+    copy_workers = NULL;
+    num_copy_workers = 0;
+}
@@ -0,0 +1,321 @@
+#include "mysync.h"
+
+// A C file that brings a stale copy of a large file up to date by rewriting only the parts that differ from the master file (the rsync algorithm, with both files local)
+// The copy is cut into blocks, and each block gets a weak checksum that can be rolled along the master file one byte at a time and a strong hash that confirms a match
+// The master file is then searched for those blocks at every offset, so data that has only moved (after an insertion or deletion) is still found
+
+long long int parse_size(char *size_string) {
+    // A function that takes a size with an optional K, M or G suffix (e.g. "64M"), and returns it in bytes (or -1 if it isn't a valid size)
+    char *end;
+    long long int size = strtoll(size_string, &end, 10);
+    if (end == size_string || size < 0) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        size *= 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size *= 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        size *= 1024 * 1024 * 1024;
+        end++;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+uint32_t weak_checksum(unsigned char *data, long long int length) {
+    // A function that takes a block of data, and returns its weak checksum (two 16-bit sums, the second weighted by position, so the checksum can be rolled)
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (long long int i = 0; i < length; i++) {
+        a += data[i];
+        b += (length - i) * data[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+uint64_t strong_hash(unsigned char *data, long long int length) {
+    // A function that takes a block of data, and returns a 64-bit hash of it (read a word at a time, with every bit of the result depending on every bit of the data)
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (uint64_t)length;
+    long long int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        // Loop through the data eight bytes at a time, mixing each word in
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word *= 0x87c37b91114253d5ULL;
+        word = (word << 31) | (word >> 33);
+        hash ^= word * 0x4cf5ad432745937fULL;
+        hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52dce729;
+    }
+    for (; i < length; i++) {
+        // Mix in the bytes left over at the end
+        hash ^= data[i] * 0x9e3779b97f4a7c15ULL;
+        hash = ((hash << 11) | (hash >> 53)) * 0x87c37b91114253d5ULL;
+    }
+    // Finish with an avalanche, so similar blocks don't give similar hashes
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+long long int delta_block_size(long long int size) {
+    // A function that takes the size of a file, and returns the block size to compare it in (about the square root of the size, which balances the number of checksums against the amount rewritten around each change)
+    long long int block_size = DELTA_MIN_BLOCK_SIZE;
+    while (block_size * block_size < size && block_size < DELTA_MAX_BLOCK_SIZE) {
+        block_size *= 2;
+    }
+    return block_size;
+}
+
+void add_match(Delta_match **matches, int *num_matches, int *capacity, long long int old_offset, long long int new_offset, long long int length) {
+    // A function that takes a growing array of matches, and adds a block of the master file that was found in the copy (joining it to the previous match if it carries straight on from it)
+    if (*num_matches > 0) {
+        Delta_match *last = &(*matches)[*num_matches - 1];
+        if (last->old_offset + last->length == old_offset && last->new_offset + last->length == new_offset) {
+            last->length += length;
+            return;
+        }
+    }
+    if (*num_matches == *capacity) {
+        // If the array is full, double its size
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *matches = realloc(*matches, *capacity * sizeof(Delta_match));
+        if (*matches == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*matches)[*num_matches].old_offset = old_offset;
+    (*matches)[*num_matches].new_offset = new_offset;
+    (*matches)[*num_matches].length = length;
+    (*num_matches)++;
+}
+
+Delta_match *find_matches(unsigned char *master, long long int master_size, unsigned char *copy, long long int copy_size, long long int block_size, int *num_matches) {
+    // A function that takes the master file and the copy (mapped into memory) and a block size, and returns an array of the parts of the master file that are already somewhere in the copy (in master file order)
+    int num_blocks = copy_size / block_size; // Only whole blocks are compared (a short last block is rewritten if it changed)
+    uint32_t *weak = malloc_data((num_blocks + 1) * sizeof(uint32_t)); // The weak checksum of each block of the copy
+    uint64_t *strong = malloc_data((num_blocks + 1) * sizeof(uint64_t)); // The strong hash of each block of the copy
+    int table_size = 1; // The number of buckets in the table of weak checksums (a power of two)
+    while (table_size < num_blocks * 2) {
+        table_size *= 2;
+    }
+    int *buckets = malloc_data(table_size * sizeof(int)); // The first block in each bucket (-1 if it is empty)
+    int *next_block = malloc_data((num_blocks + 1) * sizeof(int)); // The next block in the same bucket
+    for (int i = 0; i < table_size; i++) {
+        buckets[i] = -1;
+    }
+    for (int i = num_blocks - 1; i >= 0; i--) {
+        // Loop through the blocks of the copy backwards (so each bucket lists its blocks in file order) and checksum each of them
+        weak[i] = weak_checksum(copy + (long long int)i * block_size, block_size);
+        strong[i] = strong_hash(copy + (long long int)i * block_size, block_size);
+        int bucket = (weak[i] ^ (weak[i] >> 16)) & (table_size - 1);
+        next_block[i] = buckets[bucket];
+        buckets[bucket] = i;
+    }
+    Delta_match *matches = NULL;
+    int capacity = 0;
+    *num_matches = 0;
+    long long int offset = 0; // The offset of the window in the master file
+    uint32_t a = 0; // The two halves of the weak checksum of the window
+    uint32_t b = 0;
+    bool window_valid = false; // A bool that represents whether a and b hold the checksum of the window at the current offset
+    while (num_blocks > 0 && offset + block_size <= master_size) {
+        // Loop through the master file, sliding a block sized window along it
+        if (!window_valid) {
+            // If the window has just jumped past a match, checksum it from scratch
+            uint32_t checksum = weak_checksum(master + offset, block_size);
+            a = checksum & 0xffff;
+            b = checksum >> 16;
+            window_valid = true;
+        }
+        uint32_t checksum = (a & 0xffff) | (b << 16);
+        int bucket = (checksum ^ (checksum >> 16)) & (table_size - 1);
+        int match = -1; // The block of the copy the window matches (-1 if none)
+        bool hashed = false; // The strong hash of the window is only worked out if a weak checksum matches
+        uint64_t window_hash = 0;
+        for (int i = buckets[bucket]; i != -1; i = next_block[i]) {
+            // Loop through the blocks with a similar weak checksum, and confirm a match with the strong hash
+            if (weak[i] != checksum) {
+                continue;
+            }
+            if (!hashed) {
+                window_hash = strong_hash(master + offset, block_size);
+                hashed = true;
+            }
+            if (strong[i] == window_hash) {
+                match = i;
+                if ((long long int)i * block_size == offset) {
+                    // If the block is at the same offset in the copy, prefer it (it doesn't need to be rewritten at all)
+                    break;
+                }
+            }
+        }
+        if (match != -1) {
+            // If the window matches a block, record it and jump the window past it
+            add_match(&matches, num_matches, &capacity, (long long int)match * block_size, offset, block_size);
+            offset += block_size;
+            window_valid = false;
+            continue;
+        }
+        if (offset + block_size < master_size) {
+            // Otherwise roll the window on by one byte, taking the first byte out of the checksum and the next byte in
+            unsigned char out = master[offset];
+            unsigned char in = master[offset + block_size];
+            a = a - out + in;
+            b = b - block_size * out + (a & 0xffff);
+        }
+        offset++;
+    }
+    free(weak);
+    free(strong);
+    free(buckets);
+    free(next_block);
+    return matches;
+}
+
+bool copy_between(int src_fd, unsigned char *src_map, long long int src_offset, int dst_fd, long long int dst_offset, long long int length) {
+    // A function that takes a source file (and its mapping), a destination file, two offsets, and a length, and copies the range from one offset in the source to the other in the destination (inside the kernel if it can), returning false if a write fails
+    while (length > 0) {
+        loff_t in_offset = src_offset;
+        loff_t out_offset = dst_offset;
+        ssize_t result = copy_file_range(src_fd, &in_offset, dst_fd, &out_offset, length, 0);
+        if (result <= 0) {
+            // If the kernel can't copy the range, write it from the mapping instead
+            return write_all(dst_fd, (char *)src_map + src_offset, length, dst_offset);
+        }
+        src_offset += result;
+        dst_offset += result;
+        length -= result;
+    }
+    return true;
+}
+
+bool delta_copy(File *master_file, char *master_path, char *filepath, Flags *flags) {
+    // A function that takes a master file, its path, a stale copy of it, and a flags struct, and brings the copy up to date by rewriting only the parts that differ, returning false if the copy should be rewritten in full instead
+    int master_fd = open(master_path, O_RDONLY);
+    int copy_fd = open(filepath, O_RDWR);
+    struct stat master_info;
+    struct stat copy_info;
+    if (master_fd == -1 || copy_fd == -1 || fstat(master_fd, &master_info) == -1 || fstat(copy_fd, &copy_info) == -1
+        || master_info.st_size < flags->delta_threshold || copy_info.st_size == 0 || !S_ISREG(copy_info.st_mode)) {
+        // If either file can't be opened, the master file is too small to be worth it, or there is no copy to compare against, copy the file in full
+        if (master_fd != -1) {
+            close(master_fd);
+        }
+        if (copy_fd != -1) {
+            close(copy_fd);
+        }
+        return false;
+    }
+    long long int master_size = master_info.st_size;
+    long long int copy_size = copy_info.st_size;
+    unsigned char *master = mmap(NULL, master_size, PROT_READ, MAP_PRIVATE, master_fd, 0); // Map both files, so the window can slide along the master file without copying it around
+    unsigned char *copy = mmap(NULL, copy_size, PROT_READ, MAP_PRIVATE, copy_fd, 0);
+    if (master == MAP_FAILED || copy == MAP_FAILED) {
+        // If either file can't be mapped, copy the file in full
+        if (master != MAP_FAILED) {
+            munmap(master, master_size);
+        }
+        if (copy != MAP_FAILED) {
+            munmap(copy, copy_size);
+        }
+        close(master_fd);
+        close(copy_fd);
+        return false;
+    }
+    madvise(master, master_size, MADV_SEQUENTIAL);
+    madvise(copy, copy_size, MADV_SEQUENTIAL);
+    long long int block_size = delta_block_size(copy_size);
+    int num_matches;
+    Delta_match *matches = find_matches(master, master_size, copy, copy_size, block_size, &num_matches);
+    long long int unmoved = 0; // The number of bytes found at the same offset in the copy (which can be left where they are)
+    long long int moved = 0; // The number of bytes found at a different offset
+    for (int i = 0; i < num_matches; i++) {
+        if (matches[i].old_offset == matches[i].new_offset) {
+            unmoved += matches[i].length;
+        } else {
+            moved += matches[i].length;
+        }
+    }
+    if (unmoved + moved == 0) {
+        // If nothing in the copy can be reused, a full copy is just as good (and can use a faster method)
+        munmap(master, master_size);
+        munmap(copy, copy_size);
+        close(master_fd);
+        close(copy_fd);
+        free(matches);
+        return false;
+    }
+    bool success = true;
+    long long int rewritten = master_size - unmoved; // The number of bytes written to the copy in place
+    if (flags->atomic_flag || copy_info.st_nlink > 1 || moved > rewritten / 2) {
+        // If most of what would be rewritten in place has only moved (data was inserted or deleted near the start), build the new copy in a temporary file from the moved blocks and the changed data instead, as rewriting in place would overwrite blocks before they are reused (with the --atomic flag the copy is always rebuilt, so it is never seen half updated, and a copy that is a hardlink is always rebuilt, so the other names of its data are left alone)
+        char *temp_path = NULL; // The temporary file path (next to the copy, so it can be renamed over it)
+        int temp_fd;
+        if (flags->atomic_flag) {
+            temp_fd = open_atomic_replica(filepath, &temp_path);
+            success = temp_fd != -1;
+        } else {
+            temp_path = temp_name(filepath); // A hidden name the scan skips, so the rebuilt copy is never synced before it replaces the old one
+            temp_fd = open(temp_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            success = temp_fd != -1 && fchmod(temp_fd, copy_info.st_mode & 07777) == 0;
+        }
+        long long int offset = 0; // The offset reached in the master file
+        for (int i = 0; success && i <= num_matches; i++) {
+            // Loop through the matches, writing the changed data before each one and then the match itself from the old copy
+            long long int next = i < num_matches ? matches[i].new_offset : master_size;
+            success = write_all(temp_fd, (char *)master + offset, next - offset, offset);
+            if (success && i < num_matches) {
+                success = copy_between(copy_fd, copy, matches[i].old_offset, temp_fd, matches[i].new_offset, matches[i].length);
+                next += matches[i].length;
+            }
+            offset = next;
+        }
+        if (flags->atomic_flag && success) {
+            // If the --atomic flag was passed, put the rebuilt copy in place the same way full copies are (with the master file's modification time, and permissions if the -p flag was passed)
+            set_fd_perm_time(temp_fd, filepath, master_file, flags);
+            commit_atomic_replica(temp_fd, filepath, temp_path, master_path, flags);
+        } else {
+            success = success && close(temp_fd) == 0 && rename(temp_path, filepath) == 0;
+            if (!success && temp_fd != -1 && temp_path != NULL) {
+                unlink(temp_path);
+            }
+            free(temp_path);
+        }
+        rewritten = master_size - unmoved - moved;
+        VERBOSE_PRINT("Updated file \"%s\" from master file \"%s\" with delta transfer (%lld of %lld bytes changed, rebuilt in a temporary file)\n", filepath, master_path, rewritten, master_size);
+    } else {
+        // Otherwise write only the changed data over the copy in place, leaving the unmoved blocks untouched
+        long long int offset = 0; // The offset reached in the master file
+        for (int i = 0; success && i <= num_matches; i++) {
+            // Loop through the unmoved matches, writing the data between each of them
+            if (i < num_matches && matches[i].old_offset != matches[i].new_offset) {
+                continue;
+            }
+            long long int next = i < num_matches ? matches[i].new_offset : master_size;
+            success = write_all(copy_fd, (char *)master + offset, next - offset, offset);
+            offset = i < num_matches ? next + matches[i].length : next;
+        }
+        success = success && ftruncate(copy_fd, master_size) == 0; // Cut the copy down to the size of the master file (if it was longer)
+        VERBOSE_PRINT("Updated file \"%s\" from master file \"%s\" with delta transfer (%lld of %lld bytes rewritten in place)\n", filepath, master_path, rewritten, master_size);
+    }
+    if (!success) {
+        // If a write failed, print an error message and exit the program
+        fprintf(stderr, "Error: could not update file \"%s\" from master file \"%s\"\n", filepath, master_path);
+        exit(EXIT_FAILURE);
+    }
+    add_stat(STAT_DELTA_COPIES, 1);
+    add_stat(STAT_BYTES_WRITTEN, rewritten);
+    munmap(master, master_size);
+    munmap(copy, copy_size);
+    close(master_fd);
+    close(copy_fd);
+    free(matches);
+    return true;
+}
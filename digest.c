@@ -0,0 +1,318 @@
+#include "mysync.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A C file that hashes the contents of files, so the -c flag can tell whether copies really differ and --verify can check copies after they are written
+// The hash follows the design of XXH3: eight 64-bit lanes are fed 64 bytes at a time and scrambled every kilobyte, which maps straight onto SSE2 (with a scalar version that gives the same digests)
+// Digests are remembered by the file's device, inode, size and modification time, and kept in the --cache directory between runs
+
+Hashtable *digests = NULL; // A hashtable that maps "device:inode" to the Digest_record of the file
+pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the digest hashtable (files are hashed on the copy threads)
+uint64_t hash_secret[HASH_SECRET_WORDS]; // The pseudo-random key the lanes are mixed with
+pthread_once_t hash_secret_once = PTHREAD_ONCE_INIT;
+
+void init_hash_secret(void) {
+    // A function that fills in the hash key (with splitmix64 from a fixed seed, so digests are the same from run to run)
+    uint64_t state = 0x6d7973796e632121ULL;
+    for (int i = 0; i < HASH_SECRET_WORDS; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        hash_secret[i] = z ^ (z >> 31);
+    }
+}
+
+void accumulate_stripe(uint64_t *acc, unsigned char *data, unsigned char *key) {
+    // A function that takes the eight lanes, 64 bytes of data and 64 bytes of key, and mixes the data into the lanes
+#ifdef __SSE2__
+    for (int i = 0; i < 4; i++) {
+        // Loop through the lanes two at a time
+        __m128i lanes = _mm_loadu_si128((__m128i *)acc + i);
+        __m128i data_vec = _mm_loadu_si128((__m128i *)data + i);
+        __m128i data_key = _mm_xor_si128(data_vec, _mm_loadu_si128((__m128i *)key + i));
+        __m128i data_key_high = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1)); // Move the high half of each word down, so it can be multiplied by the low half
+        __m128i product = _mm_mul_epu32(data_key, data_key_high);
+        __m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2)); // Swap the two words, so each lane also gets its neighbour's data
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(product, _mm_add_epi64(lanes, data_swap)));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        // Loop through the lanes
+        uint64_t data_word;
+        uint64_t key_word;
+        memcpy(&data_word, data + i * 8, 8);
+        memcpy(&key_word, key + i * 8, 8);
+        uint64_t data_key = data_word ^ key_word;
+        acc[i ^ 1] += data_word; // Each lane also gets its neighbour's data
+        acc[i] += (data_key & 0xffffffff) * (data_key >> 32);
+    }
+#endif
+}
+
+void scramble_lanes(uint64_t *acc, unsigned char *key) {
+    // A function that takes the eight lanes and 64 bytes of key, and scrambles the lanes (once a kilobyte, so the multiplies above don't lose entropy)
+#ifdef __SSE2__
+    __m128i prime = _mm_set1_epi32((int)HASH_PRIME32);
+    for (int i = 0; i < 4; i++) {
+        // Loop through the lanes two at a time
+        __m128i lanes = _mm_loadu_si128((__m128i *)acc + i);
+        lanes = _mm_xor_si128(lanes, _mm_srli_epi64(lanes, 47));
+        lanes = _mm_xor_si128(lanes, _mm_loadu_si128((__m128i *)key + i));
+        __m128i product_low = _mm_mul_epu32(lanes, prime); // Multiply the 64-bit words by the 32-bit prime in two halves
+        __m128i product_high = _mm_mul_epu32(_mm_srli_epi64(lanes, 32), prime);
+        _mm_storeu_si128((__m128i *)acc + i, _mm_add_epi64(product_low, _mm_slli_epi64(product_high, 32)));
+    }
+#else
+    for (int i = 0; i < 8; i++) {
+        // Loop through the lanes
+        uint64_t key_word;
+        memcpy(&key_word, key + i * 8, 8);
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= key_word;
+        acc[i] *= HASH_PRIME32;
+    }
+#endif
+}
+
+uint64_t fold_multiply(uint64_t a, uint64_t b) {
+    // A function that multiplies two words into 128 bits and folds the halves together
+    unsigned __int128 product = (unsigned __int128)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+uint64_t merge_lanes(uint64_t *acc, uint64_t *key, uint64_t start) {
+    // A function that takes the eight lanes, 64 bytes of key, and a starting value, and merges the lanes into one word
+    uint64_t result = start;
+    for (int i = 0; i < 4; i++) {
+        result += fold_multiply(acc[2 * i] ^ key[2 * i], acc[2 * i + 1] ^ key[2 * i + 1]);
+    }
+    // Finish with an avalanche, so every bit of the lanes affects every bit of the result
+    result ^= result >> 37;
+    result *= 0x165667919e3779f9ULL;
+    result ^= result >> 32;
+    return result;
+}
+
+void hash_blocks(uint64_t *acc, unsigned char *data, size_t length) {
+    // A function that takes the eight lanes and a whole number of kilobyte blocks, and mixes the blocks into the lanes
+    unsigned char *secret = (unsigned char *)hash_secret;
+    for (size_t offset = 0; offset < length; offset += HASH_BLOCK_SIZE) {
+        // Loop through the blocks, feeding each stripe in with the key moved on eight bytes, then scrambling
+        for (int stripe = 0; stripe < HASH_STRIPES_PER_BLOCK; stripe++) {
+            accumulate_stripe(acc, data + offset + stripe * HASH_STRIPE_SIZE, secret + stripe * 8);
+        }
+        scramble_lanes(acc, secret + HASH_SCRAMBLE_KEY * 8);
+    }
+}
+
+bool hash_fd(int fd, Digest *digest) {
+    // A function that takes an open file, and hashes its contents into a 128-bit digest, returning false if the file can't be read
+    pthread_once(&hash_secret_once, init_hash_secret);
+    uint64_t acc[8] = {0x9e3779b1ULL, 0x9e3779b185ebca87ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL,
+                       0x85ebca77c2b2ae63ULL, 0x85ebca77ULL, 0x27d4eb2f165667c5ULL, 0x9e3779b1ULL}; // The lanes start from the XXH3 primes
+    unsigned char *buffer = malloc_data(HASH_READ_SIZE); // Allocate memory for the buffer (a whole number of blocks)
+    unsigned long long int total = 0; // The number of bytes hashed
+    bool success = true;
+    while (true) {
+        // Loop through the file a buffer at a time
+        size_t filled = 0;
+        while (filled < HASH_READ_SIZE) {
+            // Fill the buffer (short reads only mean the end of the file if read returns 0)
+            ssize_t bytes_read = pread(fd, buffer + filled, HASH_READ_SIZE - filled, total + filled);
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                success = bytes_read == 0;
+                break;
+            }
+            filled += bytes_read;
+        }
+        if (!success) {
+            break;
+        }
+        size_t whole = filled - filled % HASH_BLOCK_SIZE; // The bytes that make up whole blocks
+        hash_blocks(acc, buffer, whole);
+        total += filled;
+        if (filled < HASH_READ_SIZE) {
+            // If this was the end of the file, mix in the stripes of the last partial block (padding the last stripe with zeros)
+            unsigned char *secret = (unsigned char *)hash_secret;
+            size_t stripe = 0;
+            for (; whole + HASH_STRIPE_SIZE <= filled; whole += HASH_STRIPE_SIZE, stripe++) {
+                accumulate_stripe(acc, buffer + whole, secret + stripe * 8);
+            }
+            if (whole < filled) {
+                unsigned char last_stripe[HASH_STRIPE_SIZE] = {0};
+                memcpy(last_stripe, buffer + whole, filled - whole);
+                accumulate_stripe(acc, last_stripe, secret + stripe * 8);
+            }
+            break;
+        }
+    }
+    free(buffer);
+    // Merge the lanes twice with different keys for the two halves of the digest (mixing in the length, so the zero padding can't collide)
+    digest->low = merge_lanes(acc, hash_secret + HASH_LOW_KEY, total * 0x9e3779b185ebca87ULL);
+    digest->high = merge_lanes(acc, hash_secret + HASH_HIGH_KEY, ~(total * 0xc2b2ae3d27d4eb4fULL));
+    return success;
+}
+
+void digest_key(char *key, struct stat *info) {
+    // A function that takes a buffer and a file's info, and writes the file's key in the digest hashtable into the buffer
+    sprintf(key, "%llx:%llx", (unsigned long long int)info->st_dev, (unsigned long long int)info->st_ino);
+}
+
+void remember_digest(struct stat *info, Digest *digest) {
+    // A function that takes a file's info and its digest, and remembers the digest until the file changes
+    Digest_record *record = malloc_data(sizeof(Digest_record));
+    record->type_id = 2; // So the hashtable frees it as a digest_record when it is replaced
+    record->device = info->st_dev;
+    record->inode = info->st_ino;
+    record->size = info->st_size;
+    record->edit_time = info->st_mtim;
+    record->change_time = info->st_ctim;
+    record->digest = *digest;
+    record->used = true;
+    char key[40];
+    digest_key(key, info);
+    pthread_mutex_lock(&digest_lock);
+    put(&digests, key, record); // Replaces (and frees) any digest remembered for an older version of the file
+    pthread_mutex_unlock(&digest_lock);
+}
+
+bool file_digest(char *filepath, bool use_cache, Digest *digest) {
+    // A function that takes a filepath and whether a remembered digest can be used, and hashes the file's contents (or finds the digest remembered for it), returning false if the file can't be read
+    int fd = open(filepath, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    if (use_cache) {
+        // If a remembered digest can be used, look for one from when the file had the same size, modification time and status change time
+        char key[40];
+        digest_key(key, &info);
+        pthread_mutex_lock(&digest_lock);
+        Digest_record *record = (Digest_record *)get(digests, key);
+        bool found = record != NULL && record->size == info.st_size
+            && record->edit_time.tv_sec == info.st_mtim.tv_sec && record->edit_time.tv_nsec == info.st_mtim.tv_nsec
+            && record->change_time.tv_sec == info.st_ctim.tv_sec && record->change_time.tv_nsec == info.st_ctim.tv_nsec;
+        if (found) {
+            *digest = record->digest;
+            record->used = true; // Keep the digest in the cache file
+        }
+        pthread_mutex_unlock(&digest_lock);
+        if (found) {
+            close(fd);
+            return true;
+        }
+    }
+    bool success = hash_fd(fd, digest);
+    close(fd);
+    if (success) {
+        remember_digest(&info, digest);
+    }
+    return success;
+}
+
+char *digest_cache_path(char *cache_dir) {
+    // A function that takes the cache directory, and returns the path of the digest cache file
+    char *path = malloc_data(strlen(cache_dir) + strlen("/digests.cache") + 1);
+    sprintf(path, "%s/digests.cache", cache_dir);
+    return path;
+}
+
+void load_digests(Flags *flags) {
+    // A function that takes a flags struct, and creates the digest hashtable (filled from the cache file in the --cache directory, if there is one)
+    if (digests != NULL) {
+        // If the digests are already loaded (a --watch resync), keep them
+        return;
+    }
+    digests = create_hashtable(DEFAULT_HASHTABLE_SIZE);
+    if (flags->cache_dir == NULL) {
+        return;
+    }
+    char *path = digest_cache_path(flags->cache_dir);
+    FILE *file = fopen(path, "rb");
+    free(path);
+    if (file == NULL) {
+        // If there is no cache file yet (the first run), every file is hashed
+        return;
+    }
+    Digest_file_header header;
+    if (fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic)) == 0 && header.version == DIGEST_CACHE_VERSION) {
+        // If the file is a digest cache from this version, read each of its records
+        Digest_file_record saved;
+        for (uint64_t i = 0; i < header.num_records && fread(&saved, sizeof(saved), 1, file) == 1; i++) {
+            struct stat info; // The parts of the file's info the record was saved with
+            info.st_dev = saved.device;
+            info.st_ino = saved.inode;
+            info.st_size = saved.size;
+            info.st_mtim.tv_sec = saved.mtime_sec;
+            info.st_mtim.tv_nsec = saved.mtime_nsec;
+            info.st_ctim.tv_sec = saved.ctime_sec;
+            info.st_ctim.tv_nsec = saved.ctime_nsec;
+            Digest digest = {saved.digest_low, saved.digest_high};
+            remember_digest(&info, &digest);
+            char key[40];
+            digest_key(key, &info);
+            ((Digest_record *)get(digests, key))->used = false; // Only digests of files that are seen again are saved again
+        }
+    }
+    fclose(file);
+}
+
+void save_digests(Flags *flags) {
+    // A function that takes a flags struct, and writes every digest used this run to the cache file in the --cache directory (if it was passed)
+    if (flags->cache_dir == NULL || digests == NULL) {
+        return;
+    }
+    char *path = digest_cache_path(flags->cache_dir);
+    char *temp_path = malloc_data(strlen(path) + strlen(".tmp") + 1); // Write to a temporary file and rename it, so a run that is interrupted never leaves a half written cache
+    sprintf(temp_path, "%s.tmp", path);
+    FILE *file = fopen(temp_path, "wb");
+    bool success = file != NULL;
+    Digest_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DIGEST_CACHE_MAGIC, sizeof(header.magic));
+    header.version = DIGEST_CACHE_VERSION;
+    Digest_record *record;
+    int position = 0;
+    while ((record = hashtable_next(digests, &position)) != NULL) {
+        // Loop through the hashtable and count the digests to save
+        header.num_records += record->used;
+    }
+    success = success && fwrite(&header, sizeof(header), 1, file) == 1;
+    position = 0;
+    while (success && (record = hashtable_next(digests, &position)) != NULL) {
+        // Loop through the hashtable and write each digest used this run
+        if (!record->used) {
+            continue;
+        }
+        Digest_file_record saved;
+        memset(&saved, 0, sizeof(saved));
+        saved.device = record->device;
+        saved.inode = record->inode;
+        saved.size = record->size;
+        saved.mtime_sec = record->edit_time.tv_sec;
+        saved.mtime_nsec = record->edit_time.tv_nsec;
+        saved.ctime_sec = record->change_time.tv_sec;
+        saved.ctime_nsec = record->change_time.tv_nsec;
+        saved.digest_low = record->digest.low;
+        saved.digest_high = record->digest.high;
+        success = fwrite(&saved, sizeof(saved), 1, file) == 1;
+    }
+    if (file != NULL) {
+        success = fclose(file) == 0 && success;
+    }
+    if (!success || rename(temp_path, path) == -1) {
+        // If the cache file could not be written, print an error message and exit the program
+        fprintf(stderr, "Error: could not write digest cache \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    free(temp_path);
+    free(path);
+}
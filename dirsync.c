@@ -13,6 +13,7 @@ void create_directory(char *relpath, char *parent_dir, Flags *flags) {
             free(dirpath);
             exit(EXIT_FAILURE);
         }
+        add_stat(STAT_DIRECTORIES_CREATED, 1);
     }
     VERBOSE_PRINT("Created directory %s as it did not exist\n", dirpath);
     free(dirpath); // Free the memory allocated for the directory path
@@ -20,6 +21,8 @@ void create_directory(char *relpath, char *parent_dir, Flags *flags) {
 
 void create_directories(Dir_indexes *dir_indexes, char *relpath, char **directories, int num_directories, Flags *flags) {
     // A function that takes a directory index, a directory name, an array of directory names, and the number of directories, and creates placeholder directories in the directories that are not in the directory index
+    struct timespec start; // The time the directories started being created (for the --stats flag)
+    start_stat_timer(&start);
     Index *current_dir_index = dir_indexes->head; // Loop through the directory indexes
     for (int i=0; i<num_directories; i++) {
         if (current_dir_index != NULL && i == current_dir_index->index) {
@@ -29,4 +32,5 @@ void create_directories(Dir_indexes *dir_indexes, char *relpath, char **director
         }
         create_directory(relpath, directories[i], flags); // Create the subdirectory in the current directory
     }
+    stop_stat_timer(STAT_TIME_DIRECTORIES, &start);
 }
\ No newline at end of file
@@ -1,19 +1,94 @@
 #include "mysync.h"
 
-void copy_files(char *master_path, long long int master_size, char **filepaths, int num_filepaths, Flags *flags) {
-    // A function that takes a master file and an array of filepaths and copies the master file to each of the filepaths
+_Atomic long long int replicas_copied = 0; // The number of copies of files that have been rewritten from their master file (atomic as files are synced on several threads)
+_Atomic long long int replicas_skipped = 0; // The number of copies of files that were skipped as they were already up to date
+
+void set_fd_perm_time(int fd, char *filepath, File *master, Flags *flags) {
+    // A function that takes an open copy of a file, its path, a master file, and a flags struct, and sets the modification time of the copy to that of the master file, and its permissions too if the -p flag was passed (used on an --atomic copy before it is put in place, so it is never seen with the wrong ones)
+    struct timespec times[2]; // The access and modification times to set
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT; // Leave the access time untouched
+    times[1] = master->replicas[master->directory_index].edit_time;
+    if (futimens(fd, times) == -1) {
+        // If futimens fails, print an error message and exit the program
+        fprintf(stderr, "Error: could not set modification time for file \"%s\"\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+    if (flags->copy_perm_time_flag && fchmod(fd, master->permissions) == -1) {
+        // If fchmod fails, print an error message and exit the program
+        fprintf(stderr, "Error: could not set permissions for file \"%s\"\n", filepath);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void break_hardlink(char *filepath) {
+    // A function that takes the path of a copy about to be rewritten in place, and unlinks it first if it is a hardlink to other files (such as another name of the same file made by --hardlinks, or an identical file's copy made by --dedup=link), so rewriting it leaves the other names alone
+    struct stat file_info;
+    if (lstat(filepath, &file_info) == 0 && S_ISREG(file_info.st_mode) && file_info.st_nlink > 1) {
+        unlink(filepath);
+    }
+}
+
+void copy_files(File *master, char *master_path, char **filepaths, int num_filepaths, Flags *flags) {
+    // A function that takes a master file, its path, and an array of filepaths and copies the master file to each of the filepaths (with the fastest method each pair of filesystems supports)
+    long long int master_size = master->size;
+    int *methods = malloc_data(num_filepaths * sizeof(int)); // Allocate memory for the method each of the files was copied with
     if (!flags->no_sync_flag) {
         // If the -n flag was not passed, copy the master file to each of the filepaths
-        int master_fd = open(master_path, O_RDONLY); // Open the master file in read-only mode
-        if (master_fd == -1) {
+        Uring *ring = thread_uring(flags); // The thread's io_uring, if the --io-uring flag was passed (the files are then opened, copied through a buffer, and closed in batches)
+        int master_fd;
+        int *files = malloc_data(num_filepaths * sizeof(int)); // Allocate memory for the file descriptors
+        char **temp_paths = calloc(num_filepaths, sizeof(char *)); // The temporary paths the copies are written to before they are renamed into place (for the --atomic flag)
+        if (temp_paths == NULL) {
+            // If calloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; !flags->atomic_flag && i < num_filepaths; i++) {
+            // If the copies are rewritten in place, break any of them that share their data with other names first (an --atomic copy is a new file renamed over the old name, which breaks the link by itself)
+            break_hardlink(filepaths[i]);
+        }
+        if (ring != NULL && flags->atomic_flag) {
+            // If there is a ring but the copies are replaced atomically, only the master file is opened through it (the new copies are opened beside the old ones below)
+            int open_flags = O_RDONLY;
+            uring_open_batch(ring, &master_fd, &master_path, &open_flags, 1);
+        } else if (ring != NULL) {
+            // If there is a ring, open the master file and every copy with one batch of requests
+            int *fds = malloc_data((num_filepaths + 1) * sizeof(int));
+            char **paths = malloc_data((num_filepaths + 1) * sizeof(char *));
+            int *open_flags = malloc_data((num_filepaths + 1) * sizeof(int));
+            paths[0] = master_path;
+            open_flags[0] = O_RDONLY;
+            for (int i = 0; i < num_filepaths; i++) {
+                paths[i + 1] = filepaths[i];
+                open_flags[i + 1] = O_RDWR | O_CREAT | O_TRUNC;
+            }
+            uring_open_batch(ring, fds, paths, open_flags, num_filepaths + 1);
+            master_fd = fds[0];
+            memcpy(files, fds + 1, num_filepaths * sizeof(int));
+            free(fds);
+            free(paths);
+            free(open_flags);
+        } else {
+            master_fd = open(master_path, O_RDONLY); // Open the master file in read-only mode
+        }
+        struct stat master_info; // The master file's info (for the device it is on)
+        if (master_fd == -1 || fstat(master_fd, &master_info) == -1) {
             // If open fails, print an error message and exit the program
             fprintf(stderr, "Error: could not open master file \"%s\"\n", master_path);
             exit(EXIT_FAILURE);
         }
-        int *files = malloc_data(num_filepaths * sizeof(int)); // Allocate memory for the file descriptors
+        if (flags->stream_flag) {
+            // If the --stream flag was passed, tell the kernel the master file is read once from start to end (so it reads ahead further and keeps less of it)
+            posix_fadvise(master_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
         for (int i = 0; i < num_filepaths; i++) {
             // Loop through the filepaths
-            files[i] = open(filepaths[i], O_RDWR | O_CREAT | O_TRUNC, 0666); // Open the file in read-write mode, create it if it doesn't exist, and truncate it if it does exist, with permissions 0666
+            if (flags->atomic_flag) {
+                files[i] = open_atomic_replica(filepaths[i], &temp_paths[i]); // Open a new file to write the copy into, leaving the old copy as it is until the new one is complete
+            } else if (ring == NULL) {
+                files[i] = open(filepaths[i], O_RDWR | O_CREAT | O_TRUNC, 0666); // Open the file in read-write mode, create it if it doesn't exist, and truncate it if it does exist, with permissions 0666
+            }
             if (files[i] == -1) {
                 // If open fails, print an error message, close all the files that have been opened so far, and exit the program
                 fprintf(stderr, "Error: could not open file \"%s\"\n", filepaths[i]);
@@ -25,83 +100,582 @@ void copy_files(char *master_path, long long int master_size, char **filepaths,
                 exit(EXIT_FAILURE);
             }
         }
-        int page_size = sysconf(_SC_PAGESIZE); // Get the page size
-        size_t buffer_size = master_size < page_size * 16 ? master_size : page_size * 16; // Set the buffer size to the master file size if it is less than 16 pages, otherwise set it to 16 pages (for efficiency)
-        char *buffer = malloc_data(buffer_size); // Allocate memory for the buffer
-        ssize_t bytes_read;
-        while ((bytes_read = read(master_fd, buffer, buffer_size)) > 0) {
-            // Loop through the master file and read it into the buffer
+        bool holes = has_holes(&master_info); // A bool that represents whether the master file has holes (only its data is copied, so the copies have the same holes)
+        int *buffered = malloc_data(num_filepaths * sizeof(int)); // Allocate memory for the file descriptors that fall back to the buffered loop
+        dev_t *buffered_dsts = malloc_data(num_filepaths * sizeof(dev_t)); // Allocate memory for the devices of those files
+        int num_buffered = 0;
+        long long int bytes_written = 0; // The bytes of data written to the copies (a reflink writes none, and holes aren't written, for the --stats flag)
+        bool use_splice = false; // A bool that represents whether the shared pass over the master file is spliced rather than buffered
+        bool split = flags->split_threshold > 0 && master_info.st_size >= flags->split_threshold; // A bool that represents whether the master file is big enough to be copied in ranges on several threads (the --split flag)
+        if (split) {
+            // If the master file is split, copy every range of it to every copy on several threads (nothing is left for the loops below)
+            split_copy(master_path, master_fd, &master_info, filepaths, files, methods, num_filepaths, flags);
+        }
+        for (int i = 0; !split && i < num_filepaths; i++) {
+            // Loop through the files and copy the master file to each of them inside the kernel if possible
+            struct stat file_info; // The copy's info (for the device it is on)
+            fstat(files[i], &file_info);
+            int method = flags->copy_method != COPY_AUTO ? flags->copy_method : probe_copy_method(master_info.st_dev, file_info.st_dev); // Use the forced method, or the fastest method that works between the two filesystems
+            if ((flags->sparse_flag || flags->direct_flag) && flags->copy_method == COPY_AUTO && method != COPY_REFLINK) {
+                // If the --sparse or --direct flag was passed, copy through the buffer unless the blocks can be shared, as only the buffered loop sees the blocks of zeros to leave out (and only it can go around the page cache)
+                method = COPY_READ_WRITE;
+            }
+            long long int copied = 0; // The bytes copied inside the kernel
+            while (method != COPY_SPLICE && method != COPY_READ_WRITE && (copied = holes ? copy_extents(method, master_fd, files[i], master_size) : copy_range(method, master_fd, files[i], 0, LLONG_MAX)) == -1) {
+                // If the method fails, try the next fastest method (unless the failure is a real error), stopping at the methods that share one pass over the master file
+                if (!copy_method_unsupported(errno)) {
+                    // If the copy failed for a reason other than the method not being supported, print an error message and exit the program
+                    fprintf(stderr, "Error: could not copy master file \"%s\" to file \"%s\"\n", master_path, filepaths[i]);
+                    exit(EXIT_FAILURE);
+                }
+                if (flags->copy_method != COPY_AUTO) {
+                    // If the method was forced with the -m flag, print an error message and exit the program rather than quietly using another method
+                    fprintf(stderr, "Error: copy method %s is not supported for file \"%s\"\n", copy_method_name(method), filepaths[i]);
+                    exit(EXIT_FAILURE);
+                }
+                rule_out_copy_method(master_info.st_dev, file_info.st_dev, method); // Don't try the method between these filesystems again
+                method = flags->sparse_flag || flags->direct_flag ? COPY_READ_WRITE : method + 1;
+            }
+            if (method != COPY_REFLINK && method != COPY_SPLICE && method != COPY_READ_WRITE) {
+                // If the file was copied inside the kernel (other than by sharing the master's blocks), count the data it was given
+                bytes_written += copied;
+            }
+            if (method == COPY_SPLICE && (holes || flags->sparse_flag)) {
+                // If the master file has holes (or the --sparse flag was passed), copy through the buffer rather than splicing, as a splice reads a hole as zeros and writes them out
+                method = COPY_READ_WRITE;
+            }
+            methods[i] = method;
+            if (method == COPY_SPLICE || method == COPY_READ_WRITE) {
+                // If the file can't be copied on its own inside the kernel, add it to the files that share one pass over the master file
+                buffered[num_buffered] = files[i];
+                buffered_dsts[num_buffered++] = file_info.st_dev;
+                use_splice |= method == COPY_SPLICE; // The shared pass is spliced if any of its files can be
+            }
+        }
+        if (use_splice && !splice_fanout(master_fd, buffered, num_buffered)) {
+            // If the master file couldn't be spliced to the files (so it is read only once however many there are), fall back to the buffered loop
+            if (!copy_method_unsupported(errno)) {
+                // If the splice failed for a reason other than it not being supported, print an error message and exit the program
+                fprintf(stderr, "Error: could not copy master file \"%s\"\n", master_path);
+                exit(EXIT_FAILURE);
+            }
+            if (flags->copy_method != COPY_AUTO) {
+                // If splicing was forced with the -m flag, print an error message and exit the program rather than quietly using another method
+                fprintf(stderr, "Error: copy method splice is not supported for master file \"%s\"\n", master_path);
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < num_buffered; i++) {
+                // Loop through the files and don't splice between these filesystems again
+                rule_out_copy_method(master_info.st_dev, buffered_dsts[i], COPY_SPLICE);
+            }
+            for (int i = 0; i < num_filepaths; i++) {
+                // Loop through the files and record that the spliced ones were copied through the buffer instead
+                methods[i] = methods[i] == COPY_SPLICE ? COPY_READ_WRITE : methods[i];
+            }
+            use_splice = false;
+        }
+        if (use_splice) {
+            // If the master file was spliced to the files, every one of them was given all of it (a master file with holes is never spliced)
+            bytes_written += master_info.st_size * num_buffered;
+        }
+        bool sparse_copies = holes || flags->sparse_flag; // A bool that represents whether the buffered copies can have holes (so they must be extended to the master's size once written)
+        if (num_buffered > 0 && !use_splice && ring != NULL && !flags->direct_flag) {
+            // If any files fell back to the buffered loop and there is a ring, read the master file once into a few buffers and write each to every file as it arrives, with the reads and writes queued in batches
+            long long int start = 0, end = master_info.st_size; // The range of data being copied (the whole file unless it has holes)
+            for (long long int offset = 0; !holes || next_data_extent(master_fd, offset, master_info.st_size, &start, &end); offset = end) {
+                // Loop through the ranges of data in the master file (just the one if it has no holes)
+                if (!uring_copy(ring, master_fd, buffered, num_buffered, start, end, flags->sparse_flag, &bytes_written)) {
+                    // If a read or write fails, print an error message and exit the program
+                    fprintf(stderr, "Error: could not write to a copy of master file \"%s\"\n", master_path);
+                    exit(EXIT_FAILURE);
+                }
+                if (!holes) {
+                    break;
+                }
+            }
             for (int i = 0; i < num_filepaths; i++) {
-                // Loop through the filepaths and write the buffer to each of the files (so that the master file is copied to each of the files, with only one loop through the master file)
-                write(files[i], buffer, bytes_read);
+                // Loop through the files and record that the buffered ones were copied through io_uring
+                methods[i] = methods[i] == COPY_READ_WRITE ? COPY_URING : methods[i];
+            }
+        } else if (num_buffered > 0 && !use_splice) {
+            // If any files fell back to the buffered loop, read the master file once and write the buffer to each of them
+            size_t buffer_size = copy_buffer_size(master_size); // Size the buffer to the master file (a big file gets a bigger buffer, so it takes fewer reads and writes)
+            char *buffer = malloc_copy_buffer(buffer_size); // Allocate memory for the buffer (aligned, in case it is read and written with O_DIRECT)
+            bool master_direct = flags->direct_flag && set_direct_io(master_fd, true); // A bool that represents whether the master file is read around the page cache
+            bool *direct = malloc_data(num_buffered * sizeof(bool)); // Allocate memory for whether each file is written around the page cache
+            for (int i = 0; i < num_buffered; i++) {
+                direct[i] = flags->direct_flag && set_direct_io(buffered[i], true);
+            }
+            ssize_t bytes_read;
+            long long int window_start = 0, released = 0; // The start of the window being copied, and the end of what has been dropped from the page cache (for the --stream flag)
+            long long int start = 0, end = LLONG_MAX; // The range of data being read (the whole file unless it has holes)
+            for (long long int data_offset = 0; !holes || next_data_extent(master_fd, data_offset, master_info.st_size, &start, &end); data_offset = end) {
+                // Loop through the ranges of data in the master file (just the one if it has no holes)
+                off_t offset = start; // The offset of the buffer in the master file
+                while (offset < end) {
+                    // Loop through the range and read it into the buffer
+                    size_t length = end - offset < (long long int)buffer_size ? end - offset : buffer_size;
+                    if (master_direct) {
+                        // An O_DIRECT read must be a whole number of blocks (reading past the end of the file just comes up short)
+                        length = (length + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+                    }
+                    bytes_read = pread(master_fd, buffer, length, offset);
+                    if (bytes_read == -1 && master_direct && errno == EINVAL && set_direct_io(master_fd, false)) {
+                        // If the O_DIRECT read wasn't allowed (the offset isn't aligned to the filesystem's blocks), read through the page cache from now on
+                        master_direct = false;
+                        continue;
+                    }
+                    if (bytes_read == -1 && errno == EINTR) {
+                        // If the read was interrupted by a signal, try it again
+                        continue;
+                    }
+                    if (bytes_read == -1) {
+                        // If the read failed, print an error message and exit the program (rather than leave the copies cut short)
+                        fprintf(stderr, "Error: could not read master file \"%s\"\n", master_path);
+                        exit(EXIT_FAILURE);
+                    }
+                    if (bytes_read == 0) {
+                        // If the master file shrank since it was stat'ed, stop copying
+                        break;
+                    }
+                    for (int i = 0; i < num_buffered; i++) {
+                        // Loop through the buffered files and write the buffer to each of them (so that the master file is copied to each of the files, with only one loop through the master file), leaving out its blocks of zeros if the --sparse flag was passed
+                        if (direct[i] && (offset % DIRECT_IO_ALIGNMENT != 0 || bytes_read % DIRECT_IO_ALIGNMENT != 0)) {
+                            // If the buffer isn't a whole number of blocks (the end of the file), write it through the page cache
+                            direct[i] = !set_direct_io(buffered[i], false);
+                        }
+                        bool written = flags->sparse_flag ? write_sparse(buffered[i], buffer, bytes_read, offset, &bytes_written) : write_all(buffered[i], buffer, bytes_read, offset);
+                        if (!written && direct[i] && errno == EINVAL && set_direct_io(buffered[i], false)) {
+                            // If the filesystem took O_DIRECT but won't write this way, write through the page cache from now on
+                            direct[i] = false;
+                            written = flags->sparse_flag ? write_sparse(buffered[i], buffer, bytes_read, offset, &bytes_written) : write_all(buffered[i], buffer, bytes_read, offset);
+                        }
+                        if (written && !flags->sparse_flag) {
+                            bytes_written += bytes_read;
+                        }
+                        if (!written) {
+                            // If a write fails, print an error message and exit the program
+                            fprintf(stderr, "Error: could not write to a copy of master file \"%s\"\n", master_path);
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    offset += bytes_read;
+                    if (flags->stream_flag && offset - window_start >= STREAM_WINDOW_SIZE) {
+                        // If the --stream flag was passed and a window has been copied, start writing it back, and drop the window before it from the page cache (its writes have had a whole window's time to finish)
+                        start_writeback(buffered, num_buffered, window_start, offset);
+                        release_cached_range(master_fd, buffered, num_buffered, released, window_start);
+                        released = window_start;
+                        window_start = offset;
+                    }
+                }
+                if (!holes) {
+                    break;
+                }
             }
+            free(direct);
+            free(buffer);
+        }
+        for (int i = 0; sparse_copies && !use_splice && i < num_buffered; i++) {
+            // If the buffered copies can have holes, extend each of them to the size of the master file (so a hole at the end is kept)
+            if (ftruncate(buffered[i], master_info.st_size) == -1) {
+                // If ftruncate fails, print an error message and exit the program
+                fprintf(stderr, "Error: could not write to a copy of master file \"%s\"\n", master_path);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (flags->stream_flag) {
+            // If the --stream flag was passed, write back whatever is left of the copies and drop it and the master file from the page cache
+            release_cached_range(master_fd, files, num_filepaths, 0, 0);
         }
-        // Free the memory allocated for the buffer and close all the files
-        free(buffer);
+        // Free the memory allocated for the buffered files and close all the files
+        free(buffered);
+        free(buffered_dsts);
         close(master_fd);
-        for (int i = 0; i < num_filepaths; i++) {
-            close(files[i]);
+        if (flags->atomic_flag) {
+            // If the --atomic flag was passed, put each new copy in place of the old one (which also closes it), giving it the master file's modification time first (and permissions with the -p flag)
+            for (int i = 0; i < num_filepaths; i++) {
+                set_fd_perm_time(files[i], filepaths[i], master, flags);
+                commit_atomic_replica(files[i], filepaths[i], temp_paths[i], master_path, flags);
+            }
+        } else if (ring != NULL) {
+            // If there is a ring, close the copies with one batch of requests
+            uring_close_batch(ring, files, num_filepaths);
+        } else {
+            for (int i = 0; i < num_filepaths; i++) {
+                close(files[i]);
+            }
         }
         free(files);
+        free(temp_paths);
+        add_stat(STAT_BYTES_WRITTEN, bytes_written); // (A split copy counts its own, as its ranges are written on other threads)
     }
     // Print a message for each of the files that have been copied
     for (int i=0; i<num_filepaths; i++) {
-        VERBOSE_PRINT("Copied master file \"%s\" to file \"%s\"\n", master_path, filepaths[i]);
+        if (flags->no_sync_flag) {
+            VERBOSE_PRINT("Copied master file \"%s\" to file \"%s\"\n", master_path, filepaths[i]);
+        } else {
+            VERBOSE_PRINT("Copied master file \"%s\" to file \"%s\" with %s\n", master_path, filepaths[i], copy_method_name(methods[i]));
+        }
+    }
+    free(methods);
+}
+
+bool replica_is_stale(Replica *replica, Replica *master) {
+    // A function that takes a copy of a file and the master copy, and returns true if the copy needs to be rewritten
+    if (!replica->present || replica->size != master->size) {
+        // If the copy doesn't exist or is a different size, it is stale
+        return true;
+    }
+    // Otherwise the copy is only stale if its modification time differs from the master's (down to the nanosecond)
+    return replica->edit_time.tv_sec != master->edit_time.tv_sec || replica->edit_time.tv_nsec != master->edit_time.tv_nsec;
+}
+
+bool replica_differs(char *filepath, Replica *replica, char *master_path, Replica *master, Digest *master_digest, bool *hashed_master) {
+    // A function that takes a copy of a file and the master copy (and the master's digest, worked out the first time it is needed), and returns true if the copy's contents differ from the master's (for the -c flag)
+    if (!replica->present || replica->size != master->size) {
+        // If the copy doesn't exist or is a different size, it differs without needing to be hashed
+        return true;
+    }
+    if (!*hashed_master) {
+        // If the master file hasn't been hashed yet, hash it now (it is only hashed once however many copies there are)
+        if (!file_digest(master_path, true, master_digest)) {
+            // If the master file can't be read, print an error message and exit the program
+            fprintf(stderr, "Error: could not read master file \"%s\"\n", master_path);
+            exit(EXIT_FAILURE);
+        }
+        *hashed_master = true;
+    }
+    Digest digest; // The digest of the copy
+    if (!file_digest(filepath, true, &digest)) {
+        // If the copy can't be read, rewrite it
+        return true;
+    }
+    return digest.low != master_digest->low || digest.high != master_digest->high;
+}
+
+void set_perm_time(char *filepath, File *master, Flags *flags) {
+    // A function that takes a filepath and a master file, and sets the modification time of the file to that of the master file, and its permissions too if the -p flag was passed (a copy with the master's contents always gets the master's modification time, or it would look stale again next run)
+    if (!flags->no_sync_flag) {
+        // If the -n flag was not passed, set the modification time (and permissions) of the file
+        struct timespec times[2]; // The access and modification times to set
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT; // Leave the access time untouched
+        times[1] = master->replicas[master->directory_index].edit_time; // Set the modification time to that of the master file (with nanoseconds, so the copy is seen as up to date next run)
+        if (utimensat(AT_FDCWD, filepath, times, 0) == -1) {
+            // If utimensat fails, print an error message and exit the program
+            fprintf(stderr, "Error: could not set modification time for file \"%s\"\n", filepath);
+            exit(EXIT_FAILURE);
+        }
+        if (flags->copy_perm_time_flag && chmod(filepath, master->permissions) == -1) {
+            // If chmod fails, print an error message and exit the program
+            fprintf(stderr, "Error: could not set permissions for file \"%s\"\n", filepath);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void skip_replica(File *master, int directory_index, char *filepath, char *master_path, Flags *flags) {
+    // A function that takes a master file, the index of a directory whose copy of it is already up to date, the copy's path, the master file's path, and a flags struct, and skips rewriting the copy (only bringing its modification time up to date, and its permissions with the -p flag)
+    replicas_skipped++;
+    add_stat(STAT_COPIES_SKIPPED, 1);
+    VERBOSE_PRINT("Skipped file \"%s\" as it is already up to date with master file \"%s\"\n", filepath, master_path);
+    if (replica_is_stale(&master->replicas[directory_index], &master->replicas[master->directory_index])) {
+        // If the copy only matched by its contents (the -c flag), give it the master's modification time (and permissions if the -p flag was passed)
+        set_perm_time(filepath, master, flags);
+        if (flags->copy_perm_time_flag) {
+            VERBOSE_PRINT("Set permissions for file \"%s\" to those of master file \"%s\"\n", filepath, master_path);
+        }
+    } else if (flags->copy_perm_time_flag && (master->replicas[directory_index].permissions & 07777) != (master->permissions & 07777)) {
+        // If the -p flag was passed and only the permissions differ, just update the permissions
+        if (!flags->no_sync_flag && chmod(filepath, master->permissions) == -1) {
+            // If chmod fails, print an error message and exit the program
+            fprintf(stderr, "Error: could not set permissions for file \"%s\"\n", filepath);
+            exit(EXIT_FAILURE);
+        }
+        VERBOSE_PRINT("Set permissions for file \"%s\" to those of master file \"%s\"\n", filepath, master_path);
     }
 }
 
 void sync_master(File *master, char *relpath, char **directories, int num_directories, Flags *flags) {
-    // A function that takes a master file, a relative path to the file, an array of directory names, the number of directories, and a flags struct, and copies the master file to each of the directories
+    // A function that takes a master file, a relative path to the file, an array of directory names, the number of directories, and a flags struct, and copies the master file to each of the directories where the copy is out of date
+    struct timespec start; // The time the file started syncing (for the --stats flag)
+    start_stat_timer(&start);
     char *master_path = malloc_data(strlen(directories[master->directory_index]) + strlen(relpath) + 2); // Allocate memory for the master file path
     sprintf(master_path, "%s/%s", directories[master->directory_index], relpath); // Create the master file path by concatenating the directory name and the relative path
-    char **filepaths = malloc_data((num_directories-1) * sizeof(char *)); // Allocate memory for the filepaths
-    int passed_master = 0; // A variable that keeps track of whether the master directory has been passed
+    Replica *master_replica = &master->replicas[master->directory_index]; // The metadata of the master copy
+    char **filepaths = malloc_data((num_directories-1) * sizeof(char *)); // Allocate memory for the filepaths of the stale copies
+    int num_stale = 0; // The number of copies that need to be rewritten
+    Digest master_digest; // The digest of the master file (for the -c and --verify flags)
+    bool hashed_master = false; // A bool that represents whether the master file has been hashed yet
     for (int i=0; i<num_directories; i++) {
         // Loop through the directories
         if (i == master->directory_index) {
-            // If the current directory is the master directory, skip it and increment the passed_master variable
-            passed_master = 1;
+            // If the current directory is the master directory, skip it
             continue;
         }
-        filepaths[i - passed_master] = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the filepath
-        sprintf(filepaths[i - passed_master], "%s/%s", directories[i], relpath); // Create the filepath by concatenating the directory name and the relative path
-    }
-    copy_files(master_path, master->size, filepaths, num_directories-1, flags); // Copy the master file to each of the filepaths
-    if (flags->copy_perm_time_flag) {
-        // If the -p flag was passed, set the permissions and modification time of each of the files to those of the master file
-        struct utimbuf times; // Create a utimbuf struct
-        times.modtime = master->edit_time; // Set the modification time to the modification time of the master file
-        if (flags->verbose_flag) {
-            // If the -v flag was passed, print the permissions and modification time of the master file
-            char *readable_permissions = permissions(master->permissions);
-            printf("Master file \"%s\" has permissions %s and modification time %lld\n", master_path, readable_permissions, master->edit_time);
-        }
-        for (int i=0; i<num_directories-1; i++) {
-            // Loop through the filepaths and set the permissions and modification time of each of the files to those of the master file
-            if (!flags->no_sync_flag) {
-                // If the -n flag was not passed, set the permissions and modification time of the file
-                if (utime(filepaths[i], &times) == -1) {
-                    // If utime fails, print an error message and exit the program
-                    fprintf(stderr, "Error: could not set modification time for file \"%s\"\n", filepaths[i]);
-                    exit(EXIT_FAILURE);
-                }
-                if (chmod(filepaths[i], master->permissions) == -1) {
-                    // If chmod fails, print an error message and exit the program
-                    fprintf(stderr, "Error: could not set permissions for file \"%s\"\n", filepaths[i]);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            // Print a message for each of the files that have had their permissions and modification time set and free the memory allocated for the filepath
+        char *filepath = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the filepath
+        sprintf(filepath, "%s/%s", directories[i], relpath); // Create the filepath by concatenating the directory name and the relative path
+        bool stale = flags->checksum_flag ? replica_differs(filepath, &master->replicas[i], master_path, master_replica, &master_digest, &hashed_master) : replica_is_stale(&master->replicas[i], master_replica); // With the -c flag a copy is compared by its contents, otherwise by its size and modification time
+        if (stale) {
+            // If the copy is missing or out of date, add it to the filepaths to copy to
+            filepaths[num_stale++] = filepath;
+            continue;
+        }
+        // Otherwise the copy already has the same contents as the master, so skip rewriting it
+        skip_replica(master, i, filepath, master_path, flags);
+        free(filepath);
+    }
+    char **full_copies = malloc_data((num_directories-1) * sizeof(char *)); // Allocate memory for the filepaths of the stale copies that are rewritten in full
+    int num_full_copies = 0;
+    for (int i=0; i<num_stale; i++) {
+        // Loop through the stale copies, updating the ones of large files with a delta transfer if the --delta flag was passed
+        if (flags->delta_threshold == 0 || flags->no_sync_flag || master->size < flags->delta_threshold || !delta_copy(master, master_path, filepaths[i], flags)) {
+            full_copies[num_full_copies++] = filepaths[i];
+        }
+    }
+    if (num_full_copies > 0) {
+        // If any copies still need rewriting, copy the master file to each of them
+        copy_files(master, master_path, full_copies, num_full_copies, flags);
+    }
+    replicas_copied += num_stale;
+    add_stat(STAT_COPIES_WRITTEN, num_stale);
+    free(full_copies);
+    if (flags->copy_perm_time_flag && num_stale > 0 && flags->verbose_flag) {
+        // If the -p and -v flags were passed, print the permissions and modification time of the master file
+        char *readable_permissions = permissions(master->permissions);
+        printf("Master file \"%s\" has permissions %s and modification time %lld\n", master_path, readable_permissions, master->edit_time);
+        free(readable_permissions);
+    }
+    for (int i=0; i<num_stale; i++) {
+        // Loop through the stale filepaths
+        if (!flags->atomic_flag) {
+            // Give the copy the master file's modification time (and permissions if the -p flag was passed), so it is seen as up to date next run (an --atomic copy was given them before it was put in place)
+            set_perm_time(filepaths[i], master, flags);
+        }
+        if (flags->copy_perm_time_flag) {
             VERBOSE_PRINT("Set permissions for file \"%s\" to those of master file \"%s\"\n", filepaths[i], master_path);
-            free(filepaths[i]);
         }
-    } else {
-        // If the -p flag was not passed, just free the memory allocated for the filepaths
-        for (int i=0; i<num_directories-1; i++) {
-            free(filepaths[i]);
+        if (flags->verify_flag && !flags->no_sync_flag && !flags->atomic_flag) {
+            // If the --verify flag was passed, hash the copy that was just written and check it matches the master file (an --atomic copy was checked before it was put in place)
+            Digest digest; // The digest of the copy
+            if (!hashed_master) {
+                hashed_master = file_digest(master_path, true, &master_digest);
+            }
+            if (!hashed_master || !file_digest(filepaths[i], false, &digest) || digest.low != master_digest.low || digest.high != master_digest.high) {
+                // If the copy doesn't match the master file, print an error message and exit the program
+                fprintf(stderr, "Error: file \"%s\" does not match master file \"%s\" after copying\n", filepaths[i], master_path);
+                exit(EXIT_FAILURE);
+            }
+            VERBOSE_PRINT("Verified file \"%s\" against master file \"%s\"\n", filepaths[i], master_path);
         }
+        free(filepaths[i]); // Free the memory allocated for the filepath
     }
     // Free the memory allocated for the master file path and the filepaths
     free(master_path);
     free(filepaths);
+    add_stat(STAT_FILES_SYNCED, 1);
+    if (num_stale > 0) {
+        // If any copies were written, add the time the file took to the histogram of sync times
+        record_sync_time(&start);
+    }
+}
+
+bool replace_with_link(char *target, char *filepath) {
+    // A function that takes a file and a path, and puts a hardlink to the file at the path (replacing whatever was there in one step, so the path is never missing), returning false if the link couldn't be made
+    char *temp_path = temp_name(filepath); // The link is made beside the path under a hidden name the scan skips, then renamed over it
+    bool success = link(target, temp_path) == 0;
+    while (!success && errno == EEXIST) {
+        // If the name is taken (by a link left behind by a sync that was killed), try another one
+        free(temp_path);
+        temp_path = temp_name(filepath);
+        success = link(target, temp_path) == 0;
+    }
+    if (success && rename(temp_path, filepath) == -1) {
+        unlink(temp_path);
+        success = false;
+    }
+    free(temp_path);
+    return success;
+}
+
+void sync_link(File *master, char *relpath, File *leader, char *leader_relpath, char **directories, int num_directories, Flags *flags) {
+    // A function that takes a master file that is a hardlink to another master file in its root (the leader, whose copies have already been written), their relative paths, an array of directory names, the number of directories, and a flags struct, and makes the file a hardlink to the leader's copy in every other directory (copying it in full where a link can't be made, such as across filesystems)
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the directories
+        if (i == master->directory_index) {
+            // If the current directory is the master directory, the file is already a hardlink to the leader there
+            continue;
+        }
+        char *filepath = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the filepath
+        sprintf(filepath, "%s/%s", directories[i], relpath);
+        char *leader_path = malloc_data(strlen(directories[i]) + strlen(leader_relpath) + 2); // Allocate memory for the path of the leader's copy
+        sprintf(leader_path, "%s/%s", directories[i], leader_relpath);
+        bool linked; // A bool that represents whether the copy is already a hardlink to the leader's copy
+        if (flags->no_sync_flag) {
+            // If the -n flag was passed, nothing has been written, so go by what the scan found
+            linked = master->replicas[i].present && leader->replicas[i].present && master->replicas[i].device == leader->replicas[i].device && master->replicas[i].inode == leader->replicas[i].inode;
+        } else {
+            // Otherwise look at the copies as they are now (the leader's copy may have just been replaced)
+            struct stat file_info, leader_info;
+            linked = lstat(filepath, &file_info) == 0 && lstat(leader_path, &leader_info) == 0 && file_info.st_dev == leader_info.st_dev && file_info.st_ino == leader_info.st_ino;
+        }
+        if (linked) {
+            // If the copy is already the same file as the leader's copy, it is up to date
+            replicas_skipped++;
+            add_stat(STAT_COPIES_SKIPPED, 1);
+            VERBOSE_PRINT("Skipped file \"%s\" as it is already a hardlink to file \"%s\"\n", filepath, leader_path);
+        } else if (flags->no_sync_flag || replace_with_link(leader_path, filepath)) {
+            // If the copy could be replaced with a hardlink to the leader's copy, it shares the leader's data, permissions and modification time
+            replicas_copied++;
+            add_stat(STAT_HARDLINKS, 1);
+            VERBOSE_PRINT("Linked file \"%s\" to file \"%s\"\n", filepath, leader_path);
+        } else {
+            // Otherwise copy the master file to it in full
+            char *master_path = malloc_data(strlen(directories[master->directory_index]) + strlen(relpath) + 2); // Allocate memory for the master file path
+            sprintf(master_path, "%s/%s", directories[master->directory_index], relpath);
+            copy_files(master, master_path, &filepath, 1, flags);
+            if (!flags->atomic_flag) {
+                // Give the copy the master file's modification time (and permissions if the -p flag was passed)
+                set_perm_time(filepath, master, flags);
+            }
+            replicas_copied++;
+            add_stat(STAT_COPIES_WRITTEN, 1);
+            free(master_path);
+        }
+        free(filepath);
+        free(leader_path);
+    }
+}
+
+bool same_metadata(File *file, File *other) {
+    // A function that takes two master files, and returns true if they have the same permissions and modification time (so a hardlink to one's copy is a faithful copy of the other)
+    Replica *replica = &file->replicas[file->directory_index];
+    Replica *other_replica = &other->replicas[other->directory_index];
+    return file->permissions == other->permissions && replica->edit_time.tv_sec == other_replica->edit_time.tv_sec && replica->edit_time.tv_nsec == other_replica->edit_time.tv_nsec;
+}
+
+bool same_contents(char *path, char *other_path) {
+    // A function that takes two files, and returns true if their contents are the same byte for byte (the digests --dedup groups files by are only a hint, as a stale cached digest or a collision must never put one file's contents in another's copy)
+    int fd = open(path, O_RDONLY);
+    int other_fd = open(other_path, O_RDONLY);
+    struct stat info, other_info;
+    bool same = fd != -1 && other_fd != -1 && fstat(fd, &info) == 0 && fstat(other_fd, &other_info) == 0 && info.st_size == other_info.st_size;
+    char *buffer = malloc_data(DEDUP_COMPARE_SIZE); // Allocate memory for a chunk of each file
+    char *other_buffer = malloc_data(DEDUP_COMPARE_SIZE);
+    for (long long int offset = 0; same && offset < info.st_size; ) {
+        // Loop through the files a chunk at a time, stopping at the first difference
+        size_t length = info.st_size - offset < DEDUP_COMPARE_SIZE ? info.st_size - offset : DEDUP_COMPARE_SIZE;
+        ssize_t bytes_read = pread(fd, buffer, length, offset);
+        same = bytes_read > 0 && pread(other_fd, other_buffer, bytes_read, offset) == bytes_read && memcmp(buffer, other_buffer, bytes_read) == 0;
+        offset += bytes_read;
+    }
+    free(buffer);
+    free(other_buffer);
+    if (fd != -1) {
+        close(fd);
+    }
+    if (other_fd != -1) {
+        close(other_fd);
+    }
+    return same;
+}
+
+bool clone_replica(char *original_path, char *filepath, File *master, char *master_path, Flags *flags) {
+    // A function that takes the copy of a file, a path, and the master file of the path (and its path), and makes the path a clone of the copy (sharing its blocks, with FICLONE), returning false if the filesystem can't clone it
+    int original_fd = open(original_path, O_RDONLY);
+    if (original_fd == -1) {
+        return false;
+    }
+    char *temp_path = NULL; // The temporary path of the clone (with the --atomic flag)
+    if (!flags->atomic_flag) {
+        break_hardlink(filepath); // The clone is made in place, so a copy that shares its data with other names is unlinked first
+    }
+    int fd = flags->atomic_flag ? open_atomic_replica(filepath, &temp_path) : open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool cloned = fd != -1 && copy_range(COPY_REFLINK, original_fd, fd, 0, LLONG_MAX) != -1;
+    if (cloned && flags->atomic_flag) {
+        // If the --atomic flag was passed, put the clone in place of the old copy (with the master file's modification time, and permissions if the -p flag was passed)
+        set_fd_perm_time(fd, filepath, master, flags);
+        commit_atomic_replica(fd, filepath, temp_path, master_path, flags);
+    } else if (fd != -1) {
+        close(fd);
+        if (temp_path != NULL) {
+            // If the clone failed, remove its temporary file (the old copy is untouched)
+            unlink(temp_path);
+        }
+        free(temp_path);
+    }
+    close(original_fd);
+    return cloned;
+}
+
+void sync_duplicate(File *master, char *relpath, File *original, char *original_relpath, char **directories, int num_directories, Flags *flags) {
+    // A function that takes a master file with the same contents as another master file (the original, whose copies have already been written), their relative paths, an array of directory names, the number of directories, and a flags struct, and makes each stale copy of the file from the original's copy in that directory (a clone, or a hardlink with --dedup=link, copying the master file in full where neither can be made)
+    char *master_path = malloc_data(strlen(directories[master->directory_index]) + strlen(relpath) + 2); // Allocate memory for the master file path
+    sprintf(master_path, "%s/%s", directories[master->directory_index], relpath);
+    Replica *master_replica = &master->replicas[master->directory_index]; // The metadata of the master copy
+    Digest master_digest; // The digest of the master file (for the -c and --verify flags)
+    bool hashed_master = false;
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the directories
+        if (i == master->directory_index) {
+            // If the current directory is the master directory, skip it
+            continue;
+        }
+        bool linked = false; // A bool that represents whether the copy was made a hardlink to the original's copy (which is in place straight away, even with the --atomic flag)
+        char *filepath = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the filepath
+        sprintf(filepath, "%s/%s", directories[i], relpath);
+        bool stale = flags->checksum_flag ? replica_differs(filepath, &master->replicas[i], master_path, master_replica, &master_digest, &hashed_master) : replica_is_stale(&master->replicas[i], master_replica);
+        if (!stale) {
+            // If the copy already has the same contents as the master, skip rewriting it
+            skip_replica(master, i, filepath, master_path, flags);
+            free(filepath);
+            continue;
+        }
+        char *original_path = malloc_data(strlen(directories[i]) + strlen(original_relpath) + 2); // Allocate memory for the path of the original's copy
+        sprintf(original_path, "%s/%s", directories[i], original_relpath);
+        bool matches = flags->no_sync_flag || same_contents(master_path, original_path); // A bool that represents whether the original's copy really has the master file's contents (checked byte for byte before anything is made from it)
+        if (matches && (flags->no_sync_flag || clone_replica(original_path, filepath, master, master_path, flags))) {
+            // If the copy could be cloned from the original's copy, it shares the original's blocks
+            if (!flags->atomic_flag) {
+                set_perm_time(filepath, master, flags);
+            }
+            add_stat(STAT_DEDUP_COPIES, 1);
+            VERBOSE_PRINT("Cloned file \"%s\" from file \"%s\"\n", filepath, original_path);
+        } else if (matches && flags->dedup_mode == DEDUP_LINK && same_metadata(master, original) && replace_with_link(original_path, filepath)) {
+            // If the filesystem can't clone, but hardlinks were allowed and would have the right metadata, make the copy a hardlink to the original's copy
+            linked = true;
+            add_stat(STAT_DEDUP_COPIES, 1);
+            VERBOSE_PRINT("Linked file \"%s\" to file \"%s\"\n", filepath, original_path);
+        } else {
+            // Otherwise copy the master file to it in full (also if the original's copy turned out not to match)
+            copy_files(master, master_path, &filepath, 1, flags);
+            if (!flags->atomic_flag) {
+                set_perm_time(filepath, master, flags);
+            }
+            add_stat(STAT_COPIES_WRITTEN, 1);
+        }
+        replicas_copied++;
+        if (flags->verify_flag && !flags->no_sync_flag && (linked || !flags->atomic_flag)) {
+            // If the --verify flag was passed, hash the copy that was just made and check it matches the master file (an --atomic clone or copy was checked before it was put in place)
+            Digest digest; // The digest of the copy
+            if (!hashed_master) {
+                hashed_master = file_digest(master_path, true, &master_digest);
+            }
+            if (!hashed_master || !file_digest(filepath, false, &digest) || digest.low != master_digest.low || digest.high != master_digest.high) {
+                // If the copy doesn't match the master file, print an error message and exit the program
+                fprintf(stderr, "Error: file \"%s\" does not match master file \"%s\" after copying\n", filepath, master_path);
+                exit(EXIT_FAILURE);
+            }
+            VERBOSE_PRINT("Verified file \"%s\" against master file \"%s\"\n", filepath, master_path);
+        }
+        free(filepath);
+        free(original_path);
+    }
+    free(master_path);
+    add_stat(STAT_FILES_SYNCED, 1);
+}
+
+void print_sync_summary(Flags *flags) {
+    // A function that takes a flags struct, and prints how many copies of files were rewritten and how many were skipped as up to date
+    VERBOSE_PRINT("Summary: %lld file copies written, %lld skipped as already up to date\n", (long long int)replicas_copied, (long long int)replicas_skipped);
 }
@@ -1,30 +1,97 @@
 #include "mysync.h"
 
 // A C file that contains a powerful hashtable implementation that resizes itself when it gets too full
+// The table is open addressed: every entry lives in one flat array of slots (probed in order from the key's hash), holding the key's 64-bit hash so most mismatches are rejected without comparing strings
+// Short keys are stored inside the slot itself, and when the table grows the old slots are moved across a few at a time by later puts and deletes, so no single call pays for rehashing everything
 
 Hashtable *create_hashtable(size_t size) {
-    // A function that takes a size, and returns a hashtable with that size
+    // A function that takes a size, and returns a hashtable with room for at least that many elements
     Hashtable *hashtable = malloc_data(sizeof(Hashtable)); // Allocate memory for the hashtable
-    hashtable->size = size; // Set the size of the hashtable
+    hashtable->size = 16; // The number of slots is always a power of two, so the hash can be masked instead of divided
+    while (hashtable->size * 3 / 4 < size) {
+        hashtable->size *= 2;
+    }
     hashtable->num_elements = 0; // Initialize the number of elements in the hashtable to 0
-    hashtable->table = calloc(size, sizeof(Node *)); // Allocate memory for the table of file nodes (uses calloc so all pointers are initialized to NULL)
+    hashtable->num_used = 0;
+    hashtable->table = calloc(hashtable->size, sizeof(Slot)); // Allocate memory for the slots (uses calloc so every slot starts empty)
     if (hashtable->table == NULL) {
         // If calloc fails, print an error message and exit the program
         fprintf(stderr, "Error: could not allocate memory for hashtable\n");
         free(hashtable);
         exit(EXIT_FAILURE);
     }
+    hashtable->old_table = NULL; // The hashtable isn't being resized
+    hashtable->old_size = 0;
+    hashtable->old_position = 0;
+    hashtable->borrowed = false; // The hashtable owns its keys and data
     return hashtable; // Return the hashtable
 }
 
-unsigned int hash(char *key, int size) {
-    // A function that takes a key and a size, and returns the hash of the key (tries to be as random as possible)
-    unsigned int hash = 5381; // Initialize the hash to 5381 (the sexiest prime number)
-    for (int i = 0; i < strlen(key); i++) {
-        // Loop through the key
-        hash = ((hash << 5) + hash) + key[i]; // Calculate the hash
+Hashtable *create_borrowing_hashtable(size_t size) {
+    // A function that takes a size, and returns a hashtable whose keys and data belong to an arena (long keys must stay valid for as long as the hashtable is used, and nothing is freed by the hashtable)
+    Hashtable *hashtable = create_hashtable(size);
+    hashtable->borrowed = true;
+    return hashtable;
+}
+
+uint64_t hash(char *key, size_t length) {
+    // A function that takes a key and its length, and returns the 64-bit hash of the key (read a word at a time, and never SLOT_EMPTY or SLOT_DELETED)
+    uint64_t hash = 5381 ^ (length * 0x9e3779b97f4a7c15ULL); // Start from the same prime as before (the sexiest prime number), mixed with the length
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        // Loop through the key eight bytes at a time
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        // Loop through the bytes left over at the end
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    }
+    // Finish with an avalanche, so the low bits (used for the slot) depend on every byte
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+    return hash < SLOT_FIRST_HASH ? hash + SLOT_FIRST_HASH : hash;
+}
+
+char *slot_key(Slot *slot) {
+    // A function that takes a full slot, and returns its key (stored in the slot if it is short enough)
+    return slot->key_length < SLOT_INLINE_KEY_SIZE ? slot->inline_key : slot->key;
+}
+
+long long int find_slot(Slot *table, int size, uint64_t key_hash, char *key, size_t length) {
+    // A function that takes a table of slots, its size, and a key (with its hash and length), and returns the index of the slot holding the key (or -1 if it isn't in the table)
+    long long int found = -1;
+    long long int probes = 1; // The number of slots looked at (for the --stats flag)
+    for (long long int index = key_hash & (size - 1);; index = (index + 1) & (size - 1), probes++) {
+        // Probe the slots in order from the key's home slot, until the key or an empty slot is found
+        Slot *slot = &table[index];
+        if (slot->hash == SLOT_EMPTY) {
+            break;
+        }
+        if (slot->hash == key_hash && slot->key_length == length && memcmp(slot_key(slot), key, length) == 0) {
+            found = index;
+            break;
+        }
+    }
+    add_stat(STAT_HASH_LOOKUPS, 1);
+    add_stat(STAT_HASH_PROBES, probes);
+    return found;
+}
+
+Slot *free_slot(Hashtable *hashtable, uint64_t key_hash) {
+    // A function that takes a hashtable and a hash, and returns the first slot on the hash's probe sequence that can take a new key (empty, or deleted)
+    long long int index = key_hash & (hashtable->size - 1);
+    while (hashtable->table[index].hash >= SLOT_FIRST_HASH) {
+        index = (index + 1) & (hashtable->size - 1);
+    }
+    if (hashtable->table[index].hash == SLOT_EMPTY) {
+        // Reusing a deleted slot doesn't use up any more of the table
+        hashtable->num_used++;
     }
-    return hash % size; // Return the hash modulo the size so it is within the range of the table
+    return &hashtable->table[index];
 }
 
 void free_node_data(void *data) {
@@ -39,129 +106,202 @@ void free_node_data(void *data) {
             free(current_index); // Free the current index
             current_index = next_index; // Set the current index to the next index
         }
+    } else if (type == 1) {
+        // If the type is 1, the data is a file struct which also owns its array of replicas
+        free(((File *)data)->replicas);
+    } else if (type == 2) {
+        // If the type is 2, the data owns nothing but itself (a digest_record, or a class or state index while a glob automaton is built)
+    } else {
+        // Otherwise the data is of a type this function doesn't know how to free, so print an error message and exit the program rather than leak or corrupt it
+        fprintf(stderr, "Error: unknown data type %d in hashtable\n", type);
+        exit(EXIT_FAILURE);
     }
     free(data); // Free the memory allocated for the data
 }
 
-void resize(Hashtable **hashtable, size_t size) {
-    // A function that takes a hashtable, and resizes it to the given size
-    Hashtable *new_hashtable = create_hashtable(size); // Create a new hashtable with the given size
-    for (int i = 0; i < (*hashtable)->size; i++) {
-        // Loop through the old hashtable
-        Node *current_node = (*hashtable)->table[i]; // Get the current node
-        Node *temp = NULL; // Initialize a temporary node to NULL
-        while (current_node != NULL) {
-            // Loop through the linked list in the current node
-            put(&new_hashtable, current_node->name, current_node->data); // Put the node into the new hashtable
-            free(current_node->name); // Free the memory allocated for the old node's name
-            temp = current_node; // Set the temporary node to the current node
-            current_node = current_node->next; // Set the current node to the next node
-            free(temp); // Free the memory allocated for the old node
+void resize(Hashtable *);
+
+void move_old_slots(Hashtable *hashtable, int count) {
+    // A function that takes a hashtable that is being resized, and moves up to count slots from the old table into the new one (freeing the old table once it is empty)
+    while (hashtable->old_table != NULL && count-- > 0) {
+        if (hashtable->num_used > 0.75 * hashtable->size) {
+            // If the new table has filled up before the old one is empty (lots of puts straight after a shrink), resize again, which moves everything at once
+            resize(hashtable);
+            return;
+        }
+        Slot *old_slot = &hashtable->old_table[hashtable->old_position++];
+        if (old_slot->hash >= SLOT_FIRST_HASH) {
+            // If the slot is full, move it as it is (the hash is kept, so nothing is rehashed, and long keys keep their memory)
+            *free_slot(hashtable, old_slot->hash) = *old_slot;
+            old_slot->hash = SLOT_DELETED; // The key now only lives in the new table
+        }
+        if (hashtable->old_position == hashtable->old_size) {
+            // If every slot has been moved, the old table is no longer needed
+            free(hashtable->old_table);
+            hashtable->old_table = NULL;
         }
     }
-    // Free the memory allocated for the old hashtable and set the old hashtable to the new hashtable
-    free((*hashtable)->table);
-    free(*hashtable);
-    *hashtable = new_hashtable;
+}
+
+void resize(Hashtable *hashtable) {
+    // A function that takes a hashtable, and starts moving it to a table sized for its elements (larger if it is too full, smaller if it is mostly empty, or the same size to clear out deleted slots)
+    add_stat(STAT_HASH_RESIZES, 1);
+    int size = 16;
+    while (size < (hashtable->num_elements + 1) * 2) {
+        // Leave the new table half empty, so it has room while the old slots are moved across
+        size *= 2;
+    }
+    Slot *table = hashtable->table; // The current slots
+    int table_size = hashtable->size;
+    Slot *old_table = hashtable->old_table; // The slots of a resize that is still going (only if the table changes size very quickly)
+    hashtable->table = calloc(size, sizeof(Slot)); // Allocate memory for the new slots
+    if (hashtable->table == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: could not allocate memory for hashtable\n");
+        exit(EXIT_FAILURE);
+    }
+    hashtable->size = size;
+    hashtable->num_used = 0;
+    if (old_table == NULL) {
+        // If the hashtable isn't already being resized, the current slots are moved across a few at a time by later calls
+        hashtable->old_table = table;
+        hashtable->old_size = table_size;
+        hashtable->old_position = 0;
+        return;
+    }
+    // Otherwise move the current slots and the rest of the old slots straight away
+    for (int i = 0; i < table_size; i++) {
+        if (table[i].hash >= SLOT_FIRST_HASH) {
+            *free_slot(hashtable, table[i].hash) = table[i];
+        }
+    }
+    for (int i = hashtable->old_position; i < hashtable->old_size; i++) {
+        if (old_table[i].hash >= SLOT_FIRST_HASH) {
+            *free_slot(hashtable, old_table[i].hash) = old_table[i];
+        }
+    }
+    free(table);
+    free(old_table);
+    hashtable->old_table = NULL;
+    hashtable->old_size = 0;
+    hashtable->old_position = 0;
 }
 
 void put(Hashtable **hashtable, char *key, void *data) {
     // A function that takes a hashtable, a key, and data, and puts the data into the hashtable with the key
-    unsigned int index = hash(key, (*hashtable)->size); // Get the index of the key
-    // Check for collisions
-    if ((*hashtable)->table[index] == NULL) {
-        // If there are no collisions, put the data in the hashtable
-        Node *new_node = malloc_data(sizeof(Node)); // Allocate memory for the new node
-        new_node->name = strdup(key); // Copy the key into the new node
-        new_node->data = data; // Set the data of the new node to the data
-        new_node->next = NULL; // Set the next node to NULL
-        (*hashtable)->table[index] = new_node; // Set the node in the hashtable to the new node
-    } else {
-        // If there is a collision, loop through the linked list until the end
-        Node *current_node = (*hashtable)->table[index]; // Get the first node in the linked list
-        while (current_node != NULL) {
-            // Loop through the linked list
-            if (strcmp(current_node->name, key) == 0) {
-                // If the key already exists, replace the data
-                free_node_data(current_node->data); // Free the memory allocated for the old data
-                current_node->data = data; // Set the data to the new data
-                return;
-            }
-            current_node = current_node->next; // Set the current node to the next node
+    Hashtable *table = *hashtable;
+    move_old_slots(table, HASHTABLE_MOVE_STEP); // Move a few slots along if the hashtable is being resized
+    size_t length = strlen(key);
+    uint64_t key_hash = hash(key, length); // Get the hash of the key
+    long long int index = find_slot(table->table, table->size, key_hash, key, length);
+    Slot *slot = NULL;
+    if (index != -1) {
+        slot = &table->table[index];
+    } else if (table->old_table != NULL && (index = find_slot(table->old_table, table->old_size, key_hash, key, length)) != -1) {
+        slot = &table->old_table[index];
+    }
+    if (slot != NULL) {
+        // If the key already exists, replace the data
+        if (!table->borrowed) {
+            free_node_data(slot->data); // Free the memory allocated for the old data
         }
-        // If the key doesn't exist, add the node to the beginning of the linked list
-        Node *new_node = malloc_data(sizeof(Node)); // Allocate memory for the new node
-        new_node->name = strdup(key); // Copy the key into the new node
-        new_node->data = data; // Set the data of the new node to the data
-        new_node->next = (*hashtable)->table[index]; // Set the next node to the first node in the linked list
-        (*hashtable)->table[index] = new_node; // Set the node in the hashtable to the new node
-    }
-    (*hashtable)->num_elements++; // Increment the number of elements in the hashtable
-    if ((*hashtable)->num_elements > 0.75*(*hashtable)->size) {
-        // If the hashtable is too full, resize it (double the size)
-        resize(hashtable, (*hashtable)->size * 2);
+        slot->data = data; // Set the data to the new data
+        return;
+    }
+    // If the key doesn't exist, put it in the first free slot on its probe sequence
+    slot = free_slot(table, key_hash);
+    slot->hash = key_hash;
+    slot->data = data;
+    slot->key_length = length;
+    if (length < SLOT_INLINE_KEY_SIZE) {
+        // If the key is short, copy it into the slot
+        memcpy(slot->inline_key, key, length + 1);
+    } else {
+        // Otherwise copy it into its own memory (or use it in place if it belongs to an arena)
+        slot->key = table->borrowed ? key : strdup(key);
+    }
+    table->num_elements++; // Increment the number of elements in the hashtable
+    if (table->num_used > 0.75 * table->size) {
+        // If the hashtable is too full (counting deleted slots, which still lengthen probes), start resizing it
+        resize(table);
     }
 }
 
 void *get(Hashtable *hashtable, char *key) {
-    // A function that takes a hashtable and a key, and returns the data with the key
-    unsigned int index = hash(key, hashtable->size); // Get the index of the key
-    // Check for collisions
-    if (hashtable->table[index] == NULL) {
-        // If there are no collisions, return NULL
-        return NULL;
-    }
-    // If there is a collision, loop through the linked list until the end
-    Node *current_node = hashtable->table[index]; // Get the first node in the linked list
-    while (current_node != NULL) {
-        // Loop through the linked list
-        if (strcmp(current_node->name, key) == 0) {
-            // If the key is found, return the data
-            return current_node->data;
-        }
-        current_node = current_node->next; // Set the current node to the next node
+    // A function that takes a hashtable and a key, and returns the data with the key (without changing the hashtable, so it is safe to call from several threads at once)
+    size_t length = strlen(key);
+    uint64_t key_hash = hash(key, length); // Get the hash of the key
+    long long int index = find_slot(hashtable->table, hashtable->size, key_hash, key, length);
+    if (index != -1) {
+        return hashtable->table[index].data;
+    }
+    if (hashtable->old_table != NULL && (index = find_slot(hashtable->old_table, hashtable->old_size, key_hash, key, length)) != -1) {
+        // If the key hasn't been moved out of the old table yet, it is still there
+        return hashtable->old_table[index].data;
     }
     // If the key is not found, return NULL
     return NULL;
 }
 
-
-
 void delete(Hashtable **hashtable, char *key) {
-    // A function that takes a hashtable and a key, and deletes the node with the key
-    unsigned int index = hash(key, (*hashtable)->size); // Get the index of the key
-    // Check for collisions
-    if ((*hashtable)->table[index] == NULL) {
-        // If there are no collisions, return
+    // A function that takes a hashtable and a key, and deletes the element with the key
+    Hashtable *table = *hashtable;
+    move_old_slots(table, HASHTABLE_MOVE_STEP); // Move a few slots along if the hashtable is being resized
+    size_t length = strlen(key);
+    uint64_t key_hash = hash(key, length); // Get the hash of the key
+    long long int index = find_slot(table->table, table->size, key_hash, key, length);
+    Slot *slot = NULL;
+    if (index != -1) {
+        slot = &table->table[index];
+    } else if (table->old_table != NULL && (index = find_slot(table->old_table, table->old_size, key_hash, key, length)) != -1) {
+        slot = &table->old_table[index];
+    }
+    if (slot == NULL) {
+        // If the key is not found, return
         return;
     }
-    // If there is a collision, loop through the linked list until the end
-    Node *current_node = (*hashtable)->table[index]; // Get the first node in the linked list
-    Node *previous_node = NULL; // Initialize the previous node to NULL
-    while (current_node != NULL) {
-        // Loop through the linked list
-        if (strcmp(current_node->name, key) == 0) {
-            // If the key is found, delete the node
-            free_node_data(current_node->data); // Free the memory allocated for the data
-            free(current_node->name); // Free the memory allocated for the name
-            if (previous_node == NULL) {
-                // If the node is the first node in the linked list, set the first node to the next node
-                (*hashtable)->table[index] = current_node->next;
-            } else {
-                // If the node is not the first node in the linked list, set the previous node's next node to the next node
-                previous_node->next = current_node->next;
-            }
-            free(current_node); // Free the memory allocated for the node
-            (*hashtable)->num_elements--; // Decrement the number of elements in the hashtable
-            if ((*hashtable)->num_elements < 0.25*(*hashtable)->size && (*hashtable)->size > DEFAULT_HASHTABLE_SIZE) {
-                // If the hashtable is too empty, resize it (half the size)
-                resize(hashtable, (*hashtable)->size / 2);
+    if (!table->borrowed) {
+        free_node_data(slot->data); // Free the memory allocated for the data
+        if (slot->key_length >= SLOT_INLINE_KEY_SIZE) {
+            free(slot->key); // Free the memory allocated for a long key
+        }
+    }
+    slot->hash = SLOT_DELETED; // Mark the slot as deleted rather than empty, so probes for other keys carry on past it
+    table->num_elements--; // Decrement the number of elements in the hashtable
+    if (table->old_table == NULL && table->num_elements < 0.125 * table->size && table->size > 16) {
+        // If the hashtable is mostly empty, start shrinking it
+        resize(table);
+    }
+}
+
+void *hashtable_next(Hashtable *hashtable, int *position) {
+    // A function that takes a hashtable and a position (0 to start), and returns the data of the next element in the hashtable and moves the position past it (or returns NULL once every element has been returned)
+    while (*position < hashtable->size + (hashtable->old_table == NULL ? 0 : hashtable->old_size)) {
+        // Loop through the slots of the table, and then the old table
+        Slot *slot = *position < hashtable->size ? &hashtable->table[*position] : &hashtable->old_table[*position - hashtable->size];
+        (*position)++;
+        if (slot->hash >= SLOT_FIRST_HASH) {
+            return slot->data;
+        }
+    }
+    return NULL;
+}
+
+void free_hashtable(Hashtable *hashtable) {
+    // A function that takes a hashtable, and frees it along with every element left in it (unless the elements belong to an arena)
+    for (int i = 0; i < 2; i++) {
+        // Loop through the table and the old table
+        Slot *slots = i == 0 ? hashtable->table : hashtable->old_table;
+        int size = i == 0 ? hashtable->size : hashtable->old_size;
+        for (int j = 0; slots != NULL && !hashtable->borrowed && j < size; j++) {
+            if (slots[j].hash >= SLOT_FIRST_HASH) {
+                free_node_data(slots[j].data);
+                if (slots[j].key_length >= SLOT_INLINE_KEY_SIZE) {
+                    free(slots[j].key);
+                }
             }
-            return;
         }
-        previous_node = current_node; // Set the previous node to the current node
-        current_node = current_node->next; // Set the current node to the next node
+        free(slots);
     }
-    // If the key is not found, return
-    return;
+    free(hashtable);
 }
@@ -1,217 +1,597 @@
 #include "mysync.h"
 
-Hashtable *hashtable = NULL; // A hashtable that maps relative paths to either a File or a Dir_indexes
+Path_tree *path_tree = NULL; // A tree of the names of every file and directory found, each node holding either a File or a Dir_indexes
 
-Relpaths *file_head = NULL; // A linked list of relative paths to files (for easy retrieval from the hashtable), the files are added in the order they are found, ensuring they are synced in the correct order (not as necessary as directories, but still useful)
-Relpaths *file_tail = NULL;
+Path_node *file_head = NULL; // A linked list of the files found (threaded through their nodes), the files are added in the order they are found, ensuring they are synced in the correct order (not as necessary as directories, but still useful)
+Path_node *file_tail = NULL;
 
-Relpaths *dir_head = NULL; // A linked list of relative paths to directories (for easy retrieval from the hashtable), the directories are added in the order they are found, ensuring they are created in the correct order
-Relpaths *dir_tail = NULL;
+Path_node *dir_head = NULL; // A linked list of the directories found (threaded through their nodes), the directories are added in the order they are found, ensuring they are created in the correct order
+Path_node *dir_tail = NULL;
 
-void add_relpath(Relpaths **head, Relpaths **tail, char *relpath) {
-    // A function that takes a head and tail pointer to a linked list of relative paths, and a relative path, and adds the relative path to the end of the linked list
-    Relpaths *new_relpath = malloc_data(sizeof(Relpaths)); // Allocate memory for the new relative path
-    new_relpath->relpath = strdup(relpath); // Copy the relative path into the new relative path
-    new_relpath->next = NULL; // Set the next relative path to NULL
+int num_roots = 0; // The number of root directories being synced (the length of each file's replicas array)
+
+Hashtable *link_leaders = NULL; // The first master file synced for each file with several hardlinks (keyed by its root, device and inode, for the --hardlinks flag)
+Hardlink *link_head = NULL; // A linked list of the master files that are hardlinks to a file already synced, linked once every copy has been written
+Hardlink *link_tail = NULL;
+
+Hashtable *dedup_sizes = NULL; // The first master file copied as usual of each size that could have identical files (keyed by its size, for the --dedup flag)
+Duplicate *duplicate_head = NULL; // A linked list of the master files identical to a file already synced, whose copies are made from that file's copies once every copy has been written
+Duplicate *duplicate_tail = NULL;
+
+Arena *scan_arena = NULL; // An arena that holds every node, name, File, Dir_indexes and Index of the sync (all freed at once when the sync is finished)
+
+Replica *create_replicas(void) {
+    // A function that allocates a replicas array with one entry per root directory, with every entry marked as not present
+    Replica *replicas = arena_alloc(scan_arena, num_roots * sizeof(Replica)); // Allocate memory for the replicas array
+    for (int i = 0; i < num_roots; i++) {
+        // Loop through the root directories and mark the file as missing from each of them
+        replicas[i].present = false;
+    }
+    return replicas;
+}
+
+void set_replica(Replica *replica, struct stat *file_info) {
+    // A function that takes a replica and a file's info, and records the metadata of that copy of the file
+    replica->present = true; // The file exists in this root directory
+    replica->permissions = file_info->st_mode; // Set the permissions to the permissions of this copy
+    replica->size = file_info->st_size; // Set the size to the size of this copy
+    replica->edit_time = file_info->st_mtim; // Set the edit time to the nanosecond modification time of this copy
+    replica->device = file_info->st_dev; // Set the device, inode and link count, so copies that are the same file can be found
+    replica->inode = file_info->st_ino;
+    replica->links = file_info->st_nlink;
+}
+
+bool is_newer(struct timespec *time, struct timespec *than) {
+    // A function that takes two modification times, and returns true if the first is later than the second (comparing the seconds, then the nanoseconds, so an edit made in the same second as another still wins)
+    if (time->tv_sec != than->tv_sec) {
+        return time->tv_sec > than->tv_sec;
+    }
+    return time->tv_nsec > than->tv_nsec;
+}
+
+void add_node(Path_node **head, Path_node **tail, Path_node *node) {
+    // A function that takes a head and tail pointer to a linked list of nodes, and a node, and adds the node to the end of the linked list
     if (*head == NULL) {
-        // If the head is NULL (the linked list is empty), set the head and tail to the new relative path
-        *head = new_relpath;
-        *tail = new_relpath;
+        // If the head is NULL (the linked list is empty), set the head and tail to the new node
+        *head = node;
+        *tail = node;
     } else {
-        // If the head is not NULL (the linked list is not empty), set the next relative path of the tail to the new relative path, and set the tail to the new relative path
-        (*tail)->next = new_relpath;
-        *tail = new_relpath;
+        // If the head is not NULL (the linked list is not empty), set the next node of the tail to the new node, and set the tail to the new node
+        (*tail)->next = node;
+        *tail = node;
     }
 }
 
-bool read_directory(char *directory, char *base_dir, int base_dir_index, Flags *flags) {
-    // A function that takes a directory, a base directory, a base directory index, and a flags struct, and reads the directory, adding the files and directories to the hashtable
-    bool found_files = false; // A bool that represents whether any files were found in the directory (initialised to false)
-    DIR *dir = opendir(directory); // Open the directory
-    if (dir == NULL) {
-        // If the directory could not be opened, print an error message and exit the program
-        fprintf(stderr, "Error: could not open directory \"%s\"\n", directory);
+bool skip_directory(Scan_entry *entry, Flags *flags) {
+    // A function that takes a directory's entry and a flags struct, and returns whether the scan skipped the directory (printing why with the -v flag)
+    if (entry->skip_reason == SCAN_SKIP_DIRECTORY) {
+        // If the -r flag was not passed, skip the directory
+        VERBOSE_PRINT("Skipping directory \"%s\"\n", entry->name);
+        return true;
+    }
+    if (entry->skip_reason == SCAN_SKIP_IGNORED) {
+        // If the directory matches an ignore pattern, skip it (it was never read)
+        VERBOSE_PRINT("Skipping directory \"%s\" as it matches an ignore pattern\n", entry->name);
+        return true;
+    }
+    if (entry->skip_reason == SCAN_SKIP_NOT_ONLY) {
+        // If nothing within the directory could match an only pattern, skip it (it was never read)
+        VERBOSE_PRINT("Skipping directory \"%s\" as nothing in it can match an only pattern\n", entry->name);
+        return true;
+    }
+    VERBOSE_PRINT("Found directory \"%s\"\n", entry->name);
+    return false;
+}
+
+bool skip_file(Scan_entry *entry, Flags *flags) {
+    // A function that takes a file's entry and a flags struct, and returns whether the scan skipped the file (printing why with the -v flag)
+    if (entry->skip_reason == SCAN_SKIP_HIDDEN) {
+        // If the filename starts with a '.', and the -a flag was not passed, skip the file
+        VERBOSE_PRINT("Skipping hidden file \"%s\"\n", entry->name);
+        return true;
+    }
+    if (entry->skip_reason == SCAN_SKIP_TEMPORARY) {
+        // If the file is a temporary file of mysync's, skip the file
+        VERBOSE_PRINT("Skipping temporary file \"%s\"\n", entry->name);
+        return true;
+    }
+    if (entry->skip_reason == SCAN_SKIP_IGNORED) {
+        // If the file matches an ignore pattern, skip the file
+        VERBOSE_PRINT("Skipping file \"%s\" as it matches an ignore pattern\n", entry->name);
+        return true;
+    }
+    if (entry->skip_reason == SCAN_SKIP_NOT_ONLY) {
+        // If the file does not match an only pattern, skip the file
+        VERBOSE_PRINT("Skipping file \"%s\" as it does not match an only pattern\n", entry->name);
+        return true;
+    }
+    VERBOSE_PRINT("Found file \"%s\"\n", entry->name);
+    return false;
+}
+
+Path_node *find_directory(Path_node *directory, char *filename) {
+    // A function that takes a directory's node and the name of a subdirectory, and returns the subdirectory's node, adding it to the tree (and to the linked list of directories) if it isn't there yet
+    Path_node *node = find_child(path_tree, directory, filename); // Check if the directory is already in the tree
+    if (node == NULL) {
+        node = add_child(path_tree, directory, filename, NULL); // Add the directory to the tree (its Dir_indexes is filled in once it has been found in a root)
+        add_node(&dir_head, &dir_tail, node); // Immediately add the directory to the linked list of directories (to ensure that the directories are added in the correct order) if it is not already in the tree
+    } else if (node->data != NULL && *(int *)node->data != 0) {
+        // If the type is not 0, the data is not a dir_indexes struct, so print an error message and exit the program
+        fprintf(stderr, "Error: key \"%s\" doesn't map to a directory\n", relpath_of(node));
         exit(EXIT_FAILURE);
     }
-    struct dirent *entry; // A struct that represents a directory entry
-    struct stat file_info; // A struct that represents a file's info
-    VERBOSE_PRINT("Reading directory \"%s\"\n", directory);
-    while ((entry = readdir(dir)) != NULL) {
-        // Loop through the directory entries
-        char *filename = entry->d_name; // Get the filename
-        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
-            // If the filename is "." or "..", skip it as it is not a file or directory
-            continue;
-        }
-        char *filepath = malloc_data(strlen(directory) + strlen(filename) + 2); // Allocate memory for the filepath
-        sprintf(filepath, "%s/%s", directory, filename); // Create the filepath by concatenating the directory and the filename
-        if (stat(filepath, &file_info) == -1) {
-            // If stat fails, print an error message and exit the program
-            fprintf(stderr, "Error: could not get file info for file \"%s\"\n", filepath);
-            free(filepath);
-            exit(EXIT_FAILURE);
-        }
-        char *relpath = strdup(filepath + strlen(base_dir) + 1); // Create the relative path by copying the filepath, and removing the base directory from the start
-        if (S_ISDIR(file_info.st_mode)) {
+    return node;
+}
+
+void add_directory_index(Path_node *node, int base_dir_index, Scan_dir *listing, bool valid, Flags *flags) {
+    // A function that takes a directory's node, a base directory index, the directory's listing in that base directory, whether files were found in it, and a flags struct, and records that the directory exists in the base directory
+    Index *new_index = arena_alloc(scan_arena, sizeof(Index)); // Allocate memory for the new index
+    new_index->index = base_dir_index; // Set the index to the base directory index
+    new_index->listing = listing; // Keep the listing (only until the directory is merged, with the --pipeline flag)
+    new_index->next = NULL; // Set the next index to NULL
+    if (node->data == NULL) {
+        // If the directory was not already in the tree, give it a dir_indexes struct
+        Dir_indexes *new_dir_indexes = arena_alloc(scan_arena, sizeof(Dir_indexes)); // Allocate memory for the new dir_indexes struct
+        new_dir_indexes->type_id = 0; // Set the type_id to 0 (so it can be checked when casting)
+        new_dir_indexes->valid = valid; // Set the valid bool to whether files were found in the directory
+        new_dir_indexes->head = new_index; // Set the head of the linked list of indexes to the new index
+        new_dir_indexes->tail = new_index; // Set the tail of the linked list of indexes to the new index
+        new_dir_indexes->unlisted = 0;
+        node->data = new_dir_indexes;
+        VERBOSE_PRINT("Added directory \"%s\" to hashtable\n", relpath_of(node));
+    } else {
+        Dir_indexes *current_dir_indexes = (Dir_indexes *)node->data; // Cast the data to a dir_indexes struct
+        current_dir_indexes->valid |= valid; // If files were found in the directory, set the valid bool to true
+        current_dir_indexes->tail->next = new_index; // Set the next index of the tail of the linked list of indexes to the new index
+        current_dir_indexes->tail = new_index; // Set the tail of the linked list of indexes to the new index
+        VERBOSE_PRINT("Added directory \"%s\"'s index to hashtable\n", relpath_of(node));
+    }
+}
+
+void merge_file(Scan_entry *entry, Path_node *directory, int base_dir_index, Flags *flags) {
+    // A function that takes a file's entry, the node of the directory it is in, a base directory index, and a flags struct, and merges the file into the path tree (newest file wins)
+    char *filename = entry->name; // Get the filename
+    struct stat file_info = entry->info; // Get the file's info
+    Path_node *node = find_child(path_tree, directory, filename); // Check if the file is already in the tree
+    if (node == NULL) {
+        // If the file is not already in the tree, add it to the tree
+        File *new_file = arena_alloc(scan_arena, sizeof(File)); // Allocate memory for the new file
+        new_file->type_id = 1; // Set the type_id to 1 (so it can be checked when casting)
+        new_file->directory_index = base_dir_index; // Set the directory index to the base directory index
+        new_file->size = file_info.st_size; // Set the size to the size of the file
+        new_file->permissions = file_info.st_mode; // Set the permissions to the permissions of the file
+        new_file->edit_time = file_info.st_mtime; // Set the edit time to the modification time of the file
+        new_file->replicas = create_replicas(); // Allocate the per-root metadata of the file
+        set_replica(&new_file->replicas[base_dir_index], &file_info); // Record the metadata of this copy of the file
+        node = add_child(path_tree, directory, filename, new_file); // Add the file to the tree
+        add_node(&file_head, &file_tail, node); // Immediately add the file to the linked list of files (to ensure that the files are synced in the correct order, although this is not as necessary as directories)
+        VERBOSE_PRINT("Added file \"%s\" to hashtable\n", relpath_of(node));
+        return;
+    }
+    // If the file is already in the tree, check if the file is a newer version
+    int type = *(int *)node->data; // Cast the data to an int to get the type
+    if (type != 1) {
+        // If the type is not 1, the data is not a file struct, so print an error message and exit the program
+        fprintf(stderr, "Error: key \"%s\" doesn't map to a file\n", relpath_of(node));
+        exit(EXIT_FAILURE);
+    }
+    File *current_file = (File *)node->data; // Cast the data to a file struct
+    set_replica(&current_file->replicas[base_dir_index], &file_info); // Record the metadata of this copy of the file (whether or not it is the newest)
+    Replica *master_replica = &current_file->replicas[current_file->directory_index]; // The metadata of the newest copy so far
+    if (is_newer(&file_info.st_mtim, &master_replica->edit_time)) {
+        // If the modification time of the file is greater than the modification time of the file in the tree, update the file in the tree
+        current_file->size = file_info.st_size; // Update the size of the file
+        current_file->permissions = file_info.st_mode; // Update the permissions of the file
+        current_file->edit_time = file_info.st_mtime; // Update the modification time of the file
+        current_file->directory_index = base_dir_index; // Update the directory index of the file
+        VERBOSE_PRINT("Updated file \"%s\" in hashtable as it is a newer version\n", relpath_of(node));
+    } else {
+        VERBOSE_PRINT("Didn't update file \"%s\" in hashtable as it is an older version\n", relpath_of(node));
+    }
+}
+
+bool merge_directory(Scan_dir *listing, Path_node *directory, char *base_dir, int base_dir_index, Flags *flags) {
+    // A function that takes the listing of a directory, the directory's node, a base directory, a base directory index, and a flags struct, and merges the listing into the path tree (newest file wins), returning whether any files were found in the directory
+    bool found_files = false; // A bool that represents whether any files were found in the directory (initialised to false)
+    VERBOSE_PRINT("Reading directory \"%s%s%s\"\n", base_dir, directory->length == 0 ? "" : "/", relpath_of(directory));
+    for (int i = 0; i < listing->num_entries; i++) {
+        // Loop through the directory entries (in the order they were read from the directory)
+        Scan_entry *entry = &listing->entries[i]; // Get the entry
+        if (S_ISDIR(entry->info.st_mode)) {
             // If the file is a directory
-            if (!flags->recursive_flag) {
-                // If the -r flag was not passed, skip the directory
-                VERBOSE_PRINT("Skipping directory \"%s\"\n", filename);
-                free(filepath);
-                free(relpath);
+            if (skip_directory(entry, flags)) {
                 continue;
             }
-            VERBOSE_PRINT("Found directory \"%s\"\n", filename);
-            void *data = get(hashtable, relpath); // Check if the directory is already in the hashtable
-            if (data == NULL) {
-                add_relpath(&dir_head, &dir_tail, relpath); // Immediately add the directory to the linked list of directories (to ensure that the directories are added in the correct order) if it is not already in the hashtable
-            }
-            bool result = read_directory(filepath, base_dir, base_dir_index, flags); // Recursively read the directory, passing in the directory path, the base directory, the base directory index, and the flags struct
+            Path_node *node = find_directory(directory, entry->name); // Find the directory in the tree (adding it if it is new)
+            bool result = merge_directory(entry->listing, node, base_dir, base_dir_index, flags); // Recursively merge the listing of the directory, passing in its node, the base directory, the base directory index, and the flags struct
             found_files |= result; // Set the found_files variable to true if any files were found in the subdirectory (making the current directory not empty)
-            if (data == NULL) {
-                // If the directory is not already in the hashtable, add it to the hashtable
-                Dir_indexes *new_dir_indexes = malloc_data(sizeof(Dir_indexes)); // Allocate memory for the new dir_indexes struct
-                new_dir_indexes->type_id = 0; // Set the type_id to 0 (so it can be checked when casting)
-                new_dir_indexes->valid = result; // Set the valid bool to the result of the recursive call
-                Index *new_index = malloc_data(sizeof(Index)); // Allocate memory for the new index
-                new_index->index = base_dir_index; // Set the index to the base directory index
-                new_index->next = NULL; // Set the next index to NULL
-                new_dir_indexes->head = new_index; // Set the head of the linked list of indexes to the new index
-                new_dir_indexes->tail = new_index; // Set the tail of the linked list of indexes to the new index
-                put(&hashtable, relpath, new_dir_indexes); // Put the new dir_indexes struct into the hashtable
-                VERBOSE_PRINT("Added directory \"%s\" to hashtable\n", relpath);
-            } else {
-                int type = *(int *)data; // Cast the data to an int to get the type
-                if (type != 0) {
-                    // If the type is not 0, the data is not a dir_indexes struct, so print an error message and exit the program
-                    fprintf(stderr, "Error: key \"%s\" doesn't map to a directory\n", relpath);
-                    free(filepath);
-                    free(relpath);
-                    exit(EXIT_FAILURE);
-                }
-                Dir_indexes *current_dir_indexes = (Dir_indexes *)data; // Cast the data to a dir_indexes struct
-                current_dir_indexes->valid |= result; // If the result of the recursive call is true, set the valid bool to true
-                Index *new_index = malloc_data(sizeof(Index)); // Allocate memory for the new index
-                new_index->index = base_dir_index; // Set the index to the base directory index
-                new_index->next = NULL; // Set the next index to NULL
-                current_dir_indexes->tail->next = new_index; // Set the next index of the tail of the linked list of indexes to the new index
-                current_dir_indexes->tail = new_index; // Set the tail of the linked list of indexes to the new index
-                VERBOSE_PRINT("Added directory \"%s\"'s index to hashtable\n", relpath);
-            }
-        } else if (S_ISREG(file_info.st_mode)) {
+            add_directory_index(node, base_dir_index, NULL, result, flags); // Record that the directory is in this base directory
+        } else if (S_ISREG(entry->info.st_mode)) {
             // If the file is a regular file
-            if (filename[0] == '.' && !flags->all_flag) {
-                // If the filename starts with a '.', and the -a flag was not passed, skip the file
-                VERBOSE_PRINT("Skipping hidden file \"%s\"\n", filename);
-                free(filepath);
-                free(relpath);
-                continue;
-            }
-            if (flags->ignore1 != NULL && check_patterns(flags->ignore1, filename)) {
-                // If the file matches an ignore pattern, skip the file
-                VERBOSE_PRINT("Skipping file \"%s\" as it matches an ignore pattern\n", filename);
-                free(filepath);
-                free(relpath);
+            if (skip_file(entry, flags)) {
                 continue;
             }
-            if (flags->only1 != NULL && !check_patterns(flags->only1, filename)) {
-                // If the file does not match an only pattern, skip the file
-                VERBOSE_PRINT("Skipping file \"%s\" as it does not match an only pattern\n", filename);
-                free(filepath);
-                free(relpath);
-                continue;
-            }
-            VERBOSE_PRINT("Found file \"%s\"\n", filename);
             found_files = true; // Set the found_files variable to true (as a file was found in the directory)
-            void *data = get(hashtable, relpath); // Check if the file is already in the hashtable
-            if (data == NULL) {
-                // If the file is not already in the hashtable, add it to the hashtable
-                add_relpath(&file_head, &file_tail, relpath); // Immediately add the file to the linked list of files (to ensure that the files are synced in the correct order, although this is not as necessary as directories) if it is not already in the hashtable
-                File *new_file = malloc_data(sizeof(File)); // Allocate memory for the new file
-                new_file->type_id = 1; // Set the type_id to 1 (so it can be checked when casting)
-                new_file->directory_index = base_dir_index; // Set the directory index to the base directory index
-                new_file->size = file_info.st_size; // Set the size to the size of the file
-                new_file->permissions = file_info.st_mode; // Set the permissions to the permissions of the file
-                new_file->edit_time = file_info.st_mtime; // Set the edit time to the modification time of the file
-                put(&hashtable, relpath, new_file); // Put the new file into the hashtable
-                VERBOSE_PRINT("Added file \"%s\" to hashtable\n", relpath);
-            } else {
-                // If the file is already in the hashtable, check if the file is a newer version
-                int type = *(int *)data; // Cast the data to an int to get the type
-                if (type != 1) {
-                    // If the type is not 1, the data is not a file struct, so print an error message and exit the program
-                    fprintf(stderr, "Error: key \"%s\" doesn't map to a file\n", relpath);
-                    free(filepath);
-                    free(relpath);
-                    exit(EXIT_FAILURE);
+            merge_file(entry, directory, base_dir_index, flags);
+        }
+    }
+    // Return whether any files were found in the directory (important for the recursive calls)
+    return found_files;
+}
+
+void create_wanted_directory(Path_node *directory, char **directories, Flags *flags) {
+    // A function that takes the node of a directory files were found in, an array of directory names, and a flags struct, and creates the directory (and any of the directories it is in that haven't been created yet, outermost first) in the roots it doesn't exist in
+    if (directory->parent == NULL) {
+        // The roots themselves always exist
+        return;
+    }
+    Dir_indexes *dir_indexes = (Dir_indexes *)directory->data;
+    if (dir_indexes->valid) {
+        // If the directory is already known to be wanted, it (and every directory it is in) has already been created
+        return;
+    }
+    dir_indexes->valid = true;
+    create_wanted_directory(directory->parent, directories, flags); // Create the directories it is in first
+    create_directories(dir_indexes, relpath_of(directory), directories, num_roots, flags);
+}
+
+bool defer_hardlink(Path_node *node, char *relpath, Flags *flags) {
+    // A function that takes the node of a master file, its relative path, and a flags struct, and returns true if the file is a hardlink to a master file that has already been handed to the copy workers (it is then linked to that file's copies once they are written, rather than copied), or false if the file should be synced as usual
+    File *file = (File *)node->data;
+    Replica *master_replica = &file->replicas[file->directory_index];
+    if (!flags->hardlinks_flag || master_replica->links < 2) {
+        // If the --hardlinks flag wasn't passed or the file has only one name, sync it as usual
+        return false;
+    }
+    char key[64]; // The root the master file is in and its device and inode (files are only linked to files whose master is the same file in the same root)
+    sprintf(key, "%d:%llx:%llx", file->directory_index, (unsigned long long int)master_replica->device, (unsigned long long int)master_replica->inode);
+    Hardlink *leader = get(link_leaders, key);
+    Hardlink *link = arena_alloc(scan_arena, sizeof(Hardlink));
+    link->file = file;
+    link->relpath = arena_strdup(scan_arena, relpath);
+    link->leader = leader;
+    link->next = NULL;
+    if (leader == NULL) {
+        // If this is the first name of the file, it is copied as usual, and the names after it are linked to it
+        put(&link_leaders, arena_strdup(scan_arena, key), link);
+        return false;
+    }
+    // Otherwise wait for the first name's copies to be written, and link to them
+    if (link_head == NULL) {
+        link_head = link;
+    } else {
+        link_tail->next = link;
+    }
+    link_tail = link;
+    VERBOSE_PRINT("Syncing file \"%s\" as a hardlink to file \"%s\"\n", relpath, leader->relpath);
+    return true;
+}
+
+void link_deferred_files(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and makes every file that was held back as a hardlink into a hardlink to its first name's copy in each root (once every copy has been written)
+    for (Hardlink *link = link_head; link != NULL; link = link->next) {
+        // Loop through the files held back, in the order they were found
+        sync_link(link->file, link->relpath, link->leader->file, link->leader->relpath, directories, num_directories, flags);
+    }
+    link_head = link_tail = NULL; // The links are in the arena, which is freed with the rest of the sync
+}
+
+bool hash_master(Duplicate *candidate, char **directories) {
+    // A function that takes a candidate for the --dedup flag and an array of directory names, and works out the digest of its master file if it hasn't been already, returning false if the master file couldn't be read
+    if (!candidate->hashed) {
+        char *master_path = malloc_data(strlen(directories[candidate->file->directory_index]) + strlen(candidate->relpath) + 2); // Allocate memory for the master file path
+        sprintf(master_path, "%s/%s", directories[candidate->file->directory_index], candidate->relpath);
+        candidate->hashed = file_digest(master_path, true, &candidate->digest);
+        free(master_path);
+    }
+    return candidate->hashed;
+}
+
+bool defer_duplicate(Path_node *node, char *relpath, char **directories, int num_directories, Flags *flags) {
+    // A function that takes the node of a master file, its relative path, an array of directory names, the number of directories, and a flags struct, and returns true if the file has the same contents as a master file that has already been handed to the copy workers (its copies are then made from that file's copies once they are written), or false if the file should be synced as usual
+    File *file = (File *)node->data;
+    if (flags->dedup_mode == DEDUP_OFF || file->size < DEDUP_MIN_SIZE) {
+        // If the --dedup flag wasn't passed or the file is too small to be worth hashing, sync it as usual
+        return false;
+    }
+    char key[32]; // The size of the file (only files of the same size are hashed and compared)
+    sprintf(key, "%lld", file->size);
+    Duplicate *first = get(dedup_sizes, key);
+    Duplicate *duplicate = arena_alloc(scan_arena, sizeof(Duplicate));
+    duplicate->file = file;
+    duplicate->relpath = arena_strdup(scan_arena, relpath);
+    duplicate->hashed = false;
+    duplicate->original = NULL;
+    duplicate->next_same_size = NULL;
+    duplicate->next = NULL;
+    if (first == NULL) {
+        // If this is the first file of its size, it is copied as usual without being hashed (most files never meet another of the same size)
+        put(&dedup_sizes, arena_strdup(scan_arena, key), duplicate);
+        return false;
+    }
+    bool stale = flags->checksum_flag; // A bool that represents whether any copy of the file may need rewriting (with the -c flag that can't be known without reading them)
+    for (int i = 0; i < num_directories && !stale; i++) {
+        stale = i != file->directory_index && replica_is_stale(&file->replicas[i], &file->replicas[file->directory_index]);
+    }
+    Duplicate *last = first; // The last file of the size (the file joins the list after it)
+    for (Duplicate *candidate = first; candidate != NULL; candidate = candidate->next_same_size) {
+        // Loop through the files of the same size, looking for one with the same digest if a copy needs rewriting (hashing each file only once, the first time it is compared, and the files are compared byte for byte before a copy is made from the other's)
+        last = candidate;
+        if (!stale || (duplicate->original != NULL && (flags->dedup_mode != DEDUP_LINK || same_metadata(file, duplicate->original->file)))) {
+            // If a file that will do has been found already, just find the end of the list (with --dedup=link, one whose copies can be linked to is looked for)
+            continue;
+        }
+        if (hash_master(duplicate, directories) && hash_master(candidate, directories) && duplicate->digest.low == candidate->digest.low && duplicate->digest.high == candidate->digest.high
+            && (duplicate->original == NULL || same_metadata(file, candidate->file))) {
+            duplicate->original = candidate;
+        }
+    }
+    last->next_same_size = duplicate;
+    if (duplicate->original == NULL) {
+        // If no file has the same contents (or every copy is up to date), the file is copied as usual
+        return false;
+    }
+    // Otherwise wait for the identical file's copies to be written, and make the file's copies from them
+    if (duplicate_head == NULL) {
+        duplicate_head = duplicate;
+    } else {
+        duplicate_tail->next = duplicate;
+    }
+    duplicate_tail = duplicate;
+    VERBOSE_PRINT("Syncing file \"%s\" as a duplicate of file \"%s\"\n", relpath, duplicate->original->relpath);
+    return true;
+}
+
+void sync_deferred_duplicates(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and makes the copies of every file that was held back as a duplicate from the copies of the identical file (once every copy has been written)
+    for (Duplicate *duplicate = duplicate_head; duplicate != NULL; duplicate = duplicate->next) {
+        // Loop through the files held back, in the order they were found
+        if (flags->atomic_flag && !flags->no_sync_flag) {
+            // If the --atomic flag was passed, put the copies written so far in place first, as the file's copies are made from the original's (which may be a duplicate itself)
+            place_pending_replicas(flags);
+        }
+        sync_duplicate(duplicate->file, duplicate->relpath, duplicate->original->file, duplicate->original->relpath, directories, num_directories, flags);
+    }
+    duplicate_head = duplicate_tail = NULL; // The duplicates are in the arena, which is freed with the rest of the sync
+}
+
+void merge_listed_directory(Path_node *directory, char **directories, Flags *flags) {
+    // A function that takes the node of a directory every root has finished listing, an array of directory names, and a flags struct, and merges the directory's listings (in the order of the roots, so the same copy wins as without the --pipeline flag), creates the directory if files were found in it, hands its files to the copy workers, and then merges any of its subdirectories that have been listed already
+    Path_node *last_file = file_tail; // The last file and directory found before this directory (the ones found after it are in it)
+    Path_node *last_dir = dir_tail;
+    bool found_files = false; // A bool that represents whether any files were found in the directory itself
+    struct timespec merge_start; // The time the merge started (for the --stats flag)
+    start_stat_timer(&merge_start);
+    for (Index *index = ((Dir_indexes *)directory->data)->head; index != NULL; index = index->next) {
+        // Loop through the roots the directory exists in, merging the listing of each
+        Scan_dir *listing = index->listing;
+        VERBOSE_PRINT("Reading directory \"%s%s%s\"\n", directories[index->index], directory->length == 0 ? "" : "/", relpath_of(directory));
+        for (int i = 0; i < listing->num_entries; i++) {
+            // Loop through the directory entries (in the order they were read from the directory)
+            Scan_entry *entry = &listing->entries[i]; // Get the entry
+            if (S_ISDIR(entry->info.st_mode)) {
+                // If the file is a directory, record that it is in this root (its own entries are merged once every root has listed it)
+                if (skip_directory(entry, flags)) {
+                    continue;
+                }
+                Path_node *node = find_directory(directory, entry->name);
+                add_directory_index(node, index->index, entry->listing, false, flags);
+                entry->listing->node = node; // So the directory can be found when its listing finishes
+                if (!entry->listing->listed) {
+                    ((Dir_indexes *)node->data)->unlisted++;
                 }
-                File *current_file = (File *)data; // Cast the data to a file struct
-                if (file_info.st_mtime > current_file->edit_time) {
-                    // If the modification time of the file is greater than the modification time of the file in the hashtable, update the file in the hashtable
-                    current_file->size = file_info.st_size; // Update the size of the file
-                    current_file->permissions = file_info.st_mode; // Update the permissions of the file
-                    current_file->edit_time = file_info.st_mtime; // Update the modification time of the file
-                    current_file->directory_index = base_dir_index; // Update the directory index of the file
-                    VERBOSE_PRINT("Updated file \"%s\" in hashtable as it is a newer version\n", relpath);
-                } else {
-                    VERBOSE_PRINT("Didn't update file \"%s\" in hashtable as it is an older version\n", relpath);
+            } else if (S_ISREG(entry->info.st_mode)) {
+                // If the file is a regular file, merge it
+                if (skip_file(entry, flags)) {
+                    continue;
                 }
+                found_files = true;
+                merge_file(entry, directory, index->index, flags);
             }
         }
-        // Free the memory allocated for the filepath and relative path
-        free(filepath);
-        free(relpath);
+        index->listing = NULL; // The listing is no longer needed
+    }
+    stop_stat_timer(STAT_TIME_MERGE, &merge_start);
+    if (found_files) {
+        // If files were found in the directory, it is wanted, so create it (and the directories it is in) wherever it doesn't exist yet
+        create_wanted_directory(directory, directories, flags);
+    }
+    for (Path_node *current_file = last_file == NULL ? file_head : last_file->next; current_file != NULL; current_file = current_file->next) {
+        // Loop through the files found in the directory, handing each of them to the copy workers (every root's copy of them is known now)
+        char *relpath = relpath_of(current_file);
+        if (defer_hardlink(current_file, relpath, flags) || defer_duplicate(current_file, relpath, directories, num_roots, flags)) {
+            continue;
+        }
+        VERBOSE_PRINT("Syncing file \"%s\"\n", relpath);
+        submit_copy((File *)current_file->data, relpath);
+    }
+    if (dir_tail == last_dir) {
+        // If no subdirectories were found, there is nothing left to merge
+        return;
+    }
+    Path_node *last_subdirectory = dir_tail; // The last subdirectory found in the directory (the merges below add more directories after it)
+    for (Path_node *node = last_dir == NULL ? dir_head : last_dir->next; ; node = node->next) {
+        // Loop through the subdirectories, merging any that every root has already listed
+        if (((Dir_indexes *)node->data)->unlisted == 0) {
+            merge_listed_directory(node, directories, flags);
+        }
+        if (node == last_subdirectory) {
+            break;
+        }
     }
-    // Close the directory and return whether any files were found in the directory (important for the recursive calls)
-    closedir(dir);
-    return found_files;
+}
+
+void pipeline_directories(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and scans the directories on another thread while merging each directory as soon as every root has listed it, so its directories are created and its files copied while the rest of the roots are still being scanned
+    Dir_indexes *root_indexes = arena_alloc(scan_arena, sizeof(Dir_indexes)); // The roots are merged like any other directory (every root has it)
+    root_indexes->type_id = 0;
+    root_indexes->valid = true;
+    root_indexes->head = root_indexes->tail = NULL;
+    root_indexes->unlisted = num_directories;
+    path_tree->root.data = root_indexes;
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the roots, giving each an index (its listing is filled in once it has been listed)
+        Index *new_index = arena_alloc(scan_arena, sizeof(Index));
+        new_index->index = i;
+        new_index->listing = NULL;
+        new_index->next = NULL;
+        if (root_indexes->head == NULL) {
+            root_indexes->head = new_index;
+        } else {
+            root_indexes->tail->next = new_index;
+        }
+        root_indexes->tail = new_index;
+    }
+    start_pipelined_scan(directories, num_directories, flags); // Start listing the roots
+    Scan_dir *listing;
+    while ((listing = next_listed_directory()) != NULL) {
+        // Loop through the directories as they finish listing
+        listing->listed = true;
+        Path_node *node = listing->node; // The directory's node (NULL if its parent hasn't been merged yet, in which case it is counted as listed when it is)
+        if (listing->parent == NULL) {
+            // If the directory is a root, give the listing to the root's index
+            node = &path_tree->root;
+            Index *index = root_indexes->head;
+            while (index->index != listing->root_index) {
+                index = index->next;
+            }
+            index->listing = listing;
+        }
+        if (node != NULL && --((Dir_indexes *)node->data)->unlisted == 0) {
+            // If this was the last root the directory was waiting for, merge it
+            merge_listed_directory(node, directories, flags);
+        }
+    }
+    Scan_dir **listings = finish_pipelined_scan(); // Wait for the scan to finish (it writes the scan caches once everything is listed)
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the listings of the roots and free them, now that everything in them is in the path tree
+        free_listing(listings[i]);
+    }
+    free(listings);
+    path_tree->root.data = NULL;
 }
 
 void sync_directories(char **directories, int num_directories, Flags *flags) {
     // A function that takes an array of directory names, the number of directories, and a flags struct, and syncs the directories
-    hashtable = create_hashtable(DEFAULT_HASHTABLE_SIZE); // Create the hashtable
-    for (int i=0; i<num_directories; i++) {
-        // Loop through the directories
-        read_directory(directories[i], directories[i], i, flags); // Read the current directory
-    }
-    if (flags->verbose_flag) {
-        // If the -v flag was passed, print the directories and files found
-        printf("Directories found:\n");
-        print_all(hashtable, dir_head, directories);
-        printf("Master files found:\n");
-        print_all(hashtable, file_head, directories);
-    }
-    // Loop through the directory linked list
-    Relpaths *current_dir = dir_head; // Set the current directory to the head of the linked list
-    Relpaths *temp = NULL; // A temporary variable to store the next directory
-    while (current_dir != NULL) {
+    struct timespec sync_start, phase_start; // The times the sync and its current phase started (for the --stats flag)
+    start_stat_timer(&sync_start);
+    scan_arena = create_arena(); // Create the arena the sync's metadata is allocated from
+    path_tree = create_path_tree(scan_arena); // Create the tree of names (its nodes are in the arena too)
+    num_roots = num_directories; // Every file keeps metadata for each of the root directories
+    if (flags->hardlinks_flag) {
+        // If the --hardlinks flag was passed, keep track of the first name of each file with several hardlinks (the keys and links are in the arena)
+        link_leaders = create_borrowing_hashtable(DEFAULT_HASHTABLE_SIZE);
+    }
+    if (flags->dedup_mode != DEDUP_OFF) {
+        // If the --dedup flag was passed, keep track of the files of each size copied as usual (the keys and files are in the arena)
+        dedup_sizes = create_borrowing_hashtable(DEFAULT_HASHTABLE_SIZE);
+    }
+    if (flags->checksum_flag || flags->verify_flag || flags->dedup_mode != DEDUP_OFF) {
+        // If the -c, --verify or --dedup flag was passed, load the digests remembered from earlier runs
+        load_digests(flags);
+    }
+    if (flags->pipeline_flag) {
+        // If the --pipeline flag was passed, merge each directory as soon as every root has listed it, creating directories and copying files while the scan carries on
+        start_stat_timer(&phase_start); // The scan, merge and copy overlap, so the copy is timed from the start
+        start_copy_pool(directories, num_directories, flags); // Start the copy workers (if the -j flag asked for more than one thread)
+        pipeline_directories(directories, num_directories, flags);
+        finish_copy_pool(); // Wait for every file to be synced, as the files can only be freed once no worker is using them
+        stop_stat_timer(STAT_TIME_COPY, &phase_start);
+        if (flags->verbose_flag) {
+            // If the -v flag was passed, print the directories and files found (only now, as they aren't all known until the scan has finished)
+            printf("Directories found:\n");
+            print_all(dir_head, directories);
+            printf("Master files found:\n");
+            print_all(file_head, directories);
+        }
+        for (Path_node *current_dir = dir_head; flags->watch_flag && current_dir != NULL; current_dir = current_dir->next) {
+            // If the --watch flag was passed, watch every directory in every root for changes (now that every wanted directory has been created)
+            watch_directory(relpath_of(current_dir), directories, num_directories);
+        }
+    } else {
+        Scan_dir **listings = scan_roots(directories, num_directories, flags); // List every directory in every root (in parallel if the -j flag was passed)
+        start_stat_timer(&phase_start);
+        for (int i=0; i<num_directories; i++) {
+            // Loop through the directories in order, so the merge is the same however many threads listed them
+            merge_directory(listings[i], &path_tree->root, directories[i], i, flags); // Merge the listing of the current directory into the path tree
+            free_listing(listings[i]); // Free the listing now that it is in the path tree
+        }
+        free(listings);
+        stop_stat_timer(STAT_TIME_MERGE, &phase_start);
+        if (flags->verbose_flag) {
+            // If the -v flag was passed, print the directories and files found
+            printf("Directories found:\n");
+            print_all(dir_head, directories);
+            printf("Master files found:\n");
+            print_all(file_head, directories);
+        }
         // Loop through the directory linked list
-        Dir_indexes *current_dir_indexes = (Dir_indexes *)get(hashtable, current_dir->relpath); // Get the directory indexes from the hashtable and cast them to a dir_indexes struct
-        if (current_dir_indexes->valid) {
-            // If the directory is not empty, create the directories in the locations they don't exist (aren't in the directory indexes)
-            create_directories(current_dir_indexes, current_dir->relpath, directories, num_directories, flags);
-        }
-        delete(&hashtable, current_dir->relpath); // Delete the directory from the hashtable
-        temp = current_dir->next; // Store the next directory
-        free(current_dir->relpath); // Free the memory allocated for the relative path
-        free(current_dir); // Free the memory allocated for the directory
-        current_dir = temp; // Set the current directory to the next directory
-    }
-    // Loop through the file linked list
-    Relpaths *current_file = file_head; // Set the current file to the head of the linked list
-    while (current_file != NULL) {
-        // Loop through the file linked list
-        File *current_file_info = (File *)get(hashtable, current_file->relpath); // Get the file from the hashtable and cast it to a file struct
-        VERBOSE_PRINT("Syncing file \"%s\"\n", current_file->relpath);
-        sync_master(current_file_info, current_file->relpath, directories, num_directories, flags); // Sync the file
-        delete(&hashtable, current_file->relpath); // Delete the file from the hashtable
-        temp = current_file->next; // Store the next file
-        free(current_file->relpath); // Free the memory allocated for the relative path
-        free(current_file); // Free the memory allocated for the file
-        current_file = temp; // Set the current file to the next file
+        Path_node *current_dir = dir_head; // Set the current directory to the head of the linked list
+        while (current_dir != NULL) {
+            // Loop through the directory linked list
+            Dir_indexes *current_dir_indexes = (Dir_indexes *)current_dir->data; // Get the directory indexes from the directory's node and cast them to a dir_indexes struct
+            if (current_dir_indexes->valid) {
+                // If the directory is not empty, create the directories in the locations they don't exist (aren't in the directory indexes)
+                create_directories(current_dir_indexes, relpath_of(current_dir), directories, num_directories, flags);
+            }
+            if (flags->watch_flag) {
+                // If the --watch flag was passed, watch the directory in every root for changes
+                watch_directory(relpath_of(current_dir), directories, num_directories);
+            }
+            current_dir = current_dir->next; // Set the current directory to the next directory
+        }
+        // Loop through the file linked list, handing each file to the copy workers
+        start_stat_timer(&phase_start);
+        start_copy_pool(directories, num_directories, flags); // Start the copy workers (if the -j flag asked for more than one thread)
+        Path_node *current_file = file_head; // Set the current file to the head of the linked list
+        while (current_file != NULL) {
+            // Loop through the file linked list
+            File *current_file_info = (File *)current_file->data; // Get the file from its node and cast it to a file struct
+            char *relpath = relpath_of(current_file); // Spell out the file's relative path (only now, as the copy is about to need it)
+            if (!defer_hardlink(current_file, relpath, flags) && !defer_duplicate(current_file, relpath, directories, num_directories, flags)) {
+                // If the file isn't linked to or identical to a file synced before it, sync it (or queue it for a worker)
+                VERBOSE_PRINT("Syncing file \"%s\"\n", relpath);
+                submit_copy(current_file_info, relpath);
+            }
+            current_file = current_file->next; // Set the current file to the next file
+        }
+        finish_copy_pool(); // Wait for every file to be synced, as the files can only be freed once no worker is using them
+        stop_stat_timer(STAT_TIME_COPY, &phase_start);
+    }
+    if (flags->dedup_mode != DEDUP_OFF) {
+        // If the --dedup flag was passed, make the copies of the files that were held back from the copies of the files identical to them (before the hardlinks, which may be links to them)
+        sync_deferred_duplicates(directories, num_directories, flags);
+        free_hashtable(dedup_sizes);
+        dedup_sizes = NULL;
+    }
+    if (flags->hardlinks_flag) {
+        // If the --hardlinks flag was passed, link the files that were held back to the copies of their first names (now that every copy is written, and with the --atomic flag put in place)
+        if (flags->atomic_flag && !flags->no_sync_flag) {
+            place_pending_replicas(flags);
+        }
+        link_deferred_files(directories, num_directories, flags);
+        free_hashtable(link_leaders);
+        link_leaders = NULL;
+    }
+    if (flags->atomic_flag && !flags->no_sync_flag) {
+        // If the --atomic flag was passed, flush the copies written since the last flush, so every copy of the sync is on disk before it finishes
+        flush_replicas(flags, true);
+    }
+    for (Path_node *current_file = file_head; flags->watch_flag && current_file != NULL; current_file = current_file->next) {
+        // If the --watch flag was passed, loop through the files again and remember the state of each file's copies, so the events the sync raised can be told apart from real changes
+        remember_file(relpath_of(current_file), directories, num_directories);
+    }
+    if (flags->checksum_flag || flags->verify_flag || flags->dedup_mode != DEDUP_OFF) {
+        // If the -c, --verify or --dedup flag was passed, save the digests for the next run
+        save_digests(flags);
     }
     VERBOSE_PRINT("All files synced\n");
-    // Free the memory allocated for the hashtable
-    free(hashtable->table);
-    free(hashtable);
+    print_sync_summary(flags); // Print how many copies were made and how many were skipped
+    stop_stat_timer(STAT_TIME_TOTAL, &sync_start);
+    print_stats(); // Print the counters and timers of the sync (if the --stats flag was passed)
+    free_path_tree(path_tree); // Free the tables of the path tree
+    free_arena(scan_arena); // Free every node, name, file and directory at once
+    // Empty the linked lists, so the directories can be synced again (--watch does a full sync if it misses changes)
+    file_head = file_tail = NULL;
+    dir_head = dir_tail = NULL;
 }
\ No newline at end of file
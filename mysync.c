@@ -19,26 +19,95 @@ int main(int argc, char **argv) {
     flags->copy_perm_time_flag = false;
     flags->recursive_flag = false;
     flags->verbose_flag = false;
+    flags->num_threads = 1;
+    flags->copy_method = COPY_AUTO;
+    flags->cache_dir = NULL;
+    flags->watch_flag = false;
+    flags->debounce_ms = DEFAULT_DEBOUNCE_MS;
+    flags->checksum_flag = false;
+    flags->verify_flag = false;
+    flags->delta_threshold = 0;
+    flags->uring_flag = false;
+    flags->queue_depth = URING_DEFAULT_DEPTH;
+    flags->atomic_flag = false;
+    flags->flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+    flags->pipeline_flag = false;
+    flags->stats_format = STATS_OFF;
+    flags->sparse_flag = false;
+    flags->split_threshold = 0;
+    flags->stream_flag = false;
+    flags->hardlinks_flag = false;
+    flags->direct_flag = false;
+    flags->dedup_mode = DEDUP_OFF;
     opterr = 0; // Stop getopt from printing error messages
+    struct option long_options[] = {
+        // The options that have a long form
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"watch", no_argument, NULL, OPT_WATCH},
+        {"debounce", required_argument, NULL, OPT_DEBOUNCE},
+        {"delta", required_argument, NULL, OPT_DELTA},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"io-uring", no_argument, NULL, OPT_IO_URING},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"atomic", no_argument, NULL, OPT_ATOMIC},
+        {"flush-interval", required_argument, NULL, OPT_FLUSH_INTERVAL},
+        {"pipeline", no_argument, NULL, OPT_PIPELINE},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"sparse", no_argument, NULL, OPT_SPARSE},
+        {"split", required_argument, NULL, OPT_SPLIT},
+        {"stream", no_argument, NULL, OPT_STREAM},
+        {"direct", no_argument, NULL, OPT_DIRECT},
+        {"hardlinks", no_argument, NULL, OPT_HARDLINKS},
+        {"dedup", optional_argument, NULL, OPT_DEDUP},
+        {NULL, 0, NULL, 0}
+    };
     int opt; // The current option
-    while ((opt = getopt(argc, argv, "ai:no:prv")) != -1) {
+    while ((opt = getopt_long(argc, argv, "aci:j:m:no:prv", long_options, NULL)) != -1) {
         // Loop through the options
         switch (opt) {
             case 'a':
                 // Set the all flag to true
                 flags->all_flag = true;
                 break;
+            case 'c':
+                // Set the checksum flag to true
+                flags->checksum_flag = true;
+                break;
             case 'i':
-                // Add the pattern to the ignore1 linked list
+                // Add the glob to the ignore1 set
                 enqueue_pattern(&(flags->ignore1), optarg);
                 break;
+            case 'j':
+                // Set the number of threads to scan with
+                flags->num_threads = atoi(optarg);
+                if (flags->num_threads < 1) {
+                    // Print an error message and exit the program if the number of threads is not a positive number
+                    fprintf(stderr, "Error: invalid number of threads \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case 'm':
+                // Set the method to copy files with
+                flags->copy_method = parse_copy_method(optarg);
+                if (flags->copy_method == -1) {
+                    // Print an error message and exit the program if the method is not one of the known methods
+                    fprintf(stderr, "Error: unknown copy method \"%s\" (expected auto, reflink, copy_file_range, splice, sendfile or readwrite)\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
             case 'n':
                 // Set the no sync flag and the verbose flag to true
                 flags->no_sync_flag = true;
                 flags->verbose_flag = true;
                 break;
             case 'o':
-                // Add the pattern to the only1 linked list
+                // Add the glob to the only1 set
                 enqueue_pattern(&(flags->only1), optarg);
                 break;
             case 'p':
@@ -53,9 +122,145 @@ int main(int argc, char **argv) {
                 // Set the verbose flag to true
                 flags->verbose_flag = true;
                 break;
+            case OPT_CACHE:
+                // Set the directory to keep the scan caches in
+                flags->cache_dir = optarg;
+                break;
+            case OPT_WATCH:
+                // Set the watch flag to true
+                flags->watch_flag = true;
+                break;
+            case OPT_DEBOUNCE:
+                // Set how long to wait for changes to stop before syncing them
+                flags->debounce_ms = atoi(optarg);
+                if (flags->debounce_ms < 1) {
+                    // Print an error message and exit the program if the interval is not a positive number
+                    fprintf(stderr, "Error: invalid debounce interval \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_VERIFY:
+                // Set the verify flag to true
+                flags->verify_flag = true;
+                break;
+            case OPT_DELTA:
+                // Set the smallest master file to update copies of with a delta transfer
+                flags->delta_threshold = parse_size(optarg);
+                if (flags->delta_threshold < 1) {
+                    // Print an error message and exit the program if the size is not a positive number
+                    fprintf(stderr, "Error: invalid delta transfer size \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_IO_URING:
+                // Set the io_uring flag to true
+                flags->uring_flag = true;
+                break;
+            case OPT_QUEUE_DEPTH:
+                // Set how many requests each thread's io_uring can have in flight
+                flags->queue_depth = atoi(optarg);
+                if (flags->queue_depth < 1) {
+                    // Print an error message and exit the program if the depth is not a positive number
+                    fprintf(stderr, "Error: invalid queue depth \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_ATOMIC:
+                // Set the atomic flag to true
+                flags->atomic_flag = true;
+                break;
+            case OPT_FLUSH_INTERVAL:
+                // Set how many milliseconds to let pass between flushes of the filesystems written to
+                flags->flush_interval_ms = atoi(optarg);
+                if (flags->flush_interval_ms < 0) {
+                    // Print an error message and exit the program if the interval is negative
+                    fprintf(stderr, "Error: invalid flush interval \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_PIPELINE:
+                // Set the pipeline flag to true
+                flags->pipeline_flag = true;
+                break;
+            case OPT_STATS:
+                // Set the format to report the counters and timers of each sync in (text unless json is asked for)
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    flags->stats_format = STATS_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    flags->stats_format = STATS_JSON;
+                } else {
+                    // Print an error message and exit the program if the format is not one of the two
+                    fprintf(stderr, "Error: invalid stats format \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_SPARSE:
+                // Set the sparse flag to true
+                flags->sparse_flag = true;
+                break;
+            case OPT_SPLIT:
+                // Set the smallest master file to copy in ranges on several threads at once
+                flags->split_threshold = parse_size(optarg);
+                if (flags->split_threshold < 1) {
+                    // Print an error message and exit the program if the size is not a positive number
+                    fprintf(stderr, "Error: invalid split size \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
+            case OPT_STREAM:
+                // Set the stream flag to true
+                flags->stream_flag = true;
+                break;
+            case OPT_DIRECT:
+                // Set the direct flag to true, and the stream flag too (for the copies and filesystems that can't use O_DIRECT)
+                flags->direct_flag = true;
+                flags->stream_flag = true;
+                break;
+            case OPT_HARDLINKS:
+                // Set the hardlinks flag to true
+                flags->hardlinks_flag = true;
+                break;
+            case OPT_DEDUP:
+                // Set how the copies of files identical to a file synced before them are made (clones unless hardlinks are allowed too)
+                if (optarg == NULL || strcmp(optarg, "clone") == 0) {
+                    flags->dedup_mode = DEDUP_CLONE;
+                } else if (strcmp(optarg, "link") == 0) {
+                    flags->dedup_mode = DEDUP_LINK;
+                } else {
+                    // Print an error message and exit the program if the mode is not one of the two
+                    fprintf(stderr, "Error: invalid dedup mode \"%s\"\n", optarg);
+                    free_patterns(flags->ignore1);
+                    free_patterns(flags->only1);
+                    free(flags);
+                    return 1;
+                }
+                break;
             case '?':
                 // Print an error message and exit the program if an unknown option is passed
-                fprintf(stderr, "Unknown option -%c.\n", optopt);
+                if (optopt == 0) {
+                    // Long options have no option character, so print the whole option
+                    fprintf(stderr, "Unknown option %s.\n", argv[optind - 1]);
+                } else {
+                    fprintf(stderr, "Unknown option -%c.\n", optopt);
+                }
                 free_patterns(flags->ignore1);
                 free_patterns(flags->only1);
                 free(flags);
@@ -69,6 +274,15 @@ int main(int argc, char **argv) {
                 abort();
         }
     }
+    if (flags->watch_flag && (flags->hardlinks_flag || flags->dedup_mode != DEDUP_OFF)) {
+        // Print an error message and exit the program if --watch is combined with --hardlinks or --dedup (files resynced as they change are copied one at a time, so their copies couldn't be linked or cloned)
+        fprintf(stderr, "Error: --watch can't be used with --hardlinks or --dedup\n");
+        free_patterns(flags->ignore1);
+        free_patterns(flags->only1);
+        free(flags);
+        return 1;
+    }
+    enable_stats(flags->stats_format); // Start counting (if the --stats flag was passed)
     int num_directories = argc - optind; // Set the number of directories to the number of command line arguments minus the number of options
     if (num_directories < 2) {
         // Print an error message and exit the program if there are not enough directories
@@ -88,7 +302,7 @@ int main(int argc, char **argv) {
                 // Loop through the array of directory names and free the memory allocated for each of them
                 free(directories[j]);
             }
-            // Free the memory allocated for the array of directory names, the ignore1 linked list, the only1 linked list, and the flags struct
+            // Free the memory allocated for the array of directory names, the ignore1 set, the only1 set, and the flags struct
             free(directories);
             free_patterns(flags->ignore1);
             free_patterns(flags->only1);
@@ -97,15 +311,29 @@ int main(int argc, char **argv) {
         }
         directories[i] = strdup(argv[i+optind]); // Add the directory name to the array of directory names
     }
+    if (flags->uring_flag && !uring_supported(flags->queue_depth)) {
+        // If the --io-uring flag was passed but the kernel can't do what is needed through io_uring, fall back to the ordinary system calls
+        fprintf(stderr, "Warning: io_uring is not available, using ordinary system calls instead\n");
+        flags->uring_flag = false;
+    }
+    if (flags->watch_flag) {
+        // If the --watch flag was passed, start watching the roots before the first sync, so no change made during it is missed
+        start_watching(directories, num_directories, flags);
+    }
     sync_directories(directories, num_directories, flags); // Sync the directories
+    if (flags->watch_flag) {
+        // If the --watch flag was passed, keep syncing the files that change (until the program is killed)
+        watch_directories(directories, num_directories, flags);
+    }
     for (int i = 0; i < num_directories; i++) {
         // Loop through the array of directory names and free the memory allocated for each of them
         free(directories[i]);
     }
-    // Free the memory allocated for the array of directory names, the ignore1 linked list, the only1 linked list, and the flags struct
+    // Free the memory allocated for the array of directory names, the ignore1 set, the only1 set, and the flags struct
     free(directories);
     free_patterns(flags->ignore1);
     free_patterns(flags->only1);
+    release_thread_uring(); // Free the main thread's io_uring (if it had one)
     free(flags);
     return 0; // Exit the program
 }
\ No newline at end of file
@@ -1,17 +1,32 @@
 #ifndef MYSYNC_H
 #define MYSYNC_H
 
-#define _POSIX_C_SOURCE     200809L
+#define _GNU_SOURCE // For the Linux specific copy calls (copy_file_range, sendfile, FICLONE), which also gives everything in POSIX 2008
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
 #include <utime.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/io_uring.h>
 
 #ifndef _SC_PAGESIZE
 // If _SC_PAGESIZE is not defined, define it as 4096
@@ -19,6 +34,143 @@
 #endif
 
 #define DEFAULT_HASHTABLE_SIZE 100
+#define SLOT_EMPTY 0 // The hash of a hashtable slot that has never been used
+#define SLOT_DELETED 1 // The hash of a hashtable slot whose key was deleted
+#define SLOT_FIRST_HASH 2 // The smallest hash a key can have (so it can't be mistaken for the two above)
+#define SLOT_INLINE_KEY_SIZE 20 // Keys shorter than this are stored in the slot itself
+#define ARENA_FIRST_BLOCK_SIZE (64 * 1024) // The size of the first block of an arena (each block after is twice the size of the last)
+#define ARENA_MAX_BLOCK_SIZE (64 * 1024 * 1024) // The largest block an arena grows to
+#define ARENA_ALIGNMENT 16 // The alignment of everything allocated from an arena
+#define PATH_TREE_FIRST_SIZE 1024 // The first size of the table a path tree finds the names in each directory with (a power of two)
+#define HASHTABLE_MOVE_STEP 32 // The slots moved out of the old table by each put or delete while the hashtable is being resized
+#define SCAN_MAX_HELD_FDS 256 // The most subdirectories the scan keeps open while they wait to be read (any more are opened by their path when they are read)
+#define SCAN_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME) // The fields the scan asks statx for with the --io-uring flag (only what the merge and scan cache use)
+#define MAX_QUEUED_JOBS 1024 // The most files that can be waiting for a copy worker at once
+#define MAX_INFLIGHT_BYTES (256LL * 1024 * 1024) // The most bytes of master files that can be queued or being copied at once
+
+// The methods files can be copied with, from fastest to slowest
+#define COPY_AUTO 0 // Probe each pair of filesystems for the fastest method that works
+#define COPY_REFLINK 1 // Share the master's blocks with the copy (FICLONE)
+#define COPY_FILE_RANGE 2 // Copy inside the kernel with copy_file_range
+#define COPY_SPLICE 3 // Splice the master into a pipe once and tee it out to every copy
+#define COPY_SENDFILE 4 // Copy through the page cache with sendfile
+#define COPY_READ_WRITE 5 // Read the master into a buffer and write it to every copy
+#define COPY_URING 6 // The buffered loop run through io_uring (used in its place with the --io-uring flag, so it can't be forced with -m)
+
+#define SPLICE_PIPE_SIZE (1024 * 1024) // The size asked for the pipes used by the splice fan-out
+#define COPY_MIN_BUFFER_SIZE (64 * 1024) // The smallest buffer the buffered loop copies a master file through (unless the file is smaller)
+#define COPY_MAX_BUFFER_SIZE (4 * 1024 * 1024) // The biggest buffer the buffered loop copies a master file through
+#define COPY_BUFFERS_PER_FILE 64 // The buffered loop grows its buffer until a master file takes at most this many reads (between the two sizes above)
+#define DIRECT_IO_ALIGNMENT 4096 // The alignment of the buffers, offsets and lengths of O_DIRECT reads and writes (a multiple of every logical block size)
+#define STREAM_WINDOW_SIZE (8 * 1024 * 1024) // How much the buffered loop copies between writing back and dropping what it copied from the page cache with the --stream flag
+#define SPLIT_RANGE_SIZE (64LL * 1024 * 1024) // The size of the ranges a master file is split into with the --split flag (a multiple of every block size, so the ranges stay aligned)
+#define SPLIT_BUFFER_SIZE (1024 * 1024) // The size of the buffer each thread copies a range through when it can't be copied inside the kernel
+#define SPLIT_DEFAULT_THREADS 4 // The threads a split master file is copied on if the -j flag didn't ask for more than one
+#define SPARSE_BLOCK_SIZE 4096 // The size of the blocks checked for zeros with the --sparse flag (a block of zeros is left as a hole in the copies)
+
+#define URING_DEFAULT_DEPTH 64 // The requests each thread's io_uring can have in flight, unless the --queue-depth flag is passed
+#define URING_BUFFER_SIZE (256 * 1024) // The size of each buffer a master file is read into by an io_uring copy
+#define URING_MAX_BUFFERS 16 // The most buffers one io_uring copy reads ahead into
+#define URING_READ_TAG 0xffff // The destination in the tag of an io_uring copy's read (any other value is the index of the copy being written)
+
+#define ATOMIC_MAX_PENDING 256 // The most new copies --atomic keeps open waiting for a flush before flushing early (each holds a file descriptor until it is put in place)
+#define TEMP_NAME_MARKER ".mysync-" // What the hidden temporary names of copies being written contain, before the pid and a counter (such files are never synced)
+#define DEFAULT_FLUSH_INTERVAL_MS 1000 // How often --atomic flushes the filesystems copies are written to, unless the --flush-interval flag is passed
+
+// The formats the --stats flag can report in
+#define STATS_OFF 0 // Nothing is counted (the default)
+#define STATS_TEXT 1 // A summary is printed after each sync
+#define STATS_JSON 2 // One line of JSON is printed after each sync
+
+// The counters and timers kept with the --stats flag (see stats.c, the timers are in nanoseconds)
+#define STAT_ENTRIES_SCANNED 0 // Entries read from directories or the scan cache
+#define STAT_DIRECTORIES_SCANNED 1 // Directories listed
+#define STAT_STAT_CALLS 2 // Entries stat'ed by the scan
+#define STAT_OPEN_CALLS 3 // Directories opened by the scan
+#define STAT_URING_SUBMITS 4 // Batches of statx requests submitted by the scan
+#define STAT_PATTERN_CHECKS 5 // Names and paths checked against the -i/-o globs
+#define STAT_HASH_LOOKUPS 6 // Lookups in the hashtables and the path tree's table of children
+#define STAT_HASH_PROBES 7 // Slots looked at by those lookups
+#define STAT_HASH_RESIZES 8 // Times those tables were resized
+#define STAT_DIRECTORIES_CREATED 9 // Directories created in the roots
+#define STAT_FILES_SYNCED 10 // Master files synced
+#define STAT_COPIES_WRITTEN 11 // Copies of files rewritten
+#define STAT_COPIES_SKIPPED 12 // Copies of files skipped as up to date
+#define STAT_DELTA_COPIES 13 // Copies updated with a delta transfer
+#define STAT_BYTES_WRITTEN 14 // Bytes written to copies
+#define STAT_HARDLINKS 15 // Copies of files recreated as hardlinks (with the --hardlinks flag)
+#define STAT_DEDUP_COPIES 16 // Copies of files cloned from or linked to the copy of an identical file (with the --dedup flag)
+#define STAT_TIME_SCAN 17 // Time spent listing the roots
+#define STAT_TIME_MERGE 18 // Time spent merging the listings
+#define STAT_TIME_DIRECTORIES 19 // Time spent creating directories
+#define STAT_TIME_COPY 20 // Time from the first file handed to the copy workers until the last one was synced
+#define STAT_TIME_FLUSH 21 // Time spent flushing the filesystems written to (with the --atomic flag)
+#define STAT_TIME_TOTAL 22 // Time spent on the whole sync
+#define NUM_STATS 23
+#define STATS_HISTOGRAM_BUCKETS 32 // The buckets of the histogram of file sync times (bucket i counts the files that took under 2^i microseconds, and at least half that)
+
+// The ways the --dedup flag can make a copy of a file from the copy of an identical file
+#define DEDUP_OFF 0 // Every file is copied from its master (the --dedup flag wasn't passed)
+#define DEDUP_CLONE 1 // The copy shares the blocks of the identical file's copy (FICLONE), or is copied in full where it can't
+#define DEDUP_LINK 2 // As DEDUP_CLONE, but where a clone can't be made the copy is a hardlink to the identical file's copy (if their masters have the same permissions and modification time)
+#define DEDUP_COMPARE_SIZE (1024 * 1024) // The bytes of each file read at a time when --dedup checks that a file and the copy it is made from match byte for byte
+#define DEDUP_MIN_SIZE 4096 // The smallest master file the --dedup flag looks for an identical file for (smaller files are copied faster than they are hashed)
+
+#define DELTA_MIN_BLOCK_SIZE 2048 // The smallest block a copy is compared against its master file in by --delta
+#define DELTA_MAX_BLOCK_SIZE (128 * 1024) // The largest block (used for files of 16GiB and up)
+
+// The layout of the content hash used by -c and --verify (see digest.c)
+#define HASH_STRIPE_SIZE 64 // The bytes mixed into the eight lanes at a time
+#define HASH_STRIPES_PER_BLOCK 16 // The stripes between each scramble of the lanes
+#define HASH_BLOCK_SIZE (HASH_STRIPE_SIZE * HASH_STRIPES_PER_BLOCK)
+#define HASH_READ_SIZE (1024 * 1024) // The bytes read from a file at a time while hashing it (a whole number of blocks)
+#define HASH_PRIME32 0x9e3779b1U // The prime the lanes are multiplied by when they are scrambled
+#define HASH_SCRAMBLE_KEY 23 // The word of the key the scramble starts at (after the keys of the 16 stripes, which overlap)
+#define HASH_LOW_KEY 31 // The word of the key the low half of the digest is merged with
+#define HASH_HIGH_KEY 39 // The word of the key the high half of the digest is merged with
+#define HASH_SECRET_WORDS 48
+
+#define DIGEST_CACHE_MAGIC "MYSYNCDG" // The first bytes of the digest cache file
+#define DIGEST_CACHE_VERSION 2 // The version of the digest cache layout (a cache from another version is ignored)
+
+#define SCAN_CACHE_MAGIC "MYSYNCSC" // The first bytes of every scan cache file
+#define SCAN_CACHE_VERSION 1 // The version of the scan cache layout (a cache from another version is ignored)
+
+#define GLOB_MAX_STATES 4096 // The most states the automaton of a set of globs is given a table for
+#define GLOB_STATE_DEAD 0 // A state of the automaton that can't lead to a match
+#define GLOB_STATE_LIVE 1 // A state that isn't a match but can still lead to one
+#define GLOB_STATE_ACCEPT 2 // A state that is a match
+#define GLOB_STATE_SETTLED 3 // A state that is a match whatever follows it
+
+// The codes of the options that only have a long form
+#define OPT_CACHE 256 // --cache=DIR
+#define OPT_WATCH 257 // --watch
+#define OPT_DEBOUNCE 258 // --debounce=MS
+#define OPT_DELTA 259 // --delta=SIZE
+#define OPT_VERIFY 260 // --verify
+#define OPT_IO_URING 261 // --io-uring
+#define OPT_QUEUE_DEPTH 262 // --queue-depth=N
+#define OPT_ATOMIC 263 // --atomic
+#define OPT_FLUSH_INTERVAL 264 // --flush-interval=MS
+#define OPT_PIPELINE 265 // --pipeline
+#define OPT_STATS 266 // --stats[=text|json]
+#define OPT_SPARSE 267 // --sparse
+#define OPT_SPLIT 268 // --split=SIZE
+#define OPT_STREAM 269 // --stream
+#define OPT_DIRECT 270 // --direct
+#define OPT_HARDLINKS 271 // --hardlinks
+#define OPT_DEDUP 272 // --dedup[=clone|link]
+
+#define DEFAULT_DEBOUNCE_MS 500 // How long --watch waits for changes to stop before syncing them
+
+// Reasons an entry found while listing a directory is left out of the sync
+#define SCAN_KEEP 0 // The entry is synced
+#define SCAN_SKIP_DIRECTORY 1 // The entry is a directory and the -r flag was not passed
+#define SCAN_SKIP_HIDDEN 2 // The entry is a hidden file and the -a flag was not passed
+#define SCAN_SKIP_IGNORED 3 // The entry matches an ignore pattern (-i), or is a directory whose path matches one
+#define SCAN_SKIP_NOT_ONLY 4 // The entry doesn't match any only pattern (-o), or is a directory nothing within which could
+#define SCAN_PENDING_STAT 5 // The entry is waiting to be stat'ed in a batch with the rest of its directory (only while the directory is being read)
+#define SCAN_SKIP_TEMPORARY 6 // The entry is a temporary file of mysync's (skipped even with the -a flag)
 
 
 //  CITS2002 Project 2 2023
@@ -29,25 +181,73 @@
 //  mysync (v2.0)
 
 
-typedef struct node {
-    // A struct that represents a node in the hashtable
-    char *name; // The name of the node (the key)
-    void *data; // The data of the node (generic)
-    struct node *next; // The next node in the linked list
-} Node;
+typedef struct slot {
+    // A struct that represents a slot in the hashtable
+    uint64_t hash; // The hash of the key (SLOT_EMPTY if the slot has never been used, SLOT_DELETED if its key was deleted)
+    void *data; // The data of the slot (generic)
+    uint32_t key_length; // The length of the key
+    union {
+        char inline_key[SLOT_INLINE_KEY_SIZE]; // The key, if it is short enough to fit in the slot
+        char *key; // The key, if it isn't
+    };
+} Slot;
 
 typedef struct hashtable {
     // A struct that represents a hashtable
-    int size; // The size of the hashtable
+    int size; // The number of slots in the table (a power of two)
     int num_elements; // The number of elements in the hashtable
-    Node **table; // The table of file nodes
+    int num_used; // The number of slots in the table that are full or deleted
+    Slot *table; // The table of slots
+    Slot *old_table; // The slots of the table before it was resized, which are moved across a few at a time (NULL if the hashtable isn't being resized)
+    int old_size; // The number of slots in the old table
+    int old_position; // The index of the next slot to move out of the old table
+    bool borrowed; // A bool that represents whether the keys and data belong to an arena (so long keys are used in place rather than copied, and nothing is freed)
 } Hashtable;
 
-typedef struct relpaths {
-    // A struct that represents a linked list of relative paths
-    char *relpath; // The relative path
-    struct relpaths *next; // The next relative path
-} Relpaths;
+typedef struct arena_block {
+    // A struct that represents a block of memory in an arena
+    struct arena_block *next; // The block allocated before this one
+    size_t size; // The number of bytes in the block
+    size_t used; // The number of bytes handed out so far
+    _Alignas(ARENA_ALIGNMENT) char data[]; // The memory of the block
+} Arena_block;
+
+typedef struct arena {
+    // A struct that represents an arena (a list of blocks that memory is handed out from in order)
+    Arena_block *head; // The block memory is currently handed out from (NULL before the first allocation)
+    void *last; // The memory handed out most recently (which can be given back)
+    size_t next_block_size; // The size of the next block
+} Arena;
+
+typedef struct path_node {
+    // A struct that represents a file or directory in a path tree (one name of a relative path, linked to the directory it is in)
+    char *name; // The name of the file or directory (interned, so it is shared with every other entry of the same name)
+    struct path_node *parent; // The node of the directory the entry is in (NULL for the node that stands for the root directories)
+    void *data; // The File or Dir_indexes of the entry
+    struct path_node *next; // The next file or directory in the order they were found
+    uint32_t length; // The length of the entry's relative path
+} Path_node;
+
+typedef struct path_tree {
+    // A struct that represents the tree of every file and directory in a sync
+    Arena *arena; // The arena the nodes and names are allocated from
+    Hashtable *names; // A hashtable of the interned names (each name maps to its one copy)
+    Path_node **children; // An open addressed table of the nodes, found by the address of their directory's node and of their interned name
+    size_t size; // The number of slots in the table (a power of two)
+    size_t num_nodes; // The number of nodes in the table
+    Path_node root; // The node that stands for the root directories (its relative path is "")
+} Path_tree;
+
+typedef struct replica {
+    // A struct that represents the metadata of one copy of a file (one per root directory)
+    bool present; // A bool that represents whether the file exists in this root directory
+    int permissions; // The permissions (mode) of this copy
+    long long int size; // The size of this copy
+    struct timespec edit_time; // The modification time of this copy (with nanoseconds)
+    dev_t device; // The device and inode of this copy (for the --hardlinks flag, so copies that are the same file can be found)
+    ino_t inode;
+    nlink_t links; // The number of hardlinks to this copy
+} Replica;
 
 typedef struct file {
     // A struct that represents a file
@@ -56,11 +256,13 @@ typedef struct file {
     long long int edit_time; // The edit time of the file
     long long int size; // The size of the file
     int directory_index; // The index of the directory that the file is in
+    Replica *replicas; // An array of the metadata of every copy of the file (indexed by directory index)
 } File;
 
 typedef struct index {
     // A struct that represents an index in a linked list
     int index; // The index of the directory
+    struct scan_dir *listing; // The listing of the directory in that root (only kept with the --pipeline flag, where the directory is merged once every root has listed it)
     struct index *next; // The next index in the linked list
 } Index;
 
@@ -70,26 +272,301 @@ typedef struct dir_indexes {
     bool valid; // A bool that represents whether the directory is empty or not
     Index *head; // The head of the linked list of indexes
     Index *tail; // The tail of the linked list of indexes
+    int unlisted; // The number of roots still listing the directory (with the --pipeline flag, the directory's entries are merged once this reaches 0)
 } Dir_indexes;
 
+typedef struct scan_entry {
+    // A struct that represents an entry found while listing a directory
+    char *name; // The name of the entry
+    int skip_reason; // Why the entry is left out of the sync (SCAN_KEEP if it isn't)
+    struct stat info; // The entry's info
+    struct scan_dir *listing; // The listing of the entry if it is a subdirectory that is recursed into (NULL otherwise)
+} Scan_entry;
+
+typedef struct scan_dir {
+    // A struct that represents the listing of a directory, filled in by one of the scan threads
+    char *root; // The root directory the directory is in
+    struct scan_dir *parent; // The listing of the directory this one is in (NULL for the root itself)
+    char *name; // The name of the directory (shared with its entry in the parent's listing, NULL for the root itself)
+    int fd; // The directory, opened relative to its parent when it was found (-1 if it hasn't been opened yet)
+    int root_index; // The index of the root the directory is in
+    struct stat info; // The directory's own info
+    Scan_entry *entries; // An array of the entries in the directory (in the order they were read)
+    int num_entries; // The number of entries in the array
+    int capacity; // The number of entries the array has room for
+    struct scan_dir *next_task; // The next directory on the stack of directories waiting to be listed
+    char *pattern_path; // The relative path of the directory followed by a '/', with room for an entry's name after it (only while the directory is being read, and only if there are path globs to match entries against, NULL otherwise)
+    size_t pattern_path_length; // The length of the relative path and its '/' (0 for a root)
+    struct scan_dir *next_listed; // The next directory in the queue of directories that have finished listing (with the --pipeline flag)
+    Path_node *node; // The directory's node in the path tree, once its parent has been merged (only used by the thread merging the listings)
+    bool listed; // A bool that represents whether the merging thread has seen the directory finish listing
+} Scan_dir;
+
+typedef struct cached_listing {
+    // A struct that represents a listing about to be written to a scan cache file
+    Scan_dir *listing; // The listing
+    char *relpath; // The path of the directory relative to its root ("" for the root itself)
+} Cached_listing;
+
+typedef struct cache_header {
+    // A struct that represents the header at the start of a scan cache file
+    char magic[8]; // SCAN_CACHE_MAGIC
+    uint32_t version; // SCAN_CACHE_VERSION
+    uint32_t num_dirs; // The number of directories in the cache
+    uint32_t num_entries; // The total number of entries in those directories
+    uint32_t padding;
+    uint64_t strings_size; // The number of bytes of names after the entries
+} Cache_header;
+
+typedef struct cache_dir {
+    // A struct that represents a directory in a scan cache file (the directories are sorted by relative path)
+    uint64_t relpath; // The offset of the directory's relative path in the names
+    uint32_t first_entry; // The index of the directory's first entry
+    uint32_t num_entries; // The number of entries in the directory
+    int64_t mtime_sec; // The modification time of the directory when it was cached
+    int64_t mtime_nsec;
+    int64_t ctime_sec; // The change time of the directory when it was cached
+    int64_t ctime_nsec;
+    uint32_t trusted; // Whether the directory was old enough when cached that its times can be relied on
+    uint32_t padding;
+} Cache_dir;
+
+typedef struct cache_entry {
+    // A struct that represents an entry of a directory in a scan cache file
+    uint64_t name; // The offset of the entry's name in the names
+    uint32_t type; // The type of the entry (S_IFREG or S_IFDIR)
+    uint32_t padding;
+} Cache_entry;
+
+typedef struct scan_cache {
+    // A struct that represents a scan cache file mapped into memory
+    void *map; // The mapping of the whole file
+    size_t size; // The size of the file
+    Cache_header *header; // The header (at the start of the mapping)
+    Cache_dir *dirs; // The directories (after the header)
+    Cache_entry *entries; // The entries (after the directories)
+    char *strings; // The names (after the entries)
+} Scan_cache;
+
+typedef struct digest {
+    // A struct that represents the 128-bit hash of a file's contents
+    uint64_t low;
+    uint64_t high;
+} Digest;
+
+typedef struct digest_record {
+    // A struct that represents the digest of a file, remembered until the file changes
+    int type_id; // An int used when casting to check the type of the struct (should always be 2, so free_node_data knows how to free it)
+    dev_t device; // The device the file is on
+    ino_t inode; // The inode of the file
+    long long int size; // The size of the file when it was hashed
+    struct timespec edit_time; // The modification time of the file when it was hashed
+    struct timespec change_time; // The status change time of the file when it was hashed (which can't be set back, unlike the modification time, so a file rewritten in place and given its old modification time is still seen to have changed)
+    Digest digest; // The digest of the file's contents
+    bool used; // A bool that represents whether the digest was looked up or worked out this run (only those are saved)
+} Digest_record;
+
+typedef struct digest_file_header {
+    // A struct that represents the header at the start of the digest cache file
+    char magic[8]; // DIGEST_CACHE_MAGIC
+    uint32_t version; // DIGEST_CACHE_VERSION
+    uint32_t padding;
+    uint64_t num_records; // The number of records after the header
+} Digest_file_header;
+
+typedef struct digest_file_record {
+    // A struct that represents a digest in the digest cache file
+    uint64_t device;
+    uint64_t inode;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t digest_low;
+    uint64_t digest_high;
+} Digest_file_record;
+
+typedef struct hardlink {
+    // A struct that represents a master file that is one of several hardlinks to the same file in its root (for the --hardlinks flag)
+    File *file; // The master file
+    char *relpath; // The relative path of the file
+    struct hardlink *leader; // The first of the links to be synced, which is copied as usual (NULL if this is it)
+    struct hardlink *next; // The next link waiting to be made once every copy has been written
+} Hardlink;
+
+typedef struct duplicate {
+    // A struct that represents a master file that is a candidate for, or has been found to be, an identical copy of another master file (for the --dedup flag)
+    File *file; // The master file
+    char *relpath; // The relative path of the file
+    Digest digest; // The digest of the master file's contents (only worked out once another file of the same size turns up)
+    bool hashed; // A bool that represents whether the digest has been worked out
+    struct duplicate *original; // The file with the same contents whose copies this file's copies are made from (NULL if the file is copied as usual)
+    struct duplicate *next_same_size; // The next file of the same size (the files later ones are compared against, duplicates included, as their copies are made in the order they were found)
+    struct duplicate *next; // The next duplicate waiting to be made once every copy has been written
+} Duplicate;
+
+typedef struct copy_job {
+    // A struct that represents a file waiting to be synced by a copy worker
+    File *file; // The master file
+    struct copy_job *next; // The next job in the queue
+    char relpath[]; // The relative path of the file (copied into the job, as the path is only spelled out while the file is submitted)
+} Copy_job;
+
+typedef struct uring {
+    // A struct that represents an io_uring (one per thread that uses it)
+    int fd; // The file descriptor of the ring
+    unsigned int depth; // The number of entries in the submission queue
+    unsigned int queued; // The number of requests written to the submission queue but not submitted yet
+    unsigned int in_flight; // The number of requests submitted whose completions haven't been collected
+    unsigned int tail; // The tail of the submission queue including the requests not published to the kernel yet
+    unsigned int *sq_head; // The head of the submission queue (moved on by the kernel)
+    unsigned int *sq_tail; // The tail of the submission queue (moved on by us)
+    unsigned int sq_mask; // The mask that turns a position into an index of the submission queue
+    unsigned int *sq_array; // The array of indexes of requests in the submission queue
+    struct io_uring_sqe *sqes; // The requests
+    unsigned int *cq_head; // The head of the completion queue (moved on by us)
+    unsigned int *cq_tail; // The tail of the completion queue (moved on by the kernel)
+    unsigned int cq_mask; // The mask that turns a position into an index of the completion queue
+    struct io_uring_cqe *cqes; // The completions
+    void *sq_ring; // The mapping of the submission queue
+    void *cq_ring; // The mapping of the completion queue (the same as the submission queue's on newer kernels)
+    size_t sq_ring_size; // The size of the submission queue's mapping
+    size_t cq_ring_size; // The size of the completion queue's mapping
+} Uring;
+
+typedef struct uring_completion {
+    // A struct that represents a finished io_uring request
+    uint64_t user_data; // The tag the request was submitted with
+    int res; // The result of the request (what its system call would have returned, or minus its errno)
+} Uring_completion;
+
+typedef struct uring_buffer {
+    // A struct that represents a buffer a chunk of a master file is read into by an io_uring copy
+    char *data; // The memory of the buffer
+    long long int offset; // The offset of the chunk in the master file
+    long long int length; // The length of the chunk
+    long long int data_start; // The part of the chunk written to the copies (with the --sparse flag, blocks of zeros at either end of it are left as holes)
+    long long int data_end;
+    int pending; // The number of reads and writes of the buffer in flight (0 if the buffer is free)
+} Uring_buffer;
+
+typedef struct flush_target {
+    // A struct that represents a filesystem copies have been written to with the --atomic flag
+    dev_t device; // The device of the filesystem
+    int fd; // A directory on the filesystem (to call syncfs with)
+    bool dirty; // A bool that represents whether a copy has been written to the filesystem since it was last flushed
+} Flush_target;
+
+typedef struct pending_replica {
+    // A struct that represents a new copy written with the --atomic flag, waiting for the next flush to be put in place of the old one
+    int fd; // The new copy (kept open, as it may not have a name yet)
+    char *filepath; // The path of the copy it replaces
+    char *temp_path; // The temporary path of the new copy (NULL if it has no name yet)
+    int target; // The index of the copy's filesystem in the flush targets
+} Pending_replica;
+
+typedef struct copy_probe {
+    // A struct that represents the copy method found for a pair of filesystems
+    dev_t src_dev; // The device of the filesystem the master files are on
+    dev_t dst_dev; // The device of the filesystem the copies are on
+    int method; // The fastest method that hasn't failed between the two filesystems
+} Copy_probe;
+
+typedef struct delta_match {
+    // A struct that represents a part of a master file that was found in the stale copy of it
+    long long int old_offset; // The offset of the part in the copy
+    long long int new_offset; // The offset of the part in the master file
+    long long int length; // The length of the part
+} Delta_match;
+
+typedef struct watch {
+    // A struct that represents a directory being watched for changes (or a change found in one)
+    int root_index; // The index of the root the directory is in
+    char *relpath; // The relative path of the directory (or of the changed entry)
+} Watch;
+
+typedef struct glob_position {
+    // A struct that represents a position in the automaton of a set of globs (a character of one of the globs)
+    uint64_t bytes[4]; // The bytes the position matches (a bit for each)
+    bool star; // A bool that represents whether the position matches any number of its bytes (a '*') rather than one
+    bool accept; // A bool that represents whether the position is the end of a glob (which matches no bytes)
+    bool repeats; // A bool that represents whether the position can go back to the one before it once it has matched (the '/' of a "**/", so it can match more than one directory)
+    bool settles; // A bool that represents whether reaching the position means a match whatever follows (a star that matches any byte at the end of its glob)
+    unsigned char skip; // How many positions (this one included) can be skipped without reading a byte (0 if none can)
+} Glob_position;
+
+typedef struct glob_automaton {
+    // A struct that represents the automaton a set of globs is merged into, read a byte at a time
+    Glob_position *positions; // The positions of every glob, one glob after another
+    int num_positions;
+    int capacity;
+    uint64_t *start; // The positions the automaton starts at
+    unsigned char byte_classes[256]; // The class of each byte (bytes that every position treats alike share a class)
+    int num_classes;
+    int *transitions; // The table of the automaton: the state each state leads to with each class of byte (NULL if there would be too many states, in which case they are worked out as a name is read)
+    unsigned char *state_kinds; // Whether each state of the table can still lead to a match, is a match, or matches whatever follows
+    int num_states;
+} Glob_automaton;
 
 typedef struct pattern {
-    // A struct that represents a pattern in a linked list
-    regex_t regex; // The regex of the pattern
-    struct pattern *next; // The next pattern in the linked list
+    // A struct that represents a set of globs compiled into one matcher (the -i or -o globs)
+    char **globs; // The globs as they were passed (kept so the matcher can be rebuilt as globs are added)
+    int num_globs;
+    bool match_all; // A bool that represents whether a glob matches every name (a glob of only stars)
+    Hashtable *exact_names; // The globs with no special characters (NULL if there are none)
+    Hashtable *suffixes; // The plain suffixes of the globs that are stars followed by one (NULL if there are none)
+    int *suffix_lengths; // The distinct lengths of the suffixes (a name is looked up once per length)
+    int num_suffix_lengths;
+    Glob_automaton names; // The automaton the other globs without a '/' are merged into (matched against names)
+    Glob_automaton paths; // The automaton the globs with a '/' are merged into (matched against relative paths)
 } Pattern;
 
 typedef struct flags {
     // A struct that represents the flags passed in the command line arguments
     bool all_flag; // A bool that represents whether the -a flag was passed
-    Pattern *ignore1; // A linked list of patterns that represent the -i flag
+    Pattern *ignore1; // The set of globs passed with the -i flag (NULL if there are none)
     bool no_sync_flag; // A bool that represents whether the -n flag was passed
-    Pattern *only1; // A linked list of patterns that represent the -o flag
+    Pattern *only1; // The set of globs passed with the -o flag (NULL if there are none)
     bool copy_perm_time_flag; // A bool that represents whether the -p flag was passed
     bool recursive_flag; // A bool that represents whether the -r flag was passed
     bool verbose_flag; // A bool that represents whether the -v flag was passed
+    int num_threads; // The number of threads to scan and copy with (the -j flag)
+    int copy_method; // The method to copy files with (the -m flag, COPY_AUTO unless a method is forced)
+    char *cache_dir; // The directory to keep the scan cache of each root in (the --cache flag, NULL if it wasn't passed)
+    bool watch_flag; // A bool that represents whether the --watch flag was passed
+    int debounce_ms; // How many milliseconds without changes --watch waits before syncing them (the --debounce flag)
+    bool checksum_flag; // A bool that represents whether the -c flag was passed
+    bool verify_flag; // A bool that represents whether the --verify flag was passed
+    long long int delta_threshold; // The smallest master file whose stale copies are updated with a delta transfer (the --delta flag, 0 if it wasn't passed)
+    bool uring_flag; // A bool that represents whether the --io-uring flag was passed (and io_uring is available)
+    int queue_depth; // The requests each thread's io_uring can have in flight (the --queue-depth flag)
+    bool atomic_flag; // A bool that represents whether the --atomic flag was passed
+    int flush_interval_ms; // How many milliseconds --atomic lets pass between flushes of the filesystems written to (the --flush-interval flag, 0 to only flush at the end of each sync)
+    bool pipeline_flag; // A bool that represents whether the --pipeline flag was passed (files are copied while the rest of the roots are still being scanned)
+    int stats_format; // The format the --stats flag reports in (STATS_OFF if it wasn't passed)
+    long long int split_threshold; // The smallest master file that is split into ranges copied on several threads at once (the --split flag, 0 if it wasn't passed)
+    bool hardlinks_flag; // A bool that represents whether the --hardlinks flag was passed (files that are hardlinks to one another in the master root are linked the same way in the other roots, rather than each copied in full)
+    bool stream_flag; // A bool that represents whether the --stream flag was passed (the data copied is written back and dropped from the page cache as the copy goes, rather than left to evict other files)
+    bool direct_flag; // A bool that represents whether the --direct flag was passed (the buffered loop reads and writes with O_DIRECT where the filesystem allows it, and streams otherwise)
+    bool sparse_flag; // A bool that represents whether the --sparse flag was passed (blocks of zeros in master files are left as holes in the copies, as well as the holes the master files already have)
+    int dedup_mode; // How the --dedup flag makes the copies of a file identical to one synced before it (DEDUP_OFF if it wasn't passed)
 } Flags;
 
+typedef struct split_copy {
+    // A struct that represents a master file being copied in ranges on several threads (with the --split flag)
+    int master_fd; // The master file
+    long long int size; // The size of the master file
+    bool holes; // A bool that represents whether the master file has holes (only its data is copied)
+    int *fds; // The copies being written (-1 for a copy that is already complete, such as a reflink)
+    int *methods; // The method each copy is written with (COPY_FILE_RANGE or COPY_READ_WRITE)
+    int num_fds;
+    _Atomic long long int next_range; // The index of the next range to be copied
+    pthread_mutex_t lock; // A lock that protects the methods and the failed bool below
+    bool failed; // A bool that represents whether a read or write failed (the threads stop taking ranges once one has)
+    Flags *flags;
+} Split_copy;
+
 // Macros
 
 #define VERBOSE_PRINT(fmt, ...) \
@@ -102,20 +579,40 @@ typedef struct flags {
 
 // Function prototypes
 
-char *glob2regex(char *);
-
 char *permissions(int);
 
 void sync_master(File *, char*, char **, int, Flags *);
 
+void print_sync_summary(Flags *);
+
+void sync_link(File *, char *, File *, char *, char **, int, Flags *);
+
+void sync_duplicate(File *, char *, File *, char *, char **, int, Flags *);
+
+bool replica_is_stale(Replica *, Replica *);
+
+void set_fd_perm_time(int, char *, File *, Flags *);
+
+bool same_metadata(File *, File *);
+
 void enqueue_pattern(Pattern **, char *);
 
-bool check_patterns(Pattern *, char *);
+bool check_patterns(Pattern *, char *, char *);
+
+bool patterns_match_names(Pattern *);
+
+bool patterns_match_paths(Pattern *);
+
+int directory_pattern_kind(Pattern *, char *);
 
 void *malloc_data(size_t);
 
 void sync_directories(char **, int, Flags *);
 
+void set_replica(Replica *, struct stat *);
+
+bool is_newer(struct timespec *, struct timespec *);
+
 void create_directories(Dir_indexes *, char *, char **, int, Flags *);
 
 void free_flags(Flags *);
@@ -128,8 +625,168 @@ void delete(Hashtable **, char *);
 
 Hashtable *create_hashtable(size_t);
 
-void print_all(Hashtable *, Relpaths *, char **);
+void *hashtable_next(Hashtable *, int *);
+
+void free_hashtable(Hashtable *);
+
+Hashtable *create_borrowing_hashtable(size_t);
+
+Arena *create_arena(void);
+
+void *arena_alloc(Arena *, size_t);
+
+char *arena_strdup(Arena *, char *);
+
+void arena_undo(Arena *, void *);
+
+void free_arena(Arena *);
+
+Path_tree *create_path_tree(Arena *);
+
+Path_node *find_child(Path_tree *, Path_node *, char *);
+
+Path_node *add_child(Path_tree *, Path_node *, char *, void *);
+
+char *write_relpath(Path_node *, char *);
+
+char *relpath_of(Path_node *);
+
+void free_path_tree(Path_tree *);
+
+void print_all(Path_node *, char **);
+
+Scan_dir **scan_roots(char **, int, Flags *);
+
+void start_pipelined_scan(char **, int, Flags *);
+
+Scan_dir *next_listed_directory(void);
+
+Scan_dir **finish_pipelined_scan(void);
+
+void free_listing(Scan_dir *);
+
+void start_copy_pool(char **, int, Flags *);
+
+void submit_copy(File *, char *);
+
+void finish_copy_pool(void);
+
+void split_copy(char *, int, struct stat *, char **, int *, int *, int, Flags *);
+
+size_t copy_buffer_size(long long int);
+
+char *malloc_copy_buffer(size_t);
+
+bool set_direct_io(int, bool);
+
+void start_writeback(int *, int, long long int, long long int);
+
+void release_cached_range(int, int *, int, long long int, long long int);
+
+int parse_copy_method(char *);
+
+char *copy_method_name(int);
+
+int probe_copy_method(dev_t, dev_t);
+
+void rule_out_copy_method(dev_t, dev_t, int);
+
+bool copy_method_unsupported(int);
+
+bool write_all(int, char *, size_t, off_t);
+
+long long int copy_range(int, int, int, off_t, long long int);
+
+bool has_holes(struct stat *);
+
+bool next_data_extent(int, long long int, long long int, long long int *, long long int *);
+
+long long int copy_extents(int, int, int, long long int);
+
+size_t zero_run_end(char *, size_t, size_t);
+
+size_t data_run_end(char *, size_t, size_t);
+
+bool write_sparse(int, char *, size_t, off_t, long long int *);
+
+bool splice_fanout(int, int *, int);
+
+Scan_cache *load_scan_cache(char *, char *);
+
+void free_scan_cache(Scan_cache *);
+
+Cache_dir *find_cached_dir(Scan_cache *, char *, struct stat *);
+
+void write_scan_cache(char *, char *, Scan_dir *, struct timespec);
 
 void free_patterns(Pattern *);
 
-#endif
\ No newline at end of file
+void create_directory(char *, char *, Flags *);
+
+int file_skip_reason(char *, char *, Flags *);
+
+int directory_skip_reason(char *, Flags *);
+
+void start_watching(char **, int, Flags *);
+
+void watch_directory(char *, char **, int);
+
+void remember_file(char *, char **, int);
+
+void watch_directories(char **, int, Flags *);
+
+long long int parse_size(char *);
+
+bool delta_copy(File *, char *, char *, Flags *);
+
+bool file_digest(char *, bool, Digest *);
+
+bool hash_fd(int, Digest *);
+
+void load_digests(Flags *);
+
+void save_digests(Flags *);
+
+bool uring_supported(unsigned int);
+
+Uring *thread_uring(Flags *);
+
+void release_thread_uring(void);
+
+void uring_submit(Uring *, unsigned int);
+
+void uring_stat_batch(Uring *, int, char **, struct stat *, int *, int);
+
+void uring_open_batch(Uring *, int *, char **, int *, int);
+
+void uring_close_batch(Uring *, int *, int);
+
+bool uring_copy(Uring *, int, int *, int, long long int, long long int, bool, long long int *);
+
+char *temp_name(char *);
+
+bool is_temp_name(char *);
+
+int open_atomic_replica(char *, char **);
+
+void commit_atomic_replica(int, char *, char *, char *, Flags *);
+
+void flush_replicas(Flags *, bool);
+
+void place_pending_replicas(Flags *);
+
+void enable_stats(int);
+
+bool stats_enabled(void);
+
+void add_stat(int, long long int);
+
+void start_stat_timer(struct timespec *);
+
+void stop_stat_timer(int, struct timespec *);
+
+void record_sync_time(struct timespec *);
+
+void print_stats(void);
+
+#endif
@@ -0,0 +1,146 @@
+#include "mysync.h"
+
+// A C file that keeps the files and directories of a sync as a tree of names rather than as full relative paths
+// Each node holds one name (interned, so a name that appears in many directories is stored once) and points to the directory it is in, so a path is only spelled out when a system call needs it
+
+uint64_t child_hash(Path_node *parent, char *name) {
+    // A function that takes a directory node and an interned name, and returns the hash of the pair (the name is interned, so its address stands for its contents)
+    uint64_t hash = (uint64_t)(uintptr_t)parent * 0x9e3779b97f4a7c15ULL ^ (uint64_t)(uintptr_t)name;
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+Path_tree *create_path_tree(Arena *arena) {
+    // A function that takes the arena of a sync, and returns an empty tree (just the node that stands for each root directory) whose nodes and names are allocated from the arena
+    Path_tree *tree = malloc_data(sizeof(Path_tree));
+    tree->arena = arena;
+    tree->names = create_borrowing_hashtable(DEFAULT_HASHTABLE_SIZE); // The interned names (each maps to itself)
+    tree->size = PATH_TREE_FIRST_SIZE;
+    tree->num_nodes = 0;
+    tree->children = calloc(tree->size, sizeof(Path_node *));
+    if (tree->children == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+        exit(EXIT_FAILURE);
+    }
+    tree->root.name = "";
+    tree->root.parent = NULL;
+    tree->root.data = NULL;
+    tree->root.next = NULL;
+    tree->root.length = 0;
+    return tree;
+}
+
+char *intern_name(Path_tree *tree, char *name) {
+    // A function that takes a tree and a name, and returns the tree's copy of the name (making one if the name hasn't been seen before)
+    char *interned = get(tree->names, name);
+    if (interned == NULL) {
+        interned = arena_strdup(tree->arena, name);
+        put(&tree->names, interned, interned);
+    }
+    return interned;
+}
+
+Path_node **find_child_slot(Path_tree *tree, Path_node *parent, char *name) {
+    // A function that takes a tree, a directory node and an interned name, and returns the slot of the children table that holds the pair (or the empty slot it would go in)
+    size_t mask = tree->size - 1;
+    size_t position = child_hash(parent, name) & mask;
+    long long int probes = 1; // The number of slots looked at (for the --stats flag)
+    while (tree->children[position] != NULL && (tree->children[position]->parent != parent || tree->children[position]->name != name)) {
+        // Probe the slots in order until the pair or an empty slot is found
+        position = (position + 1) & mask;
+        probes++;
+    }
+    add_stat(STAT_HASH_LOOKUPS, 1);
+    add_stat(STAT_HASH_PROBES, probes);
+    return &tree->children[position];
+}
+
+Path_node *find_child(Path_tree *tree, Path_node *parent, char *name) {
+    // A function that takes a tree, a directory node and a name, and returns the node of the name in the directory (NULL if there isn't one)
+    char *interned = get(tree->names, name); // A name that has never been interned can't be in any directory
+    if (interned == NULL) {
+        return NULL;
+    }
+    return *find_child_slot(tree, parent, interned);
+}
+
+void grow_children(Path_tree *tree) {
+    // A function that takes a tree, and doubles the size of its children table
+    add_stat(STAT_HASH_RESIZES, 1);
+    Path_node **old_children = tree->children;
+    size_t old_size = tree->size;
+    tree->size *= 2;
+    tree->children = calloc(tree->size, sizeof(Path_node *));
+    if (tree->children == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        // Loop through the old table and put each node in its slot of the new one
+        if (old_children[i] != NULL) {
+            *find_child_slot(tree, old_children[i]->parent, old_children[i]->name) = old_children[i];
+        }
+    }
+    free(old_children);
+}
+
+Path_node *add_child(Path_tree *tree, Path_node *parent, char *name, void *data) {
+    // A function that takes a tree, a directory node, a name that isn't in the directory yet, and the File or Dir_indexes of the name, and returns the new node of the name
+    if ((tree->num_nodes + 1) * 4 > tree->size * 3) {
+        // Keep the table at most three quarters full, so probes stay short
+        grow_children(tree);
+    }
+    Path_node *node = arena_alloc(tree->arena, sizeof(Path_node));
+    node->name = intern_name(tree, name);
+    node->parent = parent;
+    node->data = data;
+    node->next = NULL;
+    node->length = (parent->length == 0 ? 0 : parent->length + 1) + strlen(name); // The length of the relative path, so it can be written without measuring it first
+    *find_child_slot(tree, parent, node->name) = node;
+    tree->num_nodes++;
+    return node;
+}
+
+char *write_relpath(Path_node *node, char *buffer) {
+    // A function that takes a node and a buffer of at least node->length + 1 bytes, and writes the node's relative path into the buffer (from the end backwards, so every name is copied once)
+    char *end = buffer + node->length;
+    *end = '\0';
+    for (; node->parent != NULL; node = node->parent) {
+        // Loop up through the directories the node is in, putting each name in front of the last
+        size_t name_length = node->length - (node->parent->length == 0 ? 0 : node->parent->length + 1);
+        end -= name_length;
+        memcpy(end, node->name, name_length);
+        if (end > buffer) {
+            *--end = '/';
+        }
+    }
+    return buffer;
+}
+
+char *relpath_of(Path_node *node) {
+    // A function that takes a node, and returns its relative path in a buffer that is reused by the next call (only used on the main thread, for messages and to hand paths to the system calls)
+    static char *buffer = NULL;
+    static size_t capacity = 0;
+    if (node->length + 1 > capacity) {
+        // If the buffer is too small, grow it
+        capacity = node->length + 1 > 2 * capacity ? node->length + 1 : 2 * capacity;
+        buffer = realloc(buffer, capacity);
+        if (buffer == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return write_relpath(node, buffer);
+}
+
+void free_path_tree(Path_tree *tree) {
+    // A function that takes a tree, and frees its tables (the nodes and names are freed with the arena)
+    free_hashtable(tree->names);
+    free(tree->children);
+    free(tree);
+}
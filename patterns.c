@@ -1,59 +1,503 @@
 #include "mysync.h"
 
-void free_patterns(Pattern *pattern) {
-    // A function that takes a linked list of patterns and frees all the memory allocated for it
-    Pattern *current_pattern = pattern; // Set the current pattern to the head of the linked list
-    Pattern *temp = NULL; // Initialize a temporary pattern for storing the next pattern
-    while (current_pattern != NULL) {
-        // Loop through the linked list
-        temp = current_pattern->next; // Set the temporary pattern to the next pattern
-        regfree(&(current_pattern->regex)); // Free the memory allocated for the regex
-        free(current_pattern); // Free the memory allocated for the current pattern
-        current_pattern = temp; // Set the current pattern to the temporary pattern
-    }
-}
-
-void enqueue_pattern(Pattern **head, char *glob) {
-    // A function that takes a linked list of patterns and a glob, and adds the glob to the linked list as a regex
-    if (strchr(glob, '/') != NULL) {
-        // If the glob contains a slash, print an error message and exit the program
-        fprintf(stderr, "Error: glob \"%s\" contains a forward slash which is not allowed\n", glob);
+// A C file that matches filenames against the -i and -o globs
+// All the globs of a flag are compiled into one matcher, so a filename is checked in one pass however many globs there are: exact names are looked up in a hashtable, literal suffixes (like *.log) are looked up by each distinct suffix length, and every other glob is merged into one automaton (which stops as soon as the outcome is settled, so a literal prefix like build* costs only the length of the prefix)
+// A glob with a '/' in it is matched against the relative path of an entry instead (by a second automaton), and can match directories as well as files: '*', '?' and brackets stay within one directory, "**/" matches any number of directories, "**" matches anything, and a trailing '/' only matches directories (whose paths are matched with a '/' on the end)
+
+void free_automaton(Glob_automaton *automaton) {
+    // A function that takes an automaton, and frees its positions and table, leaving it empty
+    free(automaton->positions);
+    free(automaton->start);
+    free(automaton->transitions);
+    free(automaton->state_kinds);
+    memset(automaton, 0, sizeof(Glob_automaton));
+}
+
+void free_matcher(Pattern *set) {
+    // A function that takes a set of globs, and frees its compiled matcher (leaving the globs)
+    if (set->exact_names != NULL) {
+        free_hashtable(set->exact_names);
+    }
+    if (set->suffixes != NULL) {
+        free_hashtable(set->suffixes);
+    }
+    free(set->suffix_lengths);
+    set->exact_names = NULL;
+    set->suffixes = NULL;
+    set->suffix_lengths = NULL;
+    set->num_suffix_lengths = 0;
+    set->match_all = false;
+    free_automaton(&set->names);
+    free_automaton(&set->paths);
+}
+
+void free_patterns(Pattern *set) {
+    // A function that takes a set of globs and frees all the memory allocated for it
+    if (set == NULL) {
+        return;
+    }
+    free_matcher(set);
+    for (int i = 0; i < set->num_globs; i++) {
+        free(set->globs[i]);
+    }
+    free(set->globs);
+    free(set);
+}
+
+void add_byte(Glob_position *position, unsigned char byte) {
+    // A function that takes a position of an automaton and a byte, and lets the position match the byte
+    position->bytes[byte / 64] |= 1ULL << (byte % 64);
+}
+
+void remove_byte(Glob_position *position, unsigned char byte) {
+    // A function that takes a position of an automaton and a byte, and stops the position matching the byte
+    position->bytes[byte / 64] &= ~(1ULL << (byte % 64));
+}
+
+bool has_byte(Glob_position *position, unsigned char byte) {
+    // A function that takes a position of an automaton and a byte, and returns true if the position matches the byte
+    return (position->bytes[byte / 64] >> (byte % 64)) & 1;
+}
+
+void add_any_byte(Glob_position *position, bool within_directory) {
+    // A function that takes a position of an automaton, and lets it match any byte (except a '/', if it has to stay within one directory)
+    for (int byte = 1; byte < 256; byte++) {
+        add_byte(position, byte);
+    }
+    if (within_directory) {
+        remove_byte(position, '/');
+    }
+}
+
+Glob_position *new_position(Glob_automaton *automaton) {
+    // A function that takes an automaton, and returns a new empty position at the end of its positions
+    if (automaton->num_positions == automaton->capacity) {
+        // If the array is full, double its size
+        automaton->capacity = automaton->capacity == 0 ? 16 : automaton->capacity * 2;
+        automaton->positions = realloc(automaton->positions, automaton->capacity * sizeof(Glob_position));
+        if (automaton->positions == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Glob_position *position = &automaton->positions[automaton->num_positions++];
+    memset(position, 0, sizeof(Glob_position));
+    return position;
+}
+
+char *parse_bracket(Glob_position *position, char *glob) {
+    // A function that takes a position and a glob at a '[', and adds the bytes of the bracket expression to the position, returning the glob just past the ']' (or NULL if the bracket is never closed, in which case the '[' is an ordinary character)
+    char *c = glob + 1;
+    bool negated = *c == '!' || *c == '^';
+    if (negated) {
+        c++;
+    }
+    Glob_position bracket;
+    memset(&bracket, 0, sizeof(Glob_position));
+    for (bool first = true; *c != '\0' && (first || *c != ']'); first = false) {
+        // Loop through the bracket's characters and ranges (a ']' straight after the '[' is an ordinary character)
+        unsigned char low = *c++;
+        unsigned char high = low;
+        if (c[0] == '-' && c[1] != ']' && c[1] != '\0') {
+            high = c[1];
+            c += 2;
+        }
+        for (int byte = low; byte <= high; byte++) {
+            add_byte(&bracket, byte);
+        }
+    }
+    if (*c != ']') {
+        return NULL;
+    }
+    for (int byte = 1; byte < 256; byte++) {
+        // Copy the bytes into the position (flipped if the bracket starts with a '!' or '^')
+        if (has_byte(&bracket, byte) != negated) {
+            add_byte(position, byte);
+        }
+    }
+    return c + 1;
+}
+
+void add_glob_positions(Glob_automaton *automaton, char *glob, bool is_path) {
+    // A function that takes an automaton, a glob and whether the glob is matched against paths, and adds the glob to the automaton as a run of positions ending in an accepting one
+    bool segment_start = true; // A bool that represents whether the glob is at the start of a directory (where "**/" can match any number of whole directories)
+    while (*glob != '\0') {
+        // Loop through the glob, turning each character (or bracket expression) into a position
+        Glob_position *position = new_position(automaton);
+        size_t stars = strspn(glob, "*"); // The number of stars in a row at this point of the glob
+        if (is_path && stars >= 2 && segment_start && glob[stars] == '/') {
+            // A "**/" at the start of a directory matches any number of whole directories: a directory's name followed by a '/', repeated, or skipped altogether (from a position that matches no bytes, so it can only be skipped before any name is read)
+            position->star = true;
+            position->skip = 3;
+            Glob_position *name = new_position(automaton);
+            name->star = true;
+            add_any_byte(name, true);
+            Glob_position *slash = new_position(automaton);
+            add_byte(slash, '/');
+            slash->repeats = true;
+            glob += stars + 1;
+            continue;
+        }
+        if (stars > 0) {
+            // A '*' repeats a position that matches any byte (a run of them is the same as one), but stays within one directory in a path unless it is doubled
+            position->star = true;
+            add_any_byte(position, is_path && stars == 1);
+            glob += stars;
+        } else if (*glob == '?') {
+            // A '?' matches any one byte (other than a '/' in a path)
+            add_any_byte(position, is_path);
+            glob++;
+        } else if (*glob == '[' && parse_bracket(position, glob) != NULL) {
+            // A bracket expression matches one byte from (or not from) its set (never a '/' in a path)
+            glob = parse_bracket(position, glob);
+            if (is_path) {
+                remove_byte(position, '/');
+            }
+        } else {
+            // Any other character only matches itself
+            add_byte(position, *glob++);
+        }
+        segment_start = is_path && glob[-1] == '/';
+    }
+    if (is_path && !segment_start) {
+        // If a path glob doesn't end in a '/', it matches directories (whose paths end in a '/') as well as files, so the '/' is optional
+        Glob_position *slash = new_position(automaton);
+        add_byte(slash, '/');
+        slash->skip = 1;
+    }
+    new_position(automaton)->accept = true;
+}
+
+bool accepts_without_bytes(Glob_automaton *automaton, int position) {
+    // A function that takes an automaton and a position, and returns true if the end of a glob can be reached from the position without reading another byte
+    Glob_position *current = &automaton->positions[position];
+    if (current->accept) {
+        return true;
+    }
+    return (current->star && accepts_without_bytes(automaton, position + 1)) || (current->skip > 0 && accepts_without_bytes(automaton, position + current->skip));
+}
+
+bool is_literal(char *glob) {
+    // A function that takes a glob, and returns true if it has no special characters (so it only matches itself)
+    return strpbrk(glob, "*?[") == NULL;
+}
+
+void add_to_state(uint64_t *state, int position) {
+    // A function that takes a state of an automaton (a set of positions) and a position, and adds the position to the state
+    state[position / 64] |= 1ULL << (position % 64);
+}
+
+bool state_has(uint64_t *state, int position) {
+    // A function that takes a state of an automaton and a position, and returns true if the position is in the state
+    return (state[position / 64] >> (position % 64)) & 1;
+}
+
+void close_state(Glob_automaton *automaton, uint64_t *state) {
+    // A function that takes an automaton and a state of it, and adds the positions that can be reached from the state without reading a byte (past a star, as it can match nothing, or past a part of the glob that can be skipped)
+    for (int i = 0; i < automaton->num_positions; i++) {
+        // Loop through the positions in order (these only ever lead forwards, so one pass reaches every position)
+        if (!state_has(state, i)) {
+            continue;
+        }
+        if (automaton->positions[i].star) {
+            add_to_state(state, i + 1);
+        }
+        if (automaton->positions[i].skip > 0) {
+            add_to_state(state, i + automaton->positions[i].skip);
+        }
+    }
+}
+
+void step_state(Glob_automaton *automaton, uint64_t *state, unsigned char byte, uint64_t *next, int words) {
+    // A function that takes an automaton, a state of it, a byte and a state to fill in, and fills it in with the positions reached by reading the byte
+    memset(next, 0, words * sizeof(uint64_t));
+    for (int i = 0; i < automaton->num_positions; i++) {
+        // Loop through the positions in the state, moving each one that matches the byte along (or keeping it, if it is a star)
+        Glob_position *position = &automaton->positions[i];
+        if (state_has(state, i) && !position->accept && has_byte(position, byte)) {
+            add_to_state(next, position->star ? i : i + 1);
+            if (position->repeats) {
+                // If the position ends a directory of a "**/", another directory can follow
+                add_to_state(next, i - 1);
+            }
+        }
+    }
+    close_state(automaton, next);
+}
+
+int state_kind(Glob_automaton *automaton, uint64_t *state) {
+    // A function that takes an automaton and a state of it, and returns whether the state can still lead to a match, is a match, or matches whatever follows
+    int kind = GLOB_STATE_DEAD;
+    for (int i = 0; i < automaton->num_positions; i++) {
+        if (!state_has(state, i)) {
+            continue;
+        }
+        if (automaton->positions[i].settles) {
+            // If the state is at a star that matches any byte with nothing left of its glob after it, every name that gets this far matches
+            return GLOB_STATE_SETTLED;
+        }
+        if (automaton->positions[i].accept) {
+            kind = GLOB_STATE_ACCEPT;
+        } else if (kind == GLOB_STATE_DEAD) {
+            kind = GLOB_STATE_LIVE;
+        }
+    }
+    return kind;
+}
+
+char *state_key(uint64_t *state, int words, char *key) {
+    // A function that takes a state of an automaton and a buffer of at least words * 16 + 1 bytes, and writes the state into the buffer as a hashtable key
+    for (int i = 0; i < words; i++) {
+        sprintf(key + i * 16, "%016llx", (unsigned long long int)state[i]);
+    }
+    return key;
+}
+
+void build_automaton(Glob_automaton *automaton, int *starts, int num_starts) {
+    // A function that takes an automaton whose positions are filled in, and the first position of each of its globs, and builds the table the automaton reads names with (one state per set of positions a name can be at, found from the start state by trying each class of bytes)
+    int words = (automaton->num_positions + 63) / 64;
+    for (int i = 0; i < automaton->num_positions; i++) {
+        // Loop through the positions, marking the stars that settle a match (they match any byte, and nothing else has to be read after them)
+        Glob_position *position = &automaton->positions[i];
+        position->settles = position->star && position->bytes[0] == ~1ULL && position->bytes[1] == ~0ULL && position->bytes[2] == ~0ULL && position->bytes[3] == ~0ULL && accepts_without_bytes(automaton, i + 1);
+    }
+    char *key = malloc_data(automaton->num_positions + words * 16 + 1); // A buffer for hashtable keys (long enough for either kind below)
+    // Put the bytes in classes that every position treats alike, so the table has a column per class rather than per byte
+    Hashtable *classes = create_hashtable(DEFAULT_HASHTABLE_SIZE);
+    unsigned char representatives[256]; // A byte of each class
+    automaton->num_classes = 0;
+    for (int byte = 1; byte < 256; byte++) {
+        // Loop through the bytes, giving each the class of the bytes with the same positions
+        for (int i = 0; i < automaton->num_positions; i++) {
+            key[i] = has_byte(&automaton->positions[i], byte) ? '1' : '0';
+        }
+        key[automaton->num_positions] = '\0';
+        int *class = get(classes, key);
+        if (class == NULL) {
+            class = malloc_data(sizeof(int) * 2);
+            class[0] = 2; // The type of the data, so the hashtable frees it like any other
+            class[1] = automaton->num_classes;
+            representatives[automaton->num_classes++] = byte;
+            put(&classes, key, class);
+        }
+        automaton->byte_classes[byte] = class[1];
+    }
+    automaton->byte_classes[0] = 0;
+    free_hashtable(classes);
+    // Find every state the automaton can reach, filling in its row of the table as it is found
+    Hashtable *states = create_hashtable(DEFAULT_HASHTABLE_SIZE); // The index of each state found
+    uint64_t **found = NULL; // The positions of each state found
+    int capacity = 0;
+    automaton->num_states = 0;
+    automaton->start = calloc(words, sizeof(uint64_t));
+    uint64_t *next = calloc(words, sizeof(uint64_t));
+    if (automaton->start == NULL || next == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
         exit(EXIT_FAILURE);
     }
-    char *regex = glob2regex(glob); // Convert the glob to a regex
-    if (regex == NULL) {
-        // If the glob could not be converted to a regex, print an error message and exit the program
-        fprintf(stderr, "Error: could not convert glob %s to regex\n", glob);
+    for (int i = 0; i < num_starts; i++) {
+        add_to_state(automaton->start, starts[i]);
+    }
+    close_state(automaton, automaton->start);
+    for (int current = -1; current < automaton->num_states && automaton->num_states <= GLOB_MAX_STATES; current++) {
+        // Loop through the states in the order they are found (starting with the start state)
+        for (int class = 0; class < (current == -1 ? 1 : automaton->num_classes); class++) {
+            // Loop through the classes, finding the state each leads to (or, the first time round, the start state)
+            if (current == -1) {
+                memcpy(next, automaton->start, words * sizeof(uint64_t));
+            } else {
+                step_state(automaton, found[current], representatives[class], next, words);
+            }
+            int *index = get(states, state_key(next, words, key));
+            if (index == NULL) {
+                // If the state is new, add it
+                if (automaton->num_states == capacity) {
+                    // If the arrays are full, double their size
+                    capacity = capacity == 0 ? 16 : capacity * 2;
+                    found = realloc(found, capacity * sizeof(uint64_t *));
+                    automaton->state_kinds = realloc(automaton->state_kinds, capacity);
+                    automaton->transitions = realloc(automaton->transitions, (size_t)capacity * automaton->num_classes * sizeof(int));
+                    if (found == NULL || automaton->state_kinds == NULL || automaton->transitions == NULL) {
+                        // If realloc fails, print an error message and exit the program
+                        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                found[automaton->num_states] = malloc_data(words * sizeof(uint64_t));
+                memcpy(found[automaton->num_states], next, words * sizeof(uint64_t));
+                automaton->state_kinds[automaton->num_states] = state_kind(automaton, next);
+                index = malloc_data(sizeof(int) * 2);
+                index[0] = 2;
+                index[1] = automaton->num_states++;
+                put(&states, key, index);
+            }
+            if (current != -1) {
+                automaton->transitions[current * automaton->num_classes + class] = index[1];
+            }
+        }
+    }
+    if (automaton->num_states > GLOB_MAX_STATES) {
+        // If the globs have too many states between them, give up on the table, and work the states out as each name is read instead
+        free(automaton->transitions);
+        free(automaton->state_kinds);
+        automaton->transitions = NULL;
+        automaton->state_kinds = NULL;
+    }
+    for (int i = 0; i < automaton->num_states; i++) {
+        free(found[i]);
+    }
+    free(found);
+    free_hashtable(states);
+    free(next);
+    free(key);
+}
+
+void compile_patterns(Pattern *set) {
+    // A function that takes a set of globs, and (re)compiles them into one matcher
+    free_matcher(set);
+    int *name_starts = malloc_data((set->num_globs + 1) * sizeof(int)); // The first position of each glob in the automaton for names
+    int *path_starts = malloc_data((set->num_globs + 1) * sizeof(int)); // The first position of each glob in the automaton for paths
+    int num_name_starts = 0;
+    int num_path_starts = 0;
+    for (int i = 0; i < set->num_globs; i++) {
+        // Loop through the globs, putting each with the others of its kind
+        char *glob = set->globs[i];
+        char *rest = glob + strspn(glob, "*"); // The glob after any leading stars
+        if (strchr(glob, '/') != NULL) {
+            // If the glob has a '/' in it, add it to the automaton for paths (a leading '/' only says the glob starts at the root, as every path glob does)
+            path_starts[num_path_starts++] = set->paths.num_positions;
+            add_glob_positions(&set->paths, glob + strspn(glob, "/"), true);
+        } else if (is_literal(glob)) {
+            // If the glob is a plain name, add it to the exact names
+            if (set->exact_names == NULL) {
+                set->exact_names = create_borrowing_hashtable(DEFAULT_HASHTABLE_SIZE);
+            }
+            put(&set->exact_names, glob, glob);
+        } else if (*rest == '\0') {
+            // If the glob is only stars, it matches every name
+            set->match_all = true;
+        } else if (rest > glob && is_literal(rest)) {
+            // If the glob is stars followed by a plain suffix, add it to the suffixes (remembering its length, as names are looked up by each length)
+            if (set->suffixes == NULL) {
+                set->suffixes = create_borrowing_hashtable(DEFAULT_HASHTABLE_SIZE);
+                set->suffix_lengths = malloc_data(set->num_globs * sizeof(int));
+            }
+            put(&set->suffixes, rest, rest);
+            int length = strlen(rest);
+            int j = 0;
+            while (j < set->num_suffix_lengths && set->suffix_lengths[j] != length) {
+                j++;
+            }
+            if (j == set->num_suffix_lengths) {
+                set->suffix_lengths[set->num_suffix_lengths++] = length;
+            }
+        } else {
+            // Otherwise add the glob to the automaton for names
+            name_starts[num_name_starts++] = set->names.num_positions;
+            add_glob_positions(&set->names, glob, false);
+        }
+    }
+    if (num_name_starts > 0) {
+        build_automaton(&set->names, name_starts, num_name_starts);
+    }
+    if (num_path_starts > 0) {
+        build_automaton(&set->paths, path_starts, num_path_starts);
+    }
+    free(name_starts);
+    free(path_starts);
+}
+
+void enqueue_pattern(Pattern **set, char *glob) {
+    // A function that takes a set of globs (NULL if it is empty) and a glob, and adds the glob to the set, recompiling the set's matcher
+    if (glob[strspn(glob, "/")] == '\0') {
+        // If the glob is empty (or only slashes), print an error message and exit the program
+        fprintf(stderr, "Error: glob \"%s\" is empty\n", glob);
         exit(EXIT_FAILURE);
     }
-    Pattern *new_pattern = malloc_data(sizeof(Pattern)); // Allocate memory for the new pattern
-    int err = regcomp(&(new_pattern->regex), regex, REG_EXTENDED | REG_NOSUB); // Compile the regex and add it to the new pattern
-    if (err != 0) {
-        // If the regex could not be compiled, print an error message and exit the program
-        fprintf(stderr, "Error: could not compile regex %s\n", regex);
-        free(regex);
+    if (*set == NULL) {
+        // If the set is empty, create it
+        *set = calloc(1, sizeof(Pattern));
+        if (*set == NULL) {
+            // If calloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*set)->globs = realloc((*set)->globs, ((*set)->num_globs + 1) * sizeof(char *));
+    if ((*set)->globs == NULL) {
+        // If realloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
         exit(EXIT_FAILURE);
     }
-    free(regex); // Free the memory allocated for the regex
-    new_pattern->next = *head; // Set the next pattern to the head of the linked list
-    *head = new_pattern; // Set the head of the linked list to the new pattern
+    (*set)->globs[(*set)->num_globs++] = strdup(glob);
+    compile_patterns(*set);
+}
+
+int run_automaton(Glob_automaton *automaton, char *text) {
+    // A function that takes an automaton and a name or path, and returns the kind of state the automaton is left in by reading it (whether it matched, and if not whether anything longer could)
+    if (automaton->num_positions == 0) {
+        return GLOB_STATE_DEAD;
+    }
+    if (automaton->transitions != NULL) {
+        // If the automaton has a table, read the text through it a byte at a time (stopping once the outcome is settled)
+        int state = 0;
+        for (unsigned char *c = (unsigned char *)text; *c != '\0'; c++) {
+            if (automaton->state_kinds[state] == GLOB_STATE_DEAD || automaton->state_kinds[state] == GLOB_STATE_SETTLED) {
+                break;
+            }
+            state = automaton->transitions[state * automaton->num_classes + automaton->byte_classes[*c]];
+        }
+        return automaton->state_kinds[state];
+    }
+    // Otherwise work out each state as the text is read
+    int words = (automaton->num_positions + 63) / 64;
+    uint64_t state[words];
+    uint64_t next[words];
+    memcpy(state, automaton->start, words * sizeof(uint64_t));
+    for (unsigned char *c = (unsigned char *)text; *c != '\0'; c++) {
+        step_state(automaton, state, *c, next, words);
+        memcpy(state, next, words * sizeof(uint64_t));
+    }
+    return state_kind(automaton, state);
+}
+
+bool patterns_match_names(Pattern *set) {
+    // A function that takes a set of globs, and returns true if any of them are matched against the names of files (rather than their paths)
+    return set->match_all || set->exact_names != NULL || set->suffixes != NULL || set->names.num_positions > 0;
+}
+
+bool patterns_match_paths(Pattern *set) {
+    // A function that takes a set of globs (NULL if it is empty), and returns true if any of them are matched against paths
+    return set != NULL && set->paths.num_positions > 0;
 }
 
-bool check_patterns(Pattern *head, char *filename) {
-    // A function that takes a linked list of patterns and a filename, and returns true if the filename matches any of the patterns, and false otherwise
-    Pattern *current_pattern = head; // Set the current pattern to the head of the linked list
-    while (current_pattern != NULL) {
-        // Loop through the linked list
-        int err = regexec(&(current_pattern->regex), filename, 0, NULL, 0); // Execute the regex
-        if (err == 0) {
-            // If the regex matches the filename, return true
+bool check_patterns(Pattern *set, char *filename, char *relpath) {
+    // A function that takes a set of globs, a filename and its relative path (NULL if the set has no path globs), and returns true if the file matches any of the globs, and false otherwise
+    add_stat(STAT_PATTERN_CHECKS, 1);
+    if (set->match_all) {
+        return true;
+    }
+    if (set->exact_names != NULL && get(set->exact_names, filename) != NULL) {
+        // If the filename is one of the plain names, it matches
+        return true;
+    }
+    size_t length = strlen(filename);
+    for (int i = 0; i < set->num_suffix_lengths; i++) {
+        // Loop through the lengths of the suffixes, looking up the end of the filename of each length
+        if ((size_t)set->suffix_lengths[i] <= length && get(set->suffixes, filename + length - set->suffix_lengths[i]) != NULL) {
             return true;
-        } else if (err != REG_NOMATCH) {
-            // If the regex could not be executed, print an error message and exit the program
-            fprintf(stderr, "Error: could not execute regex\n");
-            exit(EXIT_FAILURE);
         }
-        current_pattern = current_pattern->next; // Set the current pattern to the next pattern
     }
-    return false; // Return false if the filename does not match any of the patterns
+    if (run_automaton(&set->names, filename) >= GLOB_STATE_ACCEPT) {
+        return true;
+    }
+    return relpath != NULL && run_automaton(&set->paths, relpath) >= GLOB_STATE_ACCEPT;
+}
+
+int directory_pattern_kind(Pattern *set, char *relpath) {
+    // A function that takes a set of globs and the relative path of a directory ending in a '/', and returns the kind of state the path globs are left in by the path (a match means the directory matches, and a dead state means nothing within it can)
+    add_stat(STAT_PATTERN_CHECKS, 1);
+    return run_automaton(&set->paths, relpath);
 }
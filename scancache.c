@@ -0,0 +1,197 @@
+#include "mysync.h"
+
+// A C file that saves the listing of each root to a scan cache, so later runs can take unchanged directories from the cache instead of reading them
+// A cache file is laid out so it can be used straight from mmap: a header, an array of directories sorted by relative path, an array of entries, and the names
+// Only the names and types of the entries are cached, as a file's contents (and so its size and modification time) can change without its directory changing
+
+unsigned long long int hash_path(char *path) {
+    // A function that takes a path, and returns a 64-bit hash of it (used to name the cache file of each root)
+    unsigned long long int hash = 5381; // The same starting value as the hashtable's hash
+    for (char *c = path; *c != '\0'; c++) {
+        // Loop through the path
+        hash = ((hash << 5) + hash) + (unsigned char)*c;
+    }
+    return hash;
+}
+
+char *scan_cache_path(char *cache_dir, char *root) {
+    // A function that takes the cache directory and a root directory, and returns the path of the root's cache file
+    char *real_root = realpath(root, NULL); // Resolve the root, so the same root always finds the same cache file
+    if (real_root == NULL) {
+        // If the root can't be resolved, print an error message and exit the program
+        fprintf(stderr, "Error: could not resolve directory \"%s\"\n", root);
+        exit(EXIT_FAILURE);
+    }
+    char *path = malloc_data(strlen(cache_dir) + 16 + strlen(".cache") + 2); // Allocate memory for the cache file path
+    sprintf(path, "%s/%016llx.cache", cache_dir, hash_path(real_root));
+    free(real_root);
+    return path;
+}
+
+Scan_cache *load_scan_cache(char *cache_dir, char *root) {
+    // A function that takes the cache directory and a root directory, and maps the root's cache file into memory, returning NULL if there isn't a usable one
+    char *path = scan_cache_path(cache_dir, root);
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
+        // If there is no cache file yet (the first run), the root is read in full
+        return NULL;
+    }
+    struct stat cache_info; // The cache file's info (for its size)
+    if (fstat(fd, &cache_info) == -1 || cache_info.st_size < (off_t)sizeof(Cache_header)) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, cache_info.st_size, PROT_READ, MAP_PRIVATE, fd, 0); // Map the cache file (it is read in place, never parsed)
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    Scan_cache *cache = malloc_data(sizeof(Scan_cache));
+    cache->map = map;
+    cache->size = cache_info.st_size;
+    cache->header = (Cache_header *)map;
+    cache->dirs = (Cache_dir *)(cache->header + 1); // The directories start straight after the header
+    cache->entries = (Cache_entry *)(cache->dirs + cache->header->num_dirs); // The entries start straight after the directories
+    cache->strings = (char *)(cache->entries + cache->header->num_entries); // The names start straight after the entries
+    if (memcmp(cache->header->magic, SCAN_CACHE_MAGIC, sizeof(cache->header->magic)) != 0 || cache->header->version != SCAN_CACHE_VERSION
+        || sizeof(Cache_header) + cache->header->num_dirs * sizeof(Cache_dir) + cache->header->num_entries * sizeof(Cache_entry) + cache->header->strings_size != cache->size) {
+        // If the file isn't a cache file from this version, or is the wrong size, ignore it (it is rewritten after the scan)
+        free_scan_cache(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void free_scan_cache(Scan_cache *cache) {
+    // A function that takes a scan cache, and unmaps it
+    munmap(cache->map, cache->size);
+    free(cache);
+}
+
+Cache_dir *find_cached_dir(Scan_cache *cache, char *relpath, struct stat *info) {
+    // A function that takes a scan cache, the relative path of a directory, and the directory's info, and returns the cached listing of the directory if it hasn't changed since it was cached (NULL otherwise)
+    int low = 0;
+    int high = (int)cache->header->num_dirs - 1;
+    while (low <= high) {
+        // Binary search the directories, which are sorted by relative path
+        int middle = low + (high - low) / 2;
+        Cache_dir *dir = &cache->dirs[middle];
+        int result = strcmp(relpath, cache->strings + dir->relpath);
+        if (result == 0) {
+            // If the directory is found, it can only be used if it was trusted when cached and neither of its times have changed since (any entry being added, removed or renamed changes both)
+            bool unchanged = dir->trusted && dir->mtime_sec == info->st_mtim.tv_sec && dir->mtime_nsec == info->st_mtim.tv_nsec
+                && dir->ctime_sec == info->st_ctim.tv_sec && dir->ctime_nsec == info->st_ctim.tv_nsec;
+            return unchanged ? dir : NULL;
+        }
+        if (result < 0) {
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NULL;
+}
+
+void collect_listings(Scan_dir *listing, char *relpath, Cached_listing **listings, int *num_listings, int *capacity) {
+    // A function that takes a listing and its relative path (which the array takes ownership of), and adds it and the listings of all of its subdirectories to a growing array
+    if (*num_listings == *capacity) {
+        // If the array is full, double its size
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *listings = realloc(*listings, *capacity * sizeof(Cached_listing));
+        if (*listings == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*listings)[*num_listings].listing = listing;
+    (*listings)[*num_listings].relpath = relpath;
+    (*num_listings)++;
+    for (int i = 0; i < listing->num_entries; i++) {
+        // Loop through the entries and collect the subdirectories that were listed
+        if (listing->entries[i].listing != NULL) {
+            char *entry_relpath = malloc_data(strlen(relpath) + strlen(listing->entries[i].name) + 2); // The listings only know their names, so the relative paths the cache is sorted by are spelled out here
+            sprintf(entry_relpath, relpath[0] == '\0' ? "%s%s" : "%s/%s", relpath, listing->entries[i].name);
+            collect_listings(listing->entries[i].listing, entry_relpath, listings, num_listings, capacity);
+        }
+    }
+}
+
+int compare_listings(const void *a, const void *b) {
+    // A function that compares two listings by relative path (for qsort)
+    return strcmp(((Cached_listing *)a)->relpath, ((Cached_listing *)b)->relpath);
+}
+
+void write_scan_cache(char *cache_dir, char *root, Scan_dir *root_listing, struct timespec scan_start) {
+    // A function that takes the cache directory, a root directory, the root's listing, and the time the scan started, and writes the listing to the root's cache file
+    Cached_listing *listings = NULL; // An array of every listing in the root, with its relative path
+    int num_listings = 0;
+    int capacity = 0;
+    collect_listings(root_listing, strdup(""), &listings, &num_listings, &capacity);
+    qsort(listings, num_listings, sizeof(Cached_listing), compare_listings); // Sort the listings so they can be binary searched
+    Cache_header header; // The header of the cache file
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCAN_CACHE_MAGIC, sizeof(header.magic));
+    header.version = SCAN_CACHE_VERSION;
+    header.num_dirs = num_listings;
+    for (int i = 0; i < num_listings; i++) {
+        // Loop through the listings and add up how many entries and bytes of names there are
+        header.num_entries += listings[i].listing->num_entries;
+        header.strings_size += strlen(listings[i].relpath) + 1;
+        for (int j = 0; j < listings[i].listing->num_entries; j++) {
+            header.strings_size += strlen(listings[i].listing->entries[j].name) + 1;
+        }
+    }
+    size_t size = sizeof(Cache_header) + header.num_dirs * sizeof(Cache_dir) + header.num_entries * sizeof(Cache_entry) + header.strings_size; // The size of the cache file
+    char *data = calloc(1, size); // Allocate memory for the whole cache file (so it can be written with one write)
+    if (data == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(data, &header, sizeof(header));
+    Cache_dir *dirs = (Cache_dir *)(data + sizeof(Cache_header));
+    Cache_entry *entries = (Cache_entry *)(dirs + header.num_dirs);
+    char *strings = (char *)(entries + header.num_entries);
+    unsigned long long int strings_used = 0; // The number of bytes of names written so far
+    uint32_t entries_used = 0; // The number of entries written so far
+    for (int i = 0; i < num_listings; i++) {
+        // Loop through the listings and write each of them
+        Scan_dir *listing = listings[i].listing;
+        dirs[i].relpath = strings_used;
+        strcpy(strings + strings_used, listings[i].relpath);
+        strings_used += strlen(listings[i].relpath) + 1;
+        free(listings[i].relpath);
+        dirs[i].first_entry = entries_used;
+        dirs[i].num_entries = listing->num_entries;
+        dirs[i].mtime_sec = listing->info.st_mtim.tv_sec;
+        dirs[i].mtime_nsec = listing->info.st_mtim.tv_nsec;
+        dirs[i].ctime_sec = listing->info.st_ctim.tv_sec;
+        dirs[i].ctime_nsec = listing->info.st_ctim.tv_nsec;
+        // A directory changed within a second of the scan starting might have changed again within the same timestamp tick, so it isn't trusted next run
+        dirs[i].trusted = listing->info.st_ctim.tv_sec < scan_start.tv_sec - 1;
+        for (int j = 0; j < listing->num_entries; j++) {
+            // Loop through the entries of the listing and write each of them
+            Scan_entry *entry = &listing->entries[j];
+            entries[entries_used].name = strings_used;
+            entries[entries_used].type = entry->info.st_mode & S_IFMT;
+            strcpy(strings + strings_used, entry->name);
+            strings_used += strlen(entry->name) + 1;
+            entries_used++;
+        }
+    }
+    free(listings);
+    char *path = scan_cache_path(cache_dir, root); // The path of the cache file
+    char *temp_path = malloc_data(strlen(path) + strlen(".tmp") + 1); // Write to a temporary file and rename it, so a run that is interrupted never leaves a half written cache
+    sprintf(temp_path, "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || !write_all(fd, data, size, 0) || close(fd) == -1 || rename(temp_path, path) == -1) {
+        // If the cache file could not be written, print an error message and exit the program
+        fprintf(stderr, "Error: could not write scan cache \"%s\"\n", path);
+        exit(EXIT_FAILURE);
+    }
+    free(data);
+    free(temp_path);
+    free(path);
+}
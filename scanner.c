@@ -0,0 +1,682 @@
+#include "mysync.h"
+
+// A C file that lists the root directories (and every subdirectory within them) on a pool of worker threads
+// Each directory is listed into its own Scan_dir, so the listings can be merged afterwards in exactly the order a single thread would have found them
+
+Scan_dir *task_stack = NULL; // A stack of directories waiting to be listed (a stack so the roots are walked depth first, keeping the number of waiting directories small)
+int pending_tasks = 0; // The number of directories that have been pushed but not finished listing yet
+pthread_mutex_t task_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the task stack and the pending count
+pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER; // A condition that is signalled when a task is pushed or the last task finishes
+
+Scan_cache **root_caches = NULL; // An array of the scan caches loaded for each root (NULL if the --cache flag wasn't passed)
+
+_Atomic int held_directory_fds = 0; // The number of subdirectories that have been opened but not read yet (each holds a file descriptor until a worker reads it)
+
+// Counters of the work the scan did, so the system calls each entry cost can be printed with the -v flag (atomic as directories are listed on several threads)
+_Atomic long long int entries_scanned = 0; // The number of entries read from directories or the scan cache
+_Atomic long long int directories_scanned = 0; // The number of directories listed
+_Atomic long long int scan_stat_calls = 0; // The number of entries stat'ed
+_Atomic long long int scan_open_calls = 0; // The number of directories opened
+_Atomic long long int scan_uring_submits = 0; // The number of batches of statx requests submitted to io_uring (with the --io-uring flag)
+
+// With the --pipeline flag, the scan runs on its own thread, and each directory is queued for the merging thread as soon as it has been listed
+Scan_dir *listed_head = NULL; // A queue of directories that have finished listing but haven't been taken by the merging thread yet
+Scan_dir *listed_tail = NULL;
+bool scan_finished = false; // A bool that represents whether every directory has been listed (so the merging thread stops waiting once the queue is empty)
+pthread_mutex_t listed_lock = PTHREAD_MUTEX_INITIALIZER; // A lock that protects the queue and scan_finished
+pthread_cond_t listed_cond = PTHREAD_COND_INITIALIZER; // A condition that is signalled when a directory is queued or the scan finishes
+pthread_t pipeline_thread; // The thread running the scan
+char **pipeline_roots = NULL; // The root directories being scanned
+int pipeline_num_roots = 0;
+Scan_dir **pipeline_listings = NULL; // The listings of the roots, once the scan has finished
+
+Scan_dir *create_listing(char *root, Scan_dir *parent, char *name, int root_index, struct stat *info) {
+    // A function that takes a root directory, the listing of the directory a directory is in and the directory's name (NULL for the root itself), the index of the root, and the directory's info, and returns an empty listing for it
+    Scan_dir *listing = malloc_data(sizeof(Scan_dir)); // Allocate memory for the listing
+    listing->root = root;
+    listing->parent = parent; // The directory's path is only spelled out (from its parents' names) when it is read
+    listing->name = name;
+    listing->fd = -1; // The directory is opened when it is read, unless the parent opens it first
+    listing->root_index = root_index;
+    listing->info = *info; // Keep the directory's info (its times decide whether the scan cache can be trusted)
+    listing->entries = NULL; // The entries array is allocated when the first entry is found
+    listing->num_entries = 0;
+    listing->capacity = 0;
+    listing->next_task = NULL;
+    listing->pattern_path = NULL;
+    listing->pattern_path_length = 0;
+    listing->next_listed = NULL;
+    listing->node = NULL;
+    listing->listed = false;
+    return listing;
+}
+
+void free_listing(Scan_dir *listing) {
+    // A function that takes a listing, and frees it along with the listings of all of its subdirectories
+    for (int i = 0; i < listing->num_entries; i++) {
+        // Loop through the entries, freeing their names and any subdirectory listings
+        if (listing->entries[i].listing != NULL) {
+            free_listing(listing->entries[i].listing);
+        }
+        free(listing->entries[i].name);
+    }
+    free(listing->entries);
+    if (listing->fd != -1) {
+        // If the directory was opened but never read, close it
+        close(listing->fd);
+        held_directory_fds--;
+    }
+    free(listing);
+}
+
+void push_task(Scan_dir *listing, bool threaded) {
+    // A function that takes a listing, and pushes it onto the task stack so a worker will fill it in
+    if (threaded) {
+        pthread_mutex_lock(&task_lock);
+    }
+    listing->next_task = task_stack; // Push the listing onto the top of the stack
+    task_stack = listing;
+    pending_tasks++; // Another directory needs to be listed before the scan is finished
+    if (threaded) {
+        pthread_cond_signal(&task_cond); // Wake up a worker that is waiting for a task
+        pthread_mutex_unlock(&task_lock);
+    }
+}
+
+Scan_entry *add_entry(Scan_dir *listing, char *name) {
+    // A function that takes a listing and the name of an entry, and appends a new entry to the listing
+    if (listing->num_entries == listing->capacity) {
+        // If the entries array is full, double its size
+        listing->capacity = listing->capacity == 0 ? 16 : listing->capacity * 2;
+        listing->entries = realloc(listing->entries, listing->capacity * sizeof(Scan_entry));
+        if (listing->entries == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    Scan_entry *entry = &listing->entries[listing->num_entries++]; // Take the next free entry
+    entry->name = strdup(name); // Copy the name of the entry
+    entry->skip_reason = SCAN_KEEP; // Entries are kept unless a filter says otherwise
+    entry->listing = NULL; // Only subdirectories that are recursed into have a listing
+    return entry;
+}
+
+int file_skip_reason(char *filename, char *relpath, Flags *flags) {
+    // A function that takes the name of a regular file, its relative path (NULL if there are no path globs to match it against), and a flags struct, and returns why the file is left out of the sync (SCAN_KEEP if it isn't)
+    if (is_temp_name(filename)) {
+        // If the file is a temporary file of mysync's (a copy being written, or one left behind by a sync that was killed), always skip the file
+        return SCAN_SKIP_TEMPORARY;
+    }
+    if (filename[0] == '.' && !flags->all_flag) {
+        // If the filename starts with a '.', and the -a flag was not passed, skip the file
+        return SCAN_SKIP_HIDDEN;
+    }
+    if (flags->ignore1 != NULL && check_patterns(flags->ignore1, filename, relpath)) {
+        // If the file matches an ignore pattern, skip the file
+        return SCAN_SKIP_IGNORED;
+    }
+    if (flags->only1 != NULL && !check_patterns(flags->only1, filename, relpath)) {
+        // If the file does not match an only pattern, skip the file
+        return SCAN_SKIP_NOT_ONLY;
+    }
+    return SCAN_KEEP;
+}
+
+int directory_skip_reason(char *relpath, Flags *flags) {
+    // A function that takes the relative path of a directory followed by a '/' (NULL if there are no path globs), and a flags struct, and returns why the directory is left out of the sync without being read (SCAN_KEEP if it isn't)
+    if (relpath == NULL) {
+        return SCAN_KEEP;
+    }
+    if (patterns_match_paths(flags->ignore1) && directory_pattern_kind(flags->ignore1, relpath) >= GLOB_STATE_ACCEPT) {
+        // If the directory matches an ignore pattern, skip it (and everything within it)
+        return SCAN_SKIP_IGNORED;
+    }
+    if (patterns_match_paths(flags->only1) && !patterns_match_names(flags->only1) && directory_pattern_kind(flags->only1, relpath) == GLOB_STATE_DEAD) {
+        // If every only pattern is a path, and none of them can match anything within the directory, skip it
+        return SCAN_SKIP_NOT_ONLY;
+    }
+    return SCAN_KEEP;
+}
+
+size_t listing_path_length(Scan_dir *listing) {
+    // A function that takes a listing, and returns the length of the full path of its directory
+    if (listing->parent == NULL) {
+        return strlen(listing->root);
+    }
+    return listing_path_length(listing->parent) + 1 + strlen(listing->name);
+}
+
+size_t write_listing_path(Scan_dir *listing, char *buffer) {
+    // A function that takes a listing and a buffer big enough for its path, and writes the full path of its directory into the buffer, returning its length
+    if (listing->parent == NULL) {
+        strcpy(buffer, listing->root);
+        return strlen(listing->root);
+    }
+    size_t length = write_listing_path(listing->parent, buffer); // Write the path of the directory it is in, then add its name
+    buffer[length] = '/';
+    strcpy(buffer + length + 1, listing->name);
+    return length + 1 + strlen(listing->name);
+}
+
+size_t write_listing_relpath(Scan_dir *listing, char *buffer) {
+    // A function that takes a listing and a buffer long enough, and writes the path of its directory relative to its root into the buffer, returning the length written (0 for a root)
+    if (listing->parent == NULL) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    size_t length = write_listing_relpath(listing->parent, buffer); // Write the path of the directory it is in, then add its name
+    if (length > 0) {
+        buffer[length++] = '/';
+    }
+    strcpy(buffer + length, listing->name);
+    return length + strlen(listing->name);
+}
+
+void start_pattern_path(Scan_dir *listing, Flags *flags) {
+    // A function that takes a listing about to be read and a flags struct, and spells out the directory's relative path for its entries to be matched against the path globs (if there are any)
+    if (!patterns_match_paths(flags->ignore1) && !patterns_match_paths(flags->only1)) {
+        return;
+    }
+    listing->pattern_path = malloc_data(listing_path_length(listing) + NAME_MAX + 3); // The relative path is shorter than the full path, and an entry's name and a '/' go after it
+    listing->pattern_path_length = write_listing_relpath(listing, listing->pattern_path);
+    if (listing->pattern_path_length > 0) {
+        listing->pattern_path[listing->pattern_path_length++] = '/';
+    }
+}
+
+void end_pattern_path(Scan_dir *listing) {
+    // A function that takes a listing that has been read, and frees the relative path its entries were matched with
+    free(listing->pattern_path);
+    listing->pattern_path = NULL;
+}
+
+char *entry_pattern_path(Scan_dir *listing, char *filename, bool is_directory) {
+    // A function that takes a listing being read, the name of an entry and whether the entry is a directory, and returns the entry's relative path to match the path globs against (with a '/' on the end for a directory), or NULL if there are no path globs
+    if (listing->pattern_path == NULL) {
+        return NULL;
+    }
+    char *end = stpcpy(listing->pattern_path + listing->pattern_path_length, filename);
+    strcpy(end, is_directory ? "/" : "");
+    return listing->pattern_path;
+}
+
+char *listing_path(Scan_dir *listing) {
+    // A function that takes a listing, and returns the full path of its directory (which must be freed), for the few times a directory is opened or reported by its path
+    char *path = malloc_data(listing_path_length(listing) + 1);
+    write_listing_path(listing, path);
+    return path;
+}
+
+int known_type(unsigned char d_type) {
+    // A function that takes the type of an entry given by readdir, and returns the type it is certain to have once stat'ed (S_IFREG or S_IFDIR), 0 if only a stat can tell (a symbolic link or a filesystem that doesn't give types), or -1 if the entry can never be synced
+    switch (d_type) {
+        case DT_REG:
+            return S_IFREG;
+        case DT_DIR:
+            return S_IFDIR;
+        case DT_LNK:
+        case DT_UNKNOWN:
+            return 0; // Links are followed, so what they point to has to be stat'ed
+        default:
+            return -1; // Devices, pipes and sockets are never synced
+    }
+}
+
+Scan_entry *add_unstated_entry(Scan_dir *listing, char *filename, int type, int skip_reason) {
+    // A function that takes a listing, the name of an entry, its type and the reason it is skipped, and adds it to the listing without stat'ing it (the merge only looks at the type of a skipped entry)
+    Scan_entry *entry = add_entry(listing, filename);
+    memset(&entry->info, 0, sizeof(struct stat));
+    entry->info.st_mode = type;
+    entry->skip_reason = skip_reason;
+    return entry;
+}
+
+bool add_unstated_if_skipped(Scan_dir *listing, char *filename, int type, Flags *flags) {
+    // A function that takes a listing, the name of an entry, the entry's type if it is already known (from readdir or the scan cache, 0 if it isn't), and a flags struct, and adds the entry without stat'ing it if its type and name already show it is skipped, returning whether it was added
+    entries_scanned++;
+    if (type == S_IFREG) {
+        // If the entry is known to be a regular file, check the filters first, as a file that is skipped never needs to be stat'ed
+        int skip_reason = file_skip_reason(filename, entry_pattern_path(listing, filename, false), flags);
+        if (skip_reason != SCAN_KEEP) {
+            add_unstated_entry(listing, filename, S_IFREG, skip_reason);
+            return true;
+        }
+    }
+    if (type == S_IFDIR && !flags->recursive_flag) {
+        // If the entry is known to be a directory and the -r flag was not passed, it is skipped without being stat'ed too
+        add_unstated_entry(listing, filename, S_IFDIR, SCAN_SKIP_DIRECTORY);
+        return true;
+    }
+    if (type == S_IFDIR) {
+        // If the entry is known to be a directory, check the path globs first, as a directory that is skipped is never stat'ed or opened (and nothing within it is read)
+        int skip_reason = directory_skip_reason(entry_pattern_path(listing, filename, true), flags);
+        if (skip_reason != SCAN_KEEP) {
+            add_unstated_entry(listing, filename, S_IFDIR, skip_reason);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool fill_stated_entry(Scan_dir *listing, Scan_entry *entry, int dir_fd, struct stat *file_info, Flags *flags) {
+    // A function that takes a listing, an entry just added to it, the open directory, the entry's info, and a flags struct, and fills in the entry from its info, returning false if the entry is never synced (so it should be taken out of the listing)
+    if (!S_ISDIR(file_info->st_mode) && !S_ISREG(file_info->st_mode)) {
+        // If the entry is neither a directory nor a regular file, it is never synced, so leave it out of the listing
+        return false;
+    }
+    entry->info = *file_info; // Keep the entry's info for the merge
+    entry->skip_reason = SCAN_KEEP;
+    if (S_ISDIR(file_info->st_mode) && !flags->recursive_flag) {
+        // If the entry is a directory and the -r flag was not passed, skip the directory
+        entry->skip_reason = SCAN_SKIP_DIRECTORY;
+    } else if (S_ISDIR(file_info->st_mode)) {
+        // If the entry is a directory, skip it without opening it if the path globs leave it out, and otherwise list it too (on whichever worker is free)
+        entry->skip_reason = directory_skip_reason(entry_pattern_path(listing, entry->name, true), flags);
+        if (entry->skip_reason != SCAN_KEEP) {
+            return true;
+        }
+        entry->listing = create_listing(listing->root, listing, entry->name, listing->root_index, file_info); // The subdirectory shares its name with its entry
+        if (held_directory_fds++ < SCAN_MAX_HELD_FDS) {
+            // If not too many subdirectories are waiting with a file descriptor already, open it now relative to this directory (otherwise it is opened by its path when it is read)
+            scan_open_calls++;
+            entry->listing->fd = openat(dir_fd, entry->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (entry->listing->fd == -1) {
+            held_directory_fds--;
+        }
+    } else {
+        // If the entry is a regular file, check whether it is filtered out
+        entry->skip_reason = file_skip_reason(entry->name, entry_pattern_path(listing, entry->name, false), flags);
+    }
+    return true;
+}
+
+void report_stat_failure(Scan_dir *listing, char *filename) {
+    // A function that takes a listing and the name of an entry that couldn't be stat'ed, and prints an error message and exits the program
+    char *dirpath = listing_path(listing);
+    fprintf(stderr, "Error: could not get file info for file \"%s/%s\"\n", dirpath, filename);
+    exit(EXIT_FAILURE);
+}
+
+bool scan_entry(Scan_dir *listing, int dir_fd, char *filename, int type, bool cached, Flags *flags) {
+    // A function that takes a listing, the open directory it is of, the name of an entry, the entry's type if it is already known (from readdir or the scan cache, 0 if it isn't), whether the entry came from the scan cache, and a flags struct, and adds the entry to the listing, returning false if a cached entry has disappeared
+    if (add_unstated_if_skipped(listing, filename, type, flags)) {
+        return true;
+    }
+    struct stat file_info; // A struct that represents a file's info
+    scan_stat_calls++;
+    if (fstatat(dir_fd, filename, &file_info, 0) == -1) {
+        // Stat the entry relative to its directory (following links, as stat would), so the kernel doesn't walk the whole path again for every entry
+        if (cached && errno == ENOENT) {
+            // If a cached entry has gone the cache was out of date, so let the caller read the directory properly
+            return false;
+        }
+        // If stat fails, print an error message and exit the program
+        report_stat_failure(listing, filename);
+    }
+    Scan_entry *entry = add_entry(listing, filename); // Add the entry to the listing
+    if (!fill_stated_entry(listing, entry, dir_fd, &file_info, flags)) {
+        // If the entry is never synced, take it back out
+        free(entry->name);
+        listing->num_entries--;
+    }
+    return true;
+}
+
+void queue_entry(Scan_dir *listing, char *filename, int type, Flags *flags) {
+    // A function that takes a listing, the name of an entry, its type if it is already known, and a flags struct, and adds the entry to the listing to be stat'ed in a batch with the rest of the directory (with the --io-uring flag), unless its type and name already show it is skipped
+    if (!add_unstated_if_skipped(listing, filename, type, flags)) {
+        add_entry(listing, filename)->skip_reason = SCAN_PENDING_STAT;
+    }
+}
+
+bool stat_queued_entries(Scan_dir *listing, int dir_fd, Uring *ring, bool cached, Flags *flags) {
+    // A function that takes a listing whose entries were queued, the open directory, the thread's ring, whether the entries came from the scan cache, and a flags struct, and stats every queued entry with batches of statx requests, returning false if a cached entry has disappeared
+    int num_queued = 0;
+    for (int i = 0; i < listing->num_entries; i++) {
+        num_queued += listing->entries[i].skip_reason == SCAN_PENDING_STAT;
+    }
+    if (num_queued == 0) {
+        return true;
+    }
+    char **names = malloc_data(num_queued * sizeof(char *)); // The names to stat, in the order they were read
+    struct stat *infos = malloc_data(num_queued * sizeof(struct stat));
+    int *errors = malloc_data(num_queued * sizeof(int));
+    for (int i = 0, j = 0; i < listing->num_entries; i++) {
+        if (listing->entries[i].skip_reason == SCAN_PENDING_STAT) {
+            names[j++] = listing->entries[i].name;
+        }
+    }
+    scan_stat_calls += num_queued;
+    scan_uring_submits += (num_queued + ring->depth - 1) / ring->depth; // Each batch costs one system call
+    uring_stat_batch(ring, dir_fd, names, infos, errors, num_queued);
+    bool cache_valid = true;
+    int kept = 0; // The number of entries kept so far (the entries that are never synced are taken out, keeping the rest in order)
+    for (int i = 0, j = 0; i < listing->num_entries; i++) {
+        // Loop through the entries, filling in the queued ones from their info
+        Scan_entry *entry = &listing->entries[i];
+        bool keep = true;
+        if (entry->skip_reason == SCAN_PENDING_STAT) {
+            if (errors[j] == ENOENT && cached) {
+                // If a cached entry has gone the cache was out of date, so let the caller read the directory properly
+                cache_valid = false;
+            } else if (errors[j] != 0) {
+                // If stat fails, print an error message and exit the program
+                report_stat_failure(listing, entry->name);
+            }
+            keep = cache_valid && fill_stated_entry(listing, entry, dir_fd, &infos[j], flags);
+            j++;
+        }
+        if (keep) {
+            listing->entries[kept++] = *entry;
+        } else {
+            free(entry->name);
+        }
+    }
+    listing->num_entries = kept;
+    free(names);
+    free(infos);
+    free(errors);
+    return cache_valid;
+}
+
+void push_subdirectories(Scan_dir *listing, bool threaded) {
+    // A function that takes a finished listing, and pushes a task for each of the subdirectories found in it
+    for (int i = 0; i < listing->num_entries; i++) {
+        if (listing->entries[i].listing != NULL) {
+            push_task(listing->entries[i].listing, threaded);
+        }
+    }
+}
+
+void publish_listing(Scan_dir *listing, Flags *flags) {
+    // A function that takes a finished listing and a flags struct, and queues it for the merging thread if the --pipeline flag was passed (its subdirectories may still be being listed)
+    if (!flags->pipeline_flag) {
+        return;
+    }
+    pthread_mutex_lock(&listed_lock);
+    if (listed_tail == NULL) {
+        listed_head = listing;
+    } else {
+        listed_tail->next_listed = listing;
+    }
+    listed_tail = listing;
+    pthread_cond_signal(&listed_cond); // Wake the merging thread if it is waiting
+    pthread_mutex_unlock(&listed_lock);
+}
+
+void clear_listing(Scan_dir *listing) {
+    // A function that takes a listing, and removes all of its entries (so the directory can be read again)
+    for (int i = 0; i < listing->num_entries; i++) {
+        // Loop through the entries, freeing their names and any subdirectory listings (which haven't been pushed yet)
+        if (listing->entries[i].listing != NULL) {
+            free_listing(listing->entries[i].listing);
+        }
+        free(listing->entries[i].name);
+    }
+    listing->num_entries = 0;
+}
+
+void read_directory(Scan_dir *listing, bool threaded, Flags *flags) {
+    // A function that takes a listing and a flags struct, and reads the directory into the listing, pushing a new task for every subdirectory found
+    int dir_fd = listing->fd; // The directory, if its parent opened it already
+    if (dir_fd == -1) {
+        // If the directory isn't open yet (it is a root, or too many directories were waiting when it was found), open it by its path
+        char *dirpath = listing_path(listing);
+        scan_open_calls++;
+        dir_fd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1) {
+            // If the directory could not be opened, print an error message and exit the program
+            fprintf(stderr, "Error: could not open directory \"%s\"\n", dirpath);
+            exit(EXIT_FAILURE);
+        }
+        free(dirpath);
+    } else {
+        listing->fd = -1; // The listing no longer holds the descriptor (it is closed with the directory stream)
+        held_directory_fds--;
+    }
+    directories_scanned++;
+    start_pattern_path(listing, flags); // Spell out the directory's relative path if its entries are matched against path globs
+    Uring *ring = thread_uring(flags); // The thread's io_uring, if the --io-uring flag was passed (the entries are then stat'ed in batches)
+    Scan_cache *cache = root_caches == NULL ? NULL : root_caches[listing->root_index]; // The scan cache of the directory's root (if there is one)
+    if (cache != NULL) {
+        // If there is a scan cache, look the directory up by its path relative to its root
+        char *dirpath = listing_path(listing);
+        char *relpath = listing->parent == NULL ? "" : dirpath + strlen(listing->root) + 1; // The relative path is the end of the full path
+        Cache_dir *cached_dir = find_cached_dir(cache, relpath, &listing->info); // The cached listing of the directory, if the directory hasn't changed since it was cached
+        free(dirpath);
+        if (cached_dir != NULL) {
+            // If the directory hasn't changed, take its entries from the cache rather than reading it
+            bool cache_valid = true;
+            for (uint32_t i = 0; cache_valid && i < cached_dir->num_entries; i++) {
+                // Loop through the cached entries
+                Cache_entry *cached_entry = &cache->entries[cached_dir->first_entry + i];
+                if (ring != NULL) {
+                    queue_entry(listing, cache->strings + cached_entry->name, cached_entry->type, flags);
+                } else {
+                    cache_valid = scan_entry(listing, dir_fd, cache->strings + cached_entry->name, cached_entry->type, true, flags);
+                }
+            }
+            if (ring != NULL) {
+                // If the entries were queued, stat them all now
+                cache_valid = stat_queued_entries(listing, dir_fd, ring, true, flags);
+            }
+            if (cache_valid) {
+                close(dir_fd);
+                end_pattern_path(listing);
+                push_subdirectories(listing, threaded);
+                publish_listing(listing, flags);
+                return;
+            }
+            clear_listing(listing); // If an entry had gone, throw away what was taken from the cache and read the directory instead
+        }
+    }
+    DIR *dir = fdopendir(dir_fd); // Read the directory through the descriptor it was opened with
+    if (dir == NULL) {
+        // If the directory could not be read, print an error message and exit the program
+        char *dirpath = listing_path(listing);
+        fprintf(stderr, "Error: could not open directory \"%s\"\n", dirpath);
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *dirent; // A struct that represents a directory entry
+    while ((dirent = readdir(dir)) != NULL) {
+        // Loop through the directory entries
+        char *filename = dirent->d_name; // Get the filename
+        if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+            // If the filename is "." or "..", skip it as it is not a file or directory
+            continue;
+        }
+        int type = known_type(dirent->d_type); // The type readdir gave the entry (most filesystems give one, which saves stat'ing entries that are skipped)
+        if (type == -1) {
+            // If the entry is a device, pipe or socket, it is never synced, so leave it out without stat'ing it
+            entries_scanned++;
+            continue;
+        }
+        if (ring != NULL) {
+            queue_entry(listing, filename, type, flags); // Add the entry to the listing, to be stat'ed with the rest of the directory
+        } else {
+            scan_entry(listing, dir_fd, filename, type, false, flags); // Add the entry to the listing (stat'ing it only if it is kept)
+        }
+    }
+    if (ring != NULL) {
+        // If the entries were queued, stat them all now
+        stat_queued_entries(listing, dir_fd, ring, false, flags);
+    }
+    closedir(dir); // Close the directory (and its descriptor)
+    end_pattern_path(listing);
+    push_subdirectories(listing, threaded); // Hand the subdirectories to the workers
+    publish_listing(listing, flags); // Hand the listing to the merging thread (with the --pipeline flag)
+}
+
+Scan_dir *pop_task(void) {
+    // A function that waits for a task and pops it from the task stack, returning NULL once every directory has been listed
+    pthread_mutex_lock(&task_lock);
+    while (task_stack == NULL && pending_tasks > 0) {
+        // Wait until a task is pushed or the last pending task finishes
+        pthread_cond_wait(&task_cond, &task_lock);
+    }
+    Scan_dir *listing = task_stack; // Take the top of the stack (NULL if the scan is finished)
+    if (listing != NULL) {
+        task_stack = listing->next_task;
+    }
+    pthread_mutex_unlock(&task_lock);
+    return listing;
+}
+
+void finish_task(void) {
+    // A function that marks a task as finished, waking every worker if it was the last one
+    pthread_mutex_lock(&task_lock);
+    pending_tasks--;
+    if (pending_tasks == 0) {
+        // If there is nothing left to list, wake all the workers so they can exit
+        pthread_cond_broadcast(&task_cond);
+    }
+    pthread_mutex_unlock(&task_lock);
+}
+
+void *scan_worker(void *arg) {
+    // A function that is run by each worker thread, listing directories from the task stack until the scan is finished
+    Flags *flags = (Flags *)arg;
+    Scan_dir *listing;
+    while ((listing = pop_task()) != NULL) {
+        // Loop through the tasks, listing each directory
+        read_directory(listing, true, flags);
+        finish_task();
+    }
+    release_thread_uring(); // Free the worker's io_uring (if it had one)
+    return NULL;
+}
+
+Scan_dir **scan_roots(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and returns a listing of each of the directories (listed on flags->num_threads threads)
+    Scan_dir **listings = malloc_data(num_directories * sizeof(Scan_dir *)); // Allocate memory for the listings of the root directories
+    entries_scanned = directories_scanned = scan_stat_calls = scan_open_calls = scan_uring_submits = 0; // Count this scan's work on its own (--watch can scan again)
+    struct timespec scan_start; // The time the scan started (directories changed around this time can't be trusted from the cache next run)
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+    struct timespec scan_timer; // The time the scan started (for the --stats flag)
+    start_stat_timer(&scan_timer);
+    if (flags->cache_dir != NULL) {
+        // If the --cache flag was passed, load the scan cache of each root
+        root_caches = malloc_data(num_directories * sizeof(Scan_cache *));
+        for (int i = 0; i < num_directories; i++) {
+            root_caches[i] = load_scan_cache(flags->cache_dir, directories[i]);
+        }
+    }
+    for (int i = num_directories - 1; i >= 0; i--) {
+        // Loop through the directories in reverse, so the first root ends up on the top of the stack
+        struct stat root_info; // The root directory's info
+        if (stat(directories[i], &root_info) == -1) {
+            // If stat fails, print an error message and exit the program
+            fprintf(stderr, "Error: could not get file info for directory \"%s\"\n", directories[i]);
+            exit(EXIT_FAILURE);
+        }
+        listings[i] = create_listing(directories[i], NULL, NULL, i, &root_info);
+        push_task(listings[i], false);
+    }
+    if (flags->num_threads <= 1) {
+        // If only one thread was asked for, list every directory on this thread
+        while (task_stack != NULL) {
+            Scan_dir *listing = task_stack; // Pop the top of the stack
+            task_stack = listing->next_task;
+            read_directory(listing, false, flags);
+            pending_tasks--;
+        }
+    } else {
+        // Otherwise start the workers and wait for them to list every directory
+        pthread_t *workers = malloc_data(flags->num_threads * sizeof(pthread_t)); // Allocate memory for the worker threads
+        for (int i = 0; i < flags->num_threads; i++) {
+            // Loop through the workers and start each of them
+            if (pthread_create(&workers[i], NULL, scan_worker, flags) != 0) {
+                // If a thread could not be created, print an error message and exit the program
+                fprintf(stderr, "Error: could not create scan thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < flags->num_threads; i++) {
+            // Loop through the workers and wait for each of them to finish
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+    }
+    stop_stat_timer(STAT_TIME_SCAN, &scan_timer);
+    // Add the scan's counts to the --stats counters (the scan counts them anyway, for the -v flag)
+    add_stat(STAT_ENTRIES_SCANNED, entries_scanned);
+    add_stat(STAT_DIRECTORIES_SCANNED, directories_scanned);
+    add_stat(STAT_STAT_CALLS, scan_stat_calls);
+    add_stat(STAT_OPEN_CALLS, scan_open_calls);
+    add_stat(STAT_URING_SUBMITS, scan_uring_submits);
+    if (flags->verbose_flag && entries_scanned > 0 && scan_uring_submits > 0) {
+        // If the -v flag was passed and the entries were stat'ed through io_uring, print how many system calls the batches saved
+        printf("Scanned %lld entries in %lld directories with %lld statx requests in %lld io_uring submissions and %lld opens (%.2f system calls per entry)\n", (long long int)entries_scanned,
+               (long long int)directories_scanned, (long long int)scan_stat_calls, (long long int)scan_uring_submits, (long long int)scan_open_calls, (double)(scan_uring_submits + scan_open_calls) / entries_scanned);
+    } else if (flags->verbose_flag && entries_scanned > 0) {
+        // If the -v flag was passed, print how many system calls the scan made for each entry it found
+        printf("Scanned %lld entries in %lld directories with %lld stat calls and %lld opens (%.2f system calls per entry)\n", (long long int)entries_scanned,
+               (long long int)directories_scanned, (long long int)scan_stat_calls, (long long int)scan_open_calls, (double)(scan_stat_calls + scan_open_calls) / entries_scanned);
+    }
+    if (root_caches != NULL) {
+        // If the --cache flag was passed, replace each root's scan cache with the listing just made
+        for (int i = 0; i < num_directories; i++) {
+            if (root_caches[i] != NULL) {
+                free_scan_cache(root_caches[i]);
+            }
+            write_scan_cache(flags->cache_dir, directories[i], listings[i], scan_start);
+        }
+        free(root_caches);
+        root_caches = NULL;
+    }
+    return listings;
+}
+
+void *pipeline_scan(void *arg) {
+    // A function that is run by the scan thread of a pipelined sync, listing every root and then marking the scan as finished
+    Flags *flags = (Flags *)arg;
+    Scan_dir **listings = scan_roots(pipeline_roots, pipeline_num_roots, flags);
+    release_thread_uring(); // Free the thread's io_uring (if it had one)
+    pthread_mutex_lock(&listed_lock);
+    pipeline_listings = listings;
+    scan_finished = true;
+    pthread_cond_broadcast(&listed_cond); // Wake the merging thread, as no more directories are coming
+    pthread_mutex_unlock(&listed_lock);
+    return NULL;
+}
+
+void start_pipelined_scan(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and starts listing the directories on a thread of their own, queueing each directory as it is listed
+    pipeline_roots = directories;
+    pipeline_num_roots = num_directories;
+    listed_head = listed_tail = NULL;
+    scan_finished = false;
+    if (pthread_create(&pipeline_thread, NULL, pipeline_scan, flags) != 0) {
+        // If the thread could not be created, print an error message and exit the program
+        fprintf(stderr, "Error: could not create scan thread\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+Scan_dir *next_listed_directory(void) {
+    // A function that waits for a directory to finish listing and returns it, returning NULL once every directory has been returned
+    pthread_mutex_lock(&listed_lock);
+    while (listed_head == NULL && !scan_finished) {
+        // Wait until a directory is queued or the scan finishes
+        pthread_cond_wait(&listed_cond, &listed_lock);
+    }
+    Scan_dir *listing = listed_head; // Take the head of the queue (NULL if the scan is finished)
+    if (listing != NULL) {
+        listed_head = listing->next_listed;
+        if (listed_head == NULL) {
+            listed_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&listed_lock);
+    return listing;
+}
+
+Scan_dir **finish_pipelined_scan(void) {
+    // A function that waits for the scan thread to finish, and returns the listings of the roots (in the order the roots were passed)
+    pthread_join(pipeline_thread, NULL);
+    Scan_dir **listings = pipeline_listings;
+    pipeline_listings = NULL;
+    return listings;
+}
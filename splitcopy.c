@@ -0,0 +1,179 @@
+#include "mysync.h"
+
+// A C file that copies a very large master file in ranges on several threads at once (with the --split flag)
+// Each thread takes the next range that hasn't been started and copies it to every copy at the same offset, so one huge file can keep a deep I/O queue busy rather than being copied by a single loop
+
+void copy_split_piece(Split_copy *copy, char *buffer, long long int start, long long int end) {
+    // A function that takes a split copy, a thread's buffer, and a piece of the master file with data in it, and copies the piece to every copy (inside the kernel where it can be, otherwise reading it into the buffer once and writing it to every copy that needs it)
+    bool buffered = false; // A bool that represents whether any copy needs the piece written from the buffer
+    long long int written = 0; // The bytes of data written to the copies (for the --stats flag)
+    for (int i = 0; i < copy->num_fds; i++) {
+        // Loop through the copies and copy the piece inside the kernel to the ones that can
+        if (copy->fds[i] == -1) {
+            continue;
+        }
+        pthread_mutex_lock(&copy->lock);
+        int method = copy->methods[i];
+        pthread_mutex_unlock(&copy->lock);
+        long long int copied = method == COPY_FILE_RANGE ? copy_range(COPY_FILE_RANGE, copy->master_fd, copy->fds[i], start, end - start) : -1;
+        if (copied == end - start) {
+            written += copied;
+            continue;
+        }
+        if (method == COPY_FILE_RANGE && (copied != -1 || !copy_method_unsupported(errno))) {
+            // If the copy failed for a reason other than the method not being supported (or the master file shrank since it was stat'ed), stop copying
+            pthread_mutex_lock(&copy->lock);
+            copy->failed = true;
+            pthread_mutex_unlock(&copy->lock);
+            return;
+        }
+        if (method == COPY_FILE_RANGE) {
+            // If copy_file_range isn't supported between the files, write this copy from the buffer from now on
+            pthread_mutex_lock(&copy->lock);
+            copy->methods[i] = COPY_READ_WRITE;
+            pthread_mutex_unlock(&copy->lock);
+        }
+        buffered = true;
+    }
+    for (long long int offset = start; buffered && offset < end;) {
+        // Loop through the piece a buffer at a time, reading it once and writing it to every copy that isn't copied inside the kernel
+        size_t length = end - offset < SPLIT_BUFFER_SIZE ? end - offset : SPLIT_BUFFER_SIZE;
+        ssize_t bytes_read = pread(copy->master_fd, buffer, length, offset);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            // If the read failed (or the master file shrank since it was stat'ed), stop copying
+            pthread_mutex_lock(&copy->lock);
+            copy->failed = true;
+            pthread_mutex_unlock(&copy->lock);
+            return;
+        }
+        for (int i = 0; i < copy->num_fds; i++) {
+            // Loop through the copies written from the buffer (leaving out its blocks of zeros if the --sparse flag was passed)
+            pthread_mutex_lock(&copy->lock);
+            bool from_buffer = copy->fds[i] != -1 && copy->methods[i] == COPY_READ_WRITE;
+            pthread_mutex_unlock(&copy->lock);
+            if (from_buffer && !(copy->flags->sparse_flag ? write_sparse(copy->fds[i], buffer, bytes_read, offset, &written) : write_all(copy->fds[i], buffer, bytes_read, offset))) {
+                pthread_mutex_lock(&copy->lock);
+                copy->failed = true;
+                pthread_mutex_unlock(&copy->lock);
+                return;
+            }
+            if (from_buffer && !copy->flags->sparse_flag) {
+                written += bytes_read;
+            }
+        }
+        offset += bytes_read;
+    }
+    add_stat(STAT_BYTES_WRITTEN, written);
+}
+
+void *split_worker(void *arg) {
+    // A function that is run by each thread of a split copy, copying the next range that hasn't been started until every range is taken (or a copy fails)
+    Split_copy *copy = (Split_copy *)arg;
+    char *buffer = malloc_data(SPLIT_BUFFER_SIZE); // Allocate memory for the thread's buffer
+    while (true) {
+        long long int range_start = atomic_fetch_add(&copy->next_range, 1) * SPLIT_RANGE_SIZE; // Take the next range
+        pthread_mutex_lock(&copy->lock);
+        bool failed = copy->failed;
+        pthread_mutex_unlock(&copy->lock);
+        if (range_start >= copy->size || failed) {
+            break;
+        }
+        long long int range_end = copy->size - range_start < SPLIT_RANGE_SIZE ? copy->size : range_start + SPLIT_RANGE_SIZE;
+        long long int start = range_start, end = range_end; // The piece of the range with data in it (all of it unless the master file has holes)
+        for (long long int offset = range_start; !copy->holes || (offset < range_end && next_data_extent(copy->master_fd, offset, range_end, &start, &end)); offset = end) {
+            // Loop through the pieces of data in the range (just the one if the master file has no holes)
+            copy_split_piece(copy, buffer, start, end);
+            if (!copy->holes) {
+                break;
+            }
+        }
+        if (copy->flags->stream_flag) {
+            // If the --stream flag was passed, write the range back and drop it from the page cache now it is copied
+            release_cached_range(copy->master_fd, copy->fds, copy->num_fds, range_start, range_end);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+void split_copy(char *master_path, int master_fd, struct stat *master_info, char **filepaths, int *files, int *methods, int num_filepaths, Flags *flags) {
+    // A function that takes an open master file and its info, the paths of its copies and their open file descriptors, an array for the method each copy is written with, and a flags struct, and copies the master file to every copy in ranges on several threads at once
+    Split_copy copy; // The state the threads share
+    copy.master_fd = master_fd;
+    copy.size = master_info->st_size;
+    copy.holes = has_holes(master_info);
+    copy.fds = malloc_data(num_filepaths * sizeof(int));
+    copy.methods = methods;
+    copy.num_fds = num_filepaths;
+    atomic_init(&copy.next_range, 0);
+    pthread_mutex_init(&copy.lock, NULL);
+    copy.failed = false;
+    copy.flags = flags;
+    for (int i = 0; i < num_filepaths; i++) {
+        // Loop through the copies and pick how each is written (a reflink is tried first, as sharing the blocks is instant however big the file is)
+        struct stat file_info; // The copy's info (for the device it is on)
+        fstat(files[i], &file_info);
+        int method = flags->copy_method != COPY_AUTO ? flags->copy_method : probe_copy_method(master_info->st_dev, file_info.st_dev); // Use the forced method, or the fastest method that works between the two filesystems
+        copy.fds[i] = files[i];
+        if (method == COPY_REFLINK && copy_range(COPY_REFLINK, master_fd, files[i], 0, LLONG_MAX) != -1) {
+            // If the blocks could be shared, the copy is already complete
+            methods[i] = COPY_REFLINK;
+            copy.fds[i] = -1;
+            continue;
+        }
+        if (method == COPY_REFLINK && !copy_method_unsupported(errno)) {
+            // If the reflink failed for a reason other than it not being supported, print an error message and exit the program
+            fprintf(stderr, "Error: could not copy master file \"%s\" to file \"%s\"\n", master_path, filepaths[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (method == COPY_REFLINK && flags->copy_method != COPY_AUTO) {
+            // If reflinks were forced with the -m flag, print an error message and exit the program rather than quietly using another method
+            fprintf(stderr, "Error: copy method %s is not supported for file \"%s\"\n", copy_method_name(method), filepaths[i]);
+            exit(EXIT_FAILURE);
+        }
+        if (method == COPY_REFLINK) {
+            // Don't try a reflink between these filesystems again
+            rule_out_copy_method(master_info->st_dev, file_info.st_dev, COPY_REFLINK);
+        }
+        // Splice and sendfile move through a pipe or the copy's file position, which the threads can't share, so only copy_file_range is used inside the kernel (and not with the --sparse flag, as only the buffer shows the blocks of zeros)
+        methods[i] = (method == COPY_REFLINK || method == COPY_FILE_RANGE) && !flags->sparse_flag ? COPY_FILE_RANGE : COPY_READ_WRITE;
+        if (!copy.holes && !flags->sparse_flag) {
+            // If the copy will have no holes, allocate all of its blocks up front, so the ranges written out of order don't fragment it (not every filesystem can, which is fine)
+            fallocate(files[i], 0, 0, copy.size);
+        }
+    }
+    long long int num_ranges = (copy.size + SPLIT_RANGE_SIZE - 1) / SPLIT_RANGE_SIZE;
+    int num_threads = flags->num_threads > 1 ? flags->num_threads : SPLIT_DEFAULT_THREADS;
+    num_threads = num_threads > num_ranges ? num_ranges : num_threads; // There is no point in more threads than ranges
+    VERBOSE_PRINT("Splitting master file \"%s\" into %lld ranges copied on %d threads\n", master_path, num_ranges, num_threads);
+    pthread_t *threads = malloc_data(num_threads * sizeof(pthread_t)); // Allocate memory for the threads
+    for (int i = 0; i < num_threads; i++) {
+        // Loop through the threads and start each of them
+        if (pthread_create(&threads[i], NULL, split_worker, &copy) != 0) {
+            // If a thread could not be created, print an error message and exit the program
+            fprintf(stderr, "Error: could not create copy thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        // Loop through the threads and wait for each of them to finish (the -p steps are only run once every range is done)
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; !copy.failed && (copy.holes || flags->sparse_flag) && i < num_filepaths; i++) {
+        // If the copies can have holes, extend each of them to the size of the master file (so a hole at the end is kept)
+        if (copy.fds[i] != -1 && ftruncate(copy.fds[i], copy.size) == -1) {
+            copy.failed = true;
+        }
+    }
+    if (copy.failed) {
+        // If a range couldn't be copied, print an error message and exit the program
+        fprintf(stderr, "Error: could not write to a copy of master file \"%s\"\n", master_path);
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_destroy(&copy.lock);
+    free(threads);
+    free(copy.fds);
+}
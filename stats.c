@@ -0,0 +1,127 @@
+#include "mysync.h"
+
+// A C file that keeps the counters and timers reported by the --stats flag
+// Every counter is a relaxed atomic (files are scanned and synced on several threads), and every call returns straight away when the flag wasn't passed, so the counting costs next to nothing unless it is asked for
+
+_Atomic long long int stat_counters[NUM_STATS]; // The counters and timers (indexed by the STAT_ defines)
+_Atomic long long int sync_time_histogram[STATS_HISTOGRAM_BUCKETS]; // The number of master files synced in each range of times
+int stats_format = STATS_OFF; // The format the counters are reported in (set once, before any threads start)
+
+char *stat_names[NUM_STATS] = {"entries_scanned", "directories_scanned", "stat_calls", "open_calls", "uring_submits", "pattern_checks", "hash_lookups", "hash_probes", "hash_resizes",
+                               "directories_created", "files_synced", "copies_written", "copies_skipped", "delta_copies", "bytes_written", "hardlinks", "dedup_copies",
+                               "scan", "merge", "directories", "copy", "flush", "total"}; // The names of the counters and timers in the report
+
+void enable_stats(int format) {
+    // A function that takes the format to report in, and starts counting (if it isn't STATS_OFF)
+    stats_format = format;
+}
+
+bool stats_enabled(void) {
+    // A function that returns whether the --stats flag was passed
+    return stats_format != STATS_OFF;
+}
+
+void add_stat(int counter, long long int amount) {
+    // A function that takes a counter and an amount, and adds the amount to the counter (if the --stats flag was passed)
+    if (stats_format == STATS_OFF) {
+        return;
+    }
+    atomic_fetch_add_explicit(&stat_counters[counter], amount, memory_order_relaxed);
+}
+
+void start_stat_timer(struct timespec *start) {
+    // A function that takes a timespec, and sets it to the current time (if the --stats flag was passed)
+    if (stats_format == STATS_OFF) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+long long int elapsed_nanoseconds(struct timespec *start) {
+    // A function that takes a start time, and returns the nanoseconds since then
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+void stop_stat_timer(int timer, struct timespec *start) {
+    // A function that takes a timer and the time it was started, and adds the time since then to the timer (if the --stats flag was passed)
+    if (stats_format == STATS_OFF) {
+        return;
+    }
+    atomic_fetch_add_explicit(&stat_counters[timer], elapsed_nanoseconds(start), memory_order_relaxed);
+}
+
+void record_sync_time(struct timespec *start) {
+    // A function that takes the time a master file started syncing, and adds the time it took to the histogram (if the --stats flag was passed)
+    if (stats_format == STATS_OFF) {
+        return;
+    }
+    long long int microseconds = elapsed_nanoseconds(start) / 1000;
+    int bucket = 0; // The number of bits in the time, so bucket i holds times under 2^i microseconds
+    while (microseconds > 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        microseconds >>= 1;
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&sync_time_histogram[bucket], 1, memory_order_relaxed);
+}
+
+double stat_seconds(int timer) {
+    // A function that takes a timer, and returns its time in seconds
+    return stat_counters[timer] / 1e9;
+}
+
+void print_stats(void) {
+    // A function that prints the counters and timers of the sync that just finished in the format asked for with the --stats flag, then resets them for the next sync
+    if (stats_format == STATS_OFF) {
+        return;
+    }
+    if (stats_format == STATS_JSON) {
+        // Print the counters, the timers (in seconds) and the non-empty buckets of the histogram as one line of JSON
+        printf("{\"counters\": {");
+        for (int i = 0; i < STAT_TIME_SCAN; i++) {
+            printf("%s\"%s\": %lld", i == 0 ? "" : ", ", stat_names[i], (long long int)stat_counters[i]);
+        }
+        printf("}, \"seconds\": {");
+        for (int i = STAT_TIME_SCAN; i < NUM_STATS; i++) {
+            printf("%s\"%s\": %.6f", i == STAT_TIME_SCAN ? "" : ", ", stat_names[i], stat_seconds(i));
+        }
+        printf("}, \"file_sync_us\": [");
+        bool first = true;
+        for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            if (sync_time_histogram[i] > 0) {
+                printf("%s{\"under\": %lld, \"files\": %lld}", first ? "" : ", ", 1LL << i, (long long int)sync_time_histogram[i]);
+                first = false;
+            }
+        }
+        printf("]}\n");
+    } else {
+        // Print a summary for people to read
+        printf("Stats:\n");
+        printf("    Time: scan %.3fs, merge %.3fs, directories %.3fs, copy %.3fs, flush %.3fs, total %.3fs\n", stat_seconds(STAT_TIME_SCAN), stat_seconds(STAT_TIME_MERGE), stat_seconds(STAT_TIME_DIRECTORIES),
+               stat_seconds(STAT_TIME_COPY), stat_seconds(STAT_TIME_FLUSH), stat_seconds(STAT_TIME_TOTAL));
+        printf("    Scan: %lld entries in %lld directories, %lld stat calls, %lld opens, %lld io_uring submissions, %lld pattern checks\n", (long long int)stat_counters[STAT_ENTRIES_SCANNED],
+               (long long int)stat_counters[STAT_DIRECTORIES_SCANNED], (long long int)stat_counters[STAT_STAT_CALLS], (long long int)stat_counters[STAT_OPEN_CALLS],
+               (long long int)stat_counters[STAT_URING_SUBMITS], (long long int)stat_counters[STAT_PATTERN_CHECKS]);
+        printf("    Tables: %lld lookups, %lld probes (%.2f per lookup), %lld resizes\n", (long long int)stat_counters[STAT_HASH_LOOKUPS], (long long int)stat_counters[STAT_HASH_PROBES],
+               stat_counters[STAT_HASH_LOOKUPS] == 0 ? 0.0 : (double)stat_counters[STAT_HASH_PROBES] / stat_counters[STAT_HASH_LOOKUPS], (long long int)stat_counters[STAT_HASH_RESIZES]);
+        printf("    Sync: %lld files synced, %lld copies written (%lld with delta transfers), %lld hardlinks, %lld skipped, %lld directories created, %lld bytes written (%.1f MB/s while copying)\n",
+               (long long int)stat_counters[STAT_FILES_SYNCED], (long long int)stat_counters[STAT_COPIES_WRITTEN], (long long int)stat_counters[STAT_DELTA_COPIES],
+               (long long int)stat_counters[STAT_HARDLINKS], (long long int)stat_counters[STAT_COPIES_SKIPPED], (long long int)stat_counters[STAT_DIRECTORIES_CREATED], (long long int)stat_counters[STAT_BYTES_WRITTEN],
+               stat_counters[STAT_TIME_COPY] == 0 ? 0.0 : stat_counters[STAT_BYTES_WRITTEN] / 1e6 / stat_seconds(STAT_TIME_COPY));
+        printf("    File sync times:%s\n", stat_counters[STAT_COPIES_WRITTEN] == 0 ? " none" : "");
+        for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+            // Loop through the buckets of the histogram, printing the non-empty ones
+            if (sync_time_histogram[i] > 0) {
+                printf("        under %10lldus: %lld\n", 1LL << i, (long long int)sync_time_histogram[i]);
+            }
+        }
+    }
+    fflush(stdout);
+    for (int i = 0; i < NUM_STATS; i++) {
+        stat_counters[i] = 0;
+    }
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        sync_time_histogram[i] = 0;
+    }
+}
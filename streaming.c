@@ -0,0 +1,60 @@
+#include "mysync.h"
+
+// A C file that keeps bulk copies from filling the page cache (with the --stream and --direct flags)
+// Data that was copied is written back and dropped from the cache a window at a time, so a big sync doesn't evict the files the rest of the host is using, and the buffered loop can go around the cache altogether with O_DIRECT
+
+size_t copy_buffer_size(long long int size) {
+    // A function that takes the size of a master file, and returns the size of the buffer to copy it through (big enough that a big file takes a few dozen reads rather than thousands, small enough that a small file doesn't get more than it needs, and always a whole number of O_DIRECT blocks)
+    size_t buffer_size = COPY_MIN_BUFFER_SIZE;
+    while (buffer_size < COPY_MAX_BUFFER_SIZE && (long long int)buffer_size * COPY_BUFFERS_PER_FILE < size) {
+        // Double the buffer until the file takes few enough reads (or the buffer is as big as it gets)
+        buffer_size *= 2;
+    }
+    if (size < (long long int)buffer_size) {
+        // If the whole file fits in the buffer, only allocate what it needs (rounded up to a whole block)
+        buffer_size = size < DIRECT_IO_ALIGNMENT ? DIRECT_IO_ALIGNMENT : (size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    }
+    return buffer_size;
+}
+
+char *malloc_copy_buffer(size_t size) {
+    // A function that takes a size, and allocates a buffer of that size aligned for O_DIRECT (freed with free)
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, size) != 0) {
+        // If posix_memalign fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+        exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+bool set_direct_io(int fd, bool direct) {
+    // A function that takes a file descriptor and whether it should go around the page cache, and turns O_DIRECT on or off for it, returning false if it couldn't be changed (not every filesystem supports O_DIRECT)
+    int file_flags = fcntl(fd, F_GETFL);
+    if (file_flags == -1) {
+        return false;
+    }
+    return fcntl(fd, F_SETFL, direct ? file_flags | O_DIRECT : file_flags & ~O_DIRECT) == 0;
+}
+
+void start_writeback(int *fds, int num_fds, long long int start, long long int end) {
+    // A function that takes an array of file descriptors (-1 for any to leave alone) and a range, and starts writing the range of each file back to the disk without waiting for it
+    for (int i = 0; i < num_fds; i++) {
+        if (fds[i] != -1) {
+            sync_file_range(fds[i], start, end - start, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+}
+
+void release_cached_range(int master_fd, int *fds, int num_fds, long long int start, long long int end) {
+    // A function that takes a master file, an array of file descriptors of its copies (-1 for any to leave alone), and a range (an end of 0 is the end of the files), and drops the range from the page cache, waiting for the copies' writes to reach the disk first (dirty pages can't be dropped)
+    long long int length = end == 0 ? 0 : end - start;
+    for (int i = 0; i < num_fds; i++) {
+        // Loop through the copies, writing back and dropping the range of each
+        if (fds[i] != -1) {
+            sync_file_range(fds[i], start, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(fds[i], start, length, POSIX_FADV_DONTNEED);
+        }
+    }
+    posix_fadvise(master_fd, start, length, POSIX_FADV_DONTNEED); // The master file was only read, so it can be dropped straight away
+}
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Checks that rewriting a copy that is a hardlink never changes the other names of its data (the copies --hardlinks links together must each be rewritten on their own)
+# Usage: tests/hardlinks.sh [mysync binary] [work directory]
+# Prints one line per case and exits with a non-zero status if any case fails
+
+MYSYNC=${1:-./mysync}
+WORK=${2:-/tmp/mysync-hardlinks-test}
+FAILED=0
+
+check() {
+    # Takes a case name and a command, and prints whether the command succeeded
+    if eval "$2"; then
+        echo "PASS $1"
+    else
+        echo "FAIL $1"
+        FAILED=1
+    fi
+}
+
+# A master file with two names, linked the same way in the copy root, then one name replaced by a new file
+rm -rf "$WORK" && mkdir -p "$WORK/A" "$WORK/B"
+head -c 8192 /dev/urandom > "$WORK/A/x"
+ln "$WORK/A/x" "$WORK/A/y"
+cp "$WORK/A/y" "$WORK/original"
+"$MYSYNC" -p --hardlinks "$WORK/A" "$WORK/B"
+check "copies linked" '[ -f "$WORK/B/x" ] && [ "$(stat -c %i "$WORK/B/x")" = "$(stat -c %i "$WORK/B/y")" ]'
+rm "$WORK/A/x"
+echo NEW-X > "$WORK/A/x"
+"$MYSYNC" -p --hardlinks "$WORK/A" "$WORK/B"
+check "rewritten name updated" 'cmp -s "$WORK/A/x" "$WORK/B/x"'
+check "other name untouched" 'cmp -s "$WORK/original" "$WORK/B/y"'
+"$MYSYNC" -p "$WORK/A" "$WORK/B"
+check "master untouched on the next sync" 'cmp -s "$WORK/original" "$WORK/A/y"'
+
+# The same with the copy updated by a delta transfer (which would otherwise patch the shared data in place)
+rm -rf "$WORK" && mkdir -p "$WORK/A" "$WORK/B"
+head -c 1048576 /dev/urandom > "$WORK/A/x"
+ln "$WORK/A/x" "$WORK/A/y"
+cp "$WORK/A/y" "$WORK/original"
+"$MYSYNC" -p --hardlinks "$WORK/A" "$WORK/B"
+rm "$WORK/A/x"
+cp "$WORK/original" "$WORK/A/x"
+printf CHANGED | dd of="$WORK/A/x" bs=1 seek=4096 conv=notrunc 2>/dev/null
+"$MYSYNC" -p --hardlinks --delta=4096 "$WORK/A" "$WORK/B"
+check "delta rewritten name updated" 'cmp -s "$WORK/A/x" "$WORK/B/x"'
+check "delta other name untouched" 'cmp -s "$WORK/original" "$WORK/B/y"'
+
+# Identical master files whose copies --dedup=link made hardlinks, then one of the files edited
+rm -rf "$WORK" && mkdir -p "$WORK/A" "$WORK/B"
+head -c 8192 /dev/urandom > "$WORK/A/x"
+cp -p "$WORK/A/x" "$WORK/A/y"
+cp "$WORK/A/y" "$WORK/original"
+"$MYSYNC" -p --dedup=link "$WORK/A" "$WORK/B"
+echo NEW-X > "$WORK/A/x"
+"$MYSYNC" -p "$WORK/A" "$WORK/B"
+"$MYSYNC" -p "$WORK/A" "$WORK/B"
+check "dedup edited file updated" 'cmp -s "$WORK/A/x" "$WORK/B/x"'
+check "dedup other file untouched" 'cmp -s "$WORK/original" "$WORK/A/y" && cmp -s "$WORK/original" "$WORK/B/y"'
+
+# A file whose cached digest is stale (its contents changed but its size and modification time didn't) must not be made from another file's copy
+rm -rf "$WORK" && mkdir -p "$WORK/A" "$WORK/B" "$WORK/cache"
+head -c 8192 /dev/urandom > "$WORK/A/x"
+cp -p "$WORK/A/x" "$WORK/A/y"
+"$MYSYNC" -p --dedup=link --cache "$WORK/cache" "$WORK/A" "$WORK/B"
+rm -rf "$WORK/B" && mkdir "$WORK/B"
+printf CHANGED | dd of="$WORK/A/y" bs=1 seek=100 conv=notrunc 2>/dev/null
+touch -r "$WORK/A/x" "$WORK/A/y"
+"$MYSYNC" -p --dedup=link --cache "$WORK/cache" "$WORK/A" "$WORK/B"
+check "dedup stale digest not trusted" 'cmp -s "$WORK/A/x" "$WORK/B/x" && cmp -s "$WORK/A/y" "$WORK/B/y"'
+
+rm -rf "$WORK"
+exit $FAILED
@@ -0,0 +1,353 @@
+#include "mysync.h"
+
+// A C file that talks to the kernel through io_uring (with the --io-uring flag), so the system calls of the scan and the copies are queued in batches rather than made one at a time
+// The ring is set up with the raw system calls, and each thread that scans or copies has a ring of its own (a ring isn't safe to share between threads)
+// If a ring can't be set up (an old kernel, or io_uring is disabled) the callers fall back to the ordinary system calls
+
+_Thread_local Uring *thread_ring = NULL; // The ring of the current thread (NULL until the thread first needs one)
+_Thread_local bool thread_ring_failed = false; // A bool that represents whether the current thread couldn't set up a ring (so it doesn't keep trying)
+
+Uring *create_uring(unsigned int depth) {
+    // A function that takes a queue depth, and returns a new ring that can have that many requests in flight (NULL if io_uring isn't available)
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP; // Let the kernel lower a depth bigger than it allows, rather than failing
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+    Uring *ring = malloc_data(sizeof(Uring));
+    ring->fd = fd;
+    ring->depth = params.sq_entries;
+    ring->in_flight = 0;
+    ring->queued = 0;
+    ring->tail = 0;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // If the kernel puts both rings in one mapping, map the bigger size once
+        ring->sq_ring_size = ring->sq_ring_size > ring->cq_ring_size ? ring->sq_ring_size : ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        // If the rings couldn't be mapped, give up on io_uring
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sq_ring != MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    // Find the fields of the rings in the mappings
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->tail = *ring->sq_tail;
+    ring->sq_mask = *(unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return ring;
+}
+
+void free_uring(Uring *ring) {
+    // A function that takes a ring, and unmaps and closes it
+    munmap(ring->sqes, ring->depth * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+bool uring_supported(unsigned int depth) {
+    // A function that takes a queue depth, and returns whether a ring can be set up and does every operation the scan and copies use (checked once, before any threads start)
+    Uring *ring = create_uring(depth);
+    if (ring == NULL) {
+        return false;
+    }
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size); // Ask the kernel which operations it knows
+    if (probe == NULL) {
+        // If calloc fails, print an error message and exit the program
+        fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+        exit(EXIT_FAILURE);
+    }
+    bool supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    int needed[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_CLOSE, IORING_OP_READ, IORING_OP_WRITE};
+    for (size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        // Loop through the operations that are used and check the kernel supports each of them
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    free_uring(ring);
+    return supported;
+}
+
+Uring *thread_uring(Flags *flags) {
+    // A function that takes a flags struct, and returns the current thread's ring (NULL if the --io-uring flag wasn't passed or the thread couldn't set one up, in which case the ordinary system calls are used)
+    if (!flags->uring_flag || thread_ring_failed) {
+        return NULL;
+    }
+    if (thread_ring == NULL) {
+        // If this thread hasn't used a ring yet, set one up
+        thread_ring = create_uring(flags->queue_depth);
+        thread_ring_failed = thread_ring == NULL;
+    }
+    return thread_ring;
+}
+
+void release_thread_uring(void) {
+    // A function that frees the current thread's ring (called as a worker thread finishes)
+    if (thread_ring != NULL) {
+        free_uring(thread_ring);
+        thread_ring = NULL;
+    }
+}
+
+struct io_uring_sqe *uring_sqe(Uring *ring, uint64_t user_data) {
+    // A function that takes a ring and a value to tag a request with, and returns an empty request at the end of the submission queue (the caller must have room for it in the queue depth)
+    if (ring->queued == ring->depth) {
+        // If the submission queue is full, hand what is in it to the kernel to make room
+        uring_submit(ring, 0);
+    }
+    unsigned int index = ring->tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    ring->tail++;
+    ring->queued++;
+    return sqe;
+}
+
+void uring_prepare(struct io_uring_sqe *sqe, int opcode, int fd, void *addr, unsigned int length, uint64_t offset) {
+    // A function that takes a request, and fills in its operation, file descriptor, address, length and offset (which each operation reads in its own way)
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = length;
+    sqe->off = offset;
+}
+
+void uring_submit(Uring *ring, unsigned int wait_for) {
+    // A function that takes a ring and a number of completions, and hands the queued requests to the kernel in one system call, waiting until that many completions are ready
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE); // Publish the new tail (after the requests are written) so the kernel sees them
+    unsigned int to_submit = ring->queued;
+    while (to_submit > 0 || wait_for > 0) {
+        // Loop until every request is submitted and enough completions are ready (io_uring_enter can be interrupted by a signal)
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_for, wait_for > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                // If the call was interrupted, or the kernel needs completions reaped first, try again (waiting is what reaps them)
+                continue;
+            }
+            fprintf(stderr, "Error: could not submit requests to io_uring\n");
+            exit(EXIT_FAILURE);
+        }
+        to_submit -= submitted;
+        ring->in_flight += submitted;
+        ring->queued -= submitted;
+        wait_for = 0; // io_uring_enter only returns once the completions waited for are ready
+    }
+}
+
+Uring_completion uring_complete(Uring *ring) {
+    // A function that takes a ring with requests in flight, and returns the next completion (waiting for one if none are ready)
+    unsigned int head = *ring->cq_head;
+    while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        // If no completion is ready, wait for one
+        uring_submit(ring, 1);
+    }
+    Uring_completion cqe = {ring->cqes[head & ring->cq_mask].user_data, ring->cqes[head & ring->cq_mask].res};
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE); // Give the completion's slot back to the kernel
+    ring->in_flight--;
+    return cqe;
+}
+
+void statx_to_stat(struct statx *statx_info, struct stat *info) {
+    // A function that takes the info statx gave a file, and fills in a stat struct with the same fields (the rest of the program only knows stat structs)
+    memset(info, 0, sizeof(*info));
+    info->st_dev = makedev(statx_info->stx_dev_major, statx_info->stx_dev_minor);
+    info->st_ino = statx_info->stx_ino;
+    info->st_mode = statx_info->stx_mode;
+    info->st_nlink = statx_info->stx_nlink;
+    info->st_size = statx_info->stx_size;
+    info->st_mtim.tv_sec = statx_info->stx_mtime.tv_sec;
+    info->st_mtim.tv_nsec = statx_info->stx_mtime.tv_nsec;
+    info->st_ctim.tv_sec = statx_info->stx_ctime.tv_sec;
+    info->st_ctim.tv_nsec = statx_info->stx_ctime.tv_nsec;
+}
+
+void uring_stat_batch(Uring *ring, int dir_fd, char **names, struct stat *infos, int *errors, int num_names) {
+    // A function that takes a ring, an open directory, an array of names in it, and arrays for the results, and stats every name with batches of statx requests (a name's error is 0 if it was stat'ed, or its errno if not)
+    struct statx *statx_infos = malloc_data(ring->depth * sizeof(struct statx)); // The results of one batch
+    for (int start = 0; start < num_names; start += ring->depth) {
+        // Loop through the names a queue's worth at a time
+        int batch = num_names - start < (int)ring->depth ? num_names - start : (int)ring->depth;
+        for (int i = 0; i < batch; i++) {
+            // Queue a statx of each name in the batch (following links, as stat would)
+            struct io_uring_sqe *sqe = uring_sqe(ring, i);
+            uring_prepare(sqe, IORING_OP_STATX, dir_fd, names[start + i], SCAN_STATX_MASK, (uint64_t)(uintptr_t)&statx_infos[i]);
+            sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+        }
+        uring_submit(ring, batch); // Submit the whole batch with one system call
+        for (int i = 0; i < batch; i++) {
+            // Collect the completions (which can come back in any order, so each is matched up by its tag)
+            Uring_completion cqe = uring_complete(ring);
+            int index = start + (int)cqe.user_data;
+            errors[index] = cqe.res < 0 ? -cqe.res : 0;
+            if (cqe.res >= 0) {
+                statx_to_stat(&statx_infos[cqe.user_data], &infos[index]);
+            }
+        }
+    }
+    free(statx_infos);
+}
+
+void uring_open_batch(Uring *ring, int *fds, char **paths, int *open_flags, int num_paths) {
+    // A function that takes a ring, an array for file descriptors, an array of paths and the flags to open each with, and opens them all with batches of requests (a path that couldn't be opened gets -1, with errno set to why)
+    int error = 0;
+    for (int start = 0; start < num_paths; start += ring->depth) {
+        // Loop through the paths a queue's worth at a time
+        int batch = num_paths - start < (int)ring->depth ? num_paths - start : (int)ring->depth;
+        for (int i = 0; i < batch; i++) {
+            // Queue an open of each path in the batch (new files are created with permissions 0666, as open would)
+            struct io_uring_sqe *sqe = uring_sqe(ring, start + i);
+            uring_prepare(sqe, IORING_OP_OPENAT, AT_FDCWD, paths[start + i], 0666, 0);
+            sqe->open_flags = open_flags[start + i] | O_CLOEXEC;
+        }
+        uring_submit(ring, batch);
+        for (int i = 0; i < batch; i++) {
+            // Collect the completions, matching each to its path by its tag
+            Uring_completion cqe = uring_complete(ring);
+            fds[cqe.user_data] = cqe.res < 0 ? -1 : cqe.res;
+            error = cqe.res < 0 ? -cqe.res : error;
+        }
+    }
+    errno = error;
+}
+
+void uring_close_batch(Uring *ring, int *fds, int num_fds) {
+    // A function that takes a ring and an array of file descriptors, and closes them all with batches of requests
+    for (int start = 0; start < num_fds; start += ring->depth) {
+        // Loop through the file descriptors a queue's worth at a time
+        int batch = num_fds - start < (int)ring->depth ? num_fds - start : (int)ring->depth;
+        for (int i = 0; i < batch; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(ring, start + i);
+            uring_prepare(sqe, IORING_OP_CLOSE, fds[start + i], NULL, 0, 0);
+        }
+        uring_submit(ring, batch);
+        for (int i = 0; i < batch; i++) {
+            uring_complete(ring);
+        }
+    }
+}
+
+uint64_t copy_tag(int buffer, int destination, uint32_t done) {
+    // A function that takes a buffer, the destination being written (URING_READ_TAG for a read), and how many bytes of the buffer were already done, and returns the tag of the request (so a short read or write can carry on from where it stopped)
+    return (uint64_t)buffer << 48 | (uint64_t)destination << 32 | done;
+}
+
+bool uring_copy(Uring *ring, int src_fd, int *dst_fds, int num_dst_fds, long long int start, long long int end, bool skip_zeros, long long int *written) {
+    // A function that takes a ring, a source file descriptor, an array of destination file descriptors, a range of the source, whether to leave blocks of zeros as holes, and a count of bytes written, and copies the range to every destination by reading it into a few buffers and writing each buffer to every destination as soon as it is read, keeping up to the queue depth of reads and writes in flight (returns false with errno set if a read or write fails)
+    // Only the zero blocks at either end of a buffer are left as holes, so each buffer still needs just one write per destination
+    int num_buffers = ring->depth / (num_dst_fds + 1); // Each buffer needs room in the queue for its read and every one of its writes
+    num_buffers = num_buffers < 1 ? 1 : num_buffers > URING_MAX_BUFFERS ? URING_MAX_BUFFERS : num_buffers;
+    Uring_buffer *buffers = malloc_data(num_buffers * sizeof(Uring_buffer));
+    char *memory = malloc_data((size_t)num_buffers * URING_BUFFER_SIZE);
+    long long int next_offset = start; // The offset of the next chunk of the source to read
+    bool success = true;
+    for (int i = 0; i < num_buffers; i++) {
+        // Loop through the buffers and mark them as free
+        buffers[i].data = memory + (size_t)i * URING_BUFFER_SIZE;
+        buffers[i].pending = 0;
+    }
+    int busy_buffers = 0; // The number of buffers being read into or written from
+    while (success && (next_offset < end || busy_buffers > 0)) {
+        // Loop until the whole source is written to every destination
+        for (int i = 0; i < num_buffers && next_offset < end; i++) {
+            // Loop through the free buffers and start reading the next chunks of the source into them
+            if (buffers[i].pending != 0) {
+                continue;
+            }
+            buffers[i].offset = next_offset;
+            buffers[i].length = end - next_offset < URING_BUFFER_SIZE ? end - next_offset : URING_BUFFER_SIZE;
+            buffers[i].pending = 1; // Only the read is in flight
+            next_offset += buffers[i].length;
+            uring_prepare(uring_sqe(ring, copy_tag(i, URING_READ_TAG, 0)), IORING_OP_READ, src_fd, buffers[i].data, buffers[i].length, buffers[i].offset);
+            busy_buffers++;
+        }
+        uring_submit(ring, 1); // Submit everything queued (reads, and writes queued by the completions below) and wait for something to finish
+        while (ring->in_flight > 0 && __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) != *ring->cq_head) {
+            // Loop through the completions that are ready
+            Uring_completion cqe = uring_complete(ring);
+            int index = cqe.user_data >> 48;
+            int destination = (cqe.user_data >> 32) & 0xffff;
+            uint32_t done = (uint32_t)cqe.user_data + (cqe.res > 0 ? cqe.res : 0); // The bytes of the buffer done for this request's read or destination
+            Uring_buffer *buffer = &buffers[index];
+            if (cqe.res <= 0) {
+                // If a read or write failed (or the source ended early, having shrunk since it was stat'ed), stop copying once the requests in flight are done
+                errno = cqe.res < 0 ? -cqe.res : EIO;
+                success = false;
+            } else if (done < (destination == URING_READ_TAG ? buffer->length : buffer->data_end)) {
+                // If the read or write came up short, carry on from where it stopped
+                long long int length = destination == URING_READ_TAG ? buffer->length : buffer->data_end;
+                int fd = destination == URING_READ_TAG ? src_fd : dst_fds[destination];
+                uring_prepare(uring_sqe(ring, copy_tag(index, destination, done)), destination == URING_READ_TAG ? IORING_OP_READ : IORING_OP_WRITE, fd, buffer->data + done, length - done, buffer->offset + done);
+                continue;
+            } else if (destination == URING_READ_TAG) {
+                // If the chunk has been read, write it to every destination (leaving out the blocks of zeros at either end with the --sparse flag)
+                buffer->data_start = skip_zeros ? zero_run_end(buffer->data, 0, buffer->length) : 0;
+                buffer->data_end = buffer->length;
+                while (skip_zeros && buffer->data_end > buffer->data_start) {
+                    // Loop back through the blocks from the end of the chunk, leaving out the ones that are all zeros
+                    long long int block_start = (buffer->data_end - 1) / SPARSE_BLOCK_SIZE * SPARSE_BLOCK_SIZE;
+                    if (zero_run_end(buffer->data, block_start, buffer->data_end) == block_start) {
+                        break;
+                    }
+                    buffer->data_end = block_start;
+                }
+                if (buffer->data_start < buffer->data_end) {
+                    // If the chunk isn't all zeros, write what is left of it to every destination
+                    buffer->pending = num_dst_fds + 1; // The read's count is taken off below
+                    *written += (buffer->data_end - buffer->data_start) * num_dst_fds;
+                    for (int i = 0; i < num_dst_fds; i++) {
+                        uring_prepare(uring_sqe(ring, copy_tag(index, i, buffer->data_start)), IORING_OP_WRITE, dst_fds[i], buffer->data + buffer->data_start, buffer->data_end - buffer->data_start, buffer->offset + buffer->data_start);
+                    }
+                }
+            }
+            buffer->pending--;
+            if (buffer->pending == 0) {
+                // If nothing is using the buffer any more, it is free to read the next chunk into
+                busy_buffers--;
+            }
+        }
+    }
+    while (ring->in_flight > 0 || ring->queued > 0) {
+        // If the copy stopped early, wait for the requests still in flight (their buffers can't be freed under them)
+        uring_submit(ring, 0);
+        if (ring->in_flight > 0) {
+            uring_complete(ring);
+        }
+    }
+    free(memory);
+    free(buffers);
+    return success;
+}
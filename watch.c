@@ -0,0 +1,381 @@
+#include "mysync.h"
+
+// A C file that keeps the roots in step after the first sync, by watching every directory with inotify and syncing only the files that change
+// Events are collected until none have arrived for the debounce interval, then each changed file is synced once with the same newest-wins rule as a full sync
+// The copies mysync writes raise events of their own, so the state of every file is remembered after it is synced, and events that don't change it are ignored
+
+int inotify_fd = -1; // The inotify instance every directory is watched with
+Watch *watches = NULL; // An array of the directory each watch descriptor is on (indexed by watch descriptor)
+int watches_capacity = 0;
+int num_watches = 0; // The number of directories being watched
+Hashtable *known_states = NULL; // A hashtable that maps the relative path of every synced file to a File holding the state of each of its copies after it was synced
+
+void start_watching(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and starts watching each of the root directories (the directories within them are added as the first sync finds them)
+    inotify_fd = inotify_init1(IN_CLOEXEC); // Create the inotify instance
+    if (inotify_fd == -1) {
+        // If inotify isn't available, print an error message and exit the program
+        fprintf(stderr, "Error: could not start watching for changes\n");
+        exit(EXIT_FAILURE);
+    }
+    known_states = create_hashtable(DEFAULT_HASHTABLE_SIZE); // Create the hashtable of remembered file states
+    watch_directory("", directories, num_directories);
+}
+
+void add_watch(int root_index, char *relpath, char *directory) {
+    // A function that takes the index of a root, the relative path of a directory, and the root directory, and watches the directory in that root (if it exists there)
+    char *dirpath = malloc_data(strlen(directory) + strlen(relpath) + 2); // Allocate memory for the directory path
+    sprintf(dirpath, "%s/%s", directory, relpath); // Create the directory path by concatenating the root and the relative path
+    int wd = inotify_add_watch(inotify_fd, dirpath, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB | IN_ONLYDIR); // Watch for files being written, moved in, created, or having their times or permissions changed
+    free(dirpath);
+    if (wd == -1) {
+        // If the directory doesn't exist in this root (or can't be watched), there is nothing to do
+        return;
+    }
+    if (wd >= watches_capacity) {
+        // If the watch array is too small for the watch descriptor, grow it (watch descriptors are small and handed out in order)
+        int old_capacity = watches_capacity;
+        watches_capacity = wd * 2 + 16;
+        watches = realloc(watches, watches_capacity * sizeof(Watch));
+        if (watches == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = old_capacity; i < watches_capacity; i++) {
+            watches[i].relpath = NULL; // Mark the new slots as unused
+        }
+    }
+    if (watches[wd].relpath != NULL) {
+        // If the directory was already watched (inotify hands back the same descriptor), keep its existing entry
+        return;
+    }
+    watches[wd].root_index = root_index;
+    watches[wd].relpath = strdup(relpath);
+    num_watches++;
+}
+
+bool is_watched(int root_index, char *relpath) {
+    // A function that takes the index of a root and the relative path of a directory, and returns true if the directory is already watched in that root
+    for (int wd = 0; wd < watches_capacity; wd++) {
+        // Loop through the watches (directories are only checked when one is created, so a linear search is fine)
+        if (watches[wd].relpath != NULL && watches[wd].root_index == root_index && strcmp(watches[wd].relpath, relpath) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void watch_directory(char *relpath, char **directories, int num_directories) {
+    // A function that takes the relative path of a directory, an array of directory names, and the number of directories, and watches the directory in every root it exists in
+    for (int i = 0; i < num_directories; i++) {
+        add_watch(i, relpath, directories[i]);
+    }
+}
+
+File *stat_file(char *relpath, char **directories, int num_directories) {
+    // A function that takes a relative path, an array of directory names, and the number of directories, and returns a File holding the state of the file in every root (with the newest copy as the master), or NULL if no root has it as a regular file
+    File *file = NULL;
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the roots and stat the file in each of them
+        char *filepath = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the filepath
+        sprintf(filepath, "%s/%s", directories[i], relpath);
+        struct stat file_info;
+        bool found = stat(filepath, &file_info) == 0 && S_ISREG(file_info.st_mode);
+        free(filepath);
+        if (!found) {
+            // If the file isn't in this root, it is left as not present
+            continue;
+        }
+        if (file == NULL) {
+            // If this is the first copy found, it is the master so far
+            file = malloc_data(sizeof(File));
+            file->type_id = 1;
+            file->replicas = malloc_data(num_directories * sizeof(Replica));
+            for (int j = 0; j < num_directories; j++) {
+                file->replicas[j].present = false;
+            }
+            file->directory_index = i;
+        }
+        set_replica(&file->replicas[i], &file_info); // Record the metadata of this copy of the file
+        if (file->directory_index == i || is_newer(&file_info.st_mtim, &file->replicas[file->directory_index].edit_time)) {
+            // If this copy is newer than the master so far, it becomes the master (the same rule as a full sync, so on a tie the first root wins)
+            file->directory_index = i;
+            file->size = file_info.st_size;
+            file->permissions = file_info.st_mode;
+            file->edit_time = file_info.st_mtime;
+        }
+    }
+    return file;
+}
+
+void remember_file(char *relpath, char **directories, int num_directories) {
+    // A function that takes the relative path of a file that has just been synced, an array of directory names, and the number of directories, and remembers the state of every copy so the events its own writes raise can be ignored
+    File *state = stat_file(relpath, directories, num_directories);
+    if (state != NULL) {
+        put(&known_states, relpath, state); // Replaces (and frees) any state remembered before
+    }
+}
+
+bool file_changed(char *relpath, int root_index, char *directory) {
+    // A function that takes the relative path of a file, the index of a root an event was raised in, and the root directory, and returns true if the file is different from when it was last synced there
+    File *state = (File *)get(known_states, relpath);
+    if (state == NULL) {
+        // If the file has never been synced, the event is a real change
+        return true;
+    }
+    char *filepath = malloc_data(strlen(directory) + strlen(relpath) + 2); // Allocate memory for the filepath
+    sprintf(filepath, "%s/%s", directory, relpath);
+    struct stat file_info;
+    bool exists = stat(filepath, &file_info) == 0;
+    free(filepath);
+    Replica *known = &state->replicas[root_index]; // The state of the copy when it was last synced
+    if (!exists || !known->present) {
+        // If the copy has appeared or gone since it was synced, it has changed
+        return exists != known->present;
+    }
+    return known->size != file_info.st_size || known->permissions != (int)file_info.st_mode
+        || known->edit_time.tv_sec != file_info.st_mtim.tv_sec || known->edit_time.tv_nsec != file_info.st_mtim.tv_nsec;
+}
+
+void add_change(Watch **changes, int *num_changes, int *capacity, int root_index, char *relpath) {
+    // A function that takes a growing array of changes, and adds a change to a relative path in a root to it
+    if (*num_changes == *capacity) {
+        // If the array is full, double its size
+        *capacity = *capacity == 0 ? 64 : *capacity * 2;
+        *changes = realloc(*changes, *capacity * sizeof(Watch));
+        if (*changes == NULL) {
+            // If realloc fails, print an error message and exit the program
+            fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*changes)[*num_changes].root_index = root_index;
+    (*changes)[*num_changes].relpath = strdup(relpath);
+    (*num_changes)++;
+}
+
+void add_subtree(Watch **changes, int *num_changes, int *capacity, char *relpath, char **directories, int num_directories) {
+    // A function that takes a growing array of changes and the relative path of a new directory, and watches the directory (and every directory within it) in every root, adding every file within it as a change
+    watch_directory(relpath, directories, num_directories);
+    for (int i = 0; i < num_directories; i++) {
+        // Loop through the roots and read the directory in each one it exists in
+        char *dirpath = malloc_data(strlen(directories[i]) + strlen(relpath) + 2); // Allocate memory for the directory path
+        sprintf(dirpath, "%s/%s", directories[i], relpath);
+        DIR *dir = opendir(dirpath);
+        free(dirpath);
+        if (dir == NULL) {
+            continue;
+        }
+        struct dirent *dirent;
+        while ((dirent = readdir(dir)) != NULL) {
+            // Loop through the directory entries, adding every entry as a change (subdirectories are recognised and recursed into when the changes are synced)
+            if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+                continue;
+            }
+            char *entry_relpath = malloc_data(strlen(relpath) + strlen(dirent->d_name) + 2); // Allocate memory for the entry's relative path
+            sprintf(entry_relpath, "%s/%s", relpath, dirent->d_name);
+            add_change(changes, num_changes, capacity, i, entry_relpath);
+            free(entry_relpath);
+        }
+        closedir(dir);
+    }
+}
+
+void ensure_parent_directories(char *relpath, char **directories, int num_directories, Flags *flags) {
+    // A function that takes the relative path of a file, an array of directory names, the number of directories, and a flags struct, and creates every directory above the file in the roots it is missing from (watching each one created)
+    char *parent = strdup(relpath); // A copy of the relative path, cut short at each '/' in turn
+    for (char *slash = strchr(parent, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        // Loop through the directories above the file, from the top down
+        *slash = '\0';
+        for (int i = 0; i < num_directories; i++) {
+            // Loop through the roots and create the directory in any it is missing from
+            char *dirpath = malloc_data(strlen(directories[i]) + strlen(parent) + 2); // Allocate memory for the directory path
+            sprintf(dirpath, "%s/%s", directories[i], parent);
+            struct stat dir_info;
+            if (stat(dirpath, &dir_info) == -1) {
+                create_directory(parent, directories[i], flags);
+                add_watch(i, parent, directories[i]);
+            }
+            free(dirpath);
+        }
+        *slash = '/';
+    }
+    free(parent);
+}
+
+int compare_changes(const void *a, const void *b) {
+    // A function that compares two changes by relative path and then root (for qsort)
+    Watch *change_a = (Watch *)a;
+    Watch *change_b = (Watch *)b;
+    int result = strcmp(change_a->relpath, change_b->relpath);
+    return result != 0 ? result : change_a->root_index - change_b->root_index;
+}
+
+void sync_changes(Watch *changes, int num_changes, char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of changes, an array of directory names, the number of directories, and a flags struct, and syncs every changed file
+    int capacity = num_changes; // The capacity of the changes array (which grows as new directories add their contents)
+    File **files = NULL; // An array of the files being synced (kept until the copy workers are finished with them)
+    char **relpaths = NULL;
+    int num_files = 0;
+    int i = 0;
+    start_copy_pool(directories, num_directories, flags); // Start the copy workers (if the -j flag asked for more than one thread)
+    while (i < num_changes) {
+        // Loop through the changes (sorted again whenever a new directory adds its contents, so every change to a path is next to the others)
+        qsort(changes + i, num_changes - i, sizeof(Watch), compare_changes);
+        char *relpath = changes[i].relpath; // The relative path all the changes in this group are to
+        bool changed = false; // A bool that represents whether any of the changes is real (rather than raised by mysync's own writes)
+        int group_end = i;
+        for (; group_end < num_changes && strcmp(changes[group_end].relpath, relpath) == 0; group_end++) {
+            changed |= file_changed(relpath, changes[group_end].root_index, directories[changes[group_end].root_index]);
+        }
+        bool is_directory = false; // A bool that represents whether the path is a directory in any root
+        bool is_new = false; // A bool that represents whether the directory isn't watched yet in a root it is in (directories mysync created itself are already watched)
+        for (int j = 0; j < num_directories; j++) {
+            char *path = malloc_data(strlen(directories[j]) + strlen(relpath) + 2); // Allocate memory for the path
+            sprintf(path, "%s/%s", directories[j], relpath);
+            struct stat info;
+            if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+                is_directory = true;
+                is_new |= !is_watched(j, relpath);
+            }
+            free(path);
+        }
+        char *filename = strrchr(relpath, '/') == NULL ? relpath : strrchr(relpath, '/') + 1; // The last part of the relative path
+        if (is_directory) {
+            // If the path is a new directory, watch it and add everything in it as changes
+            char *dir_relpath = malloc_data(strlen(relpath) + 2); // The directory's relative path with a '/' on the end, to match the path globs against
+            sprintf(dir_relpath, "%s/", relpath);
+            if (flags->recursive_flag && is_new && directory_skip_reason(dir_relpath, flags) == SCAN_KEEP) {
+                VERBOSE_PRINT("Found new directory \"%s\"\n", relpath);
+                add_subtree(&changes, &num_changes, &capacity, relpath, directories, num_directories);
+            }
+            free(dir_relpath);
+        } else if (changed && file_skip_reason(filename, relpath, flags) == SCAN_KEEP) {
+            // If the file really changed and isn't filtered out, sync it
+            File *file = stat_file(relpath, directories, num_directories);
+            if (file != NULL) {
+                ensure_parent_directories(relpath, directories, num_directories, flags); // A file in a new directory may need the directory created in the other roots first
+                files = realloc(files, (num_files + 1) * sizeof(File *));
+                relpaths = realloc(relpaths, (num_files + 1) * sizeof(char *));
+                if (files == NULL || relpaths == NULL) {
+                    // If realloc fails, print an error message and exit the program
+                    fprintf(stderr, "Error: Failed to allocate memory for new data\n");
+                    exit(EXIT_FAILURE);
+                }
+                files[num_files] = file;
+                relpaths[num_files] = strdup(relpath);
+                VERBOSE_PRINT("Syncing file \"%s\"\n", relpath);
+                submit_copy(file, relpaths[num_files]); // Sync the file (or queue it for a worker)
+                num_files++;
+            }
+        }
+        i = group_end;
+    }
+    finish_copy_pool(); // Wait for every file to be synced
+    if (flags->atomic_flag && !flags->no_sync_flag) {
+        // If the --atomic flag was passed, flush the copies written since the last flush
+        flush_replicas(flags, true);
+    }
+    for (int j = 0; j < num_files; j++) {
+        // Loop through the synced files, remembering their new state and freeing them
+        remember_file(relpaths[j], directories, num_directories);
+        free(files[j]->replicas);
+        free(files[j]);
+        free(relpaths[j]);
+    }
+    for (int j = 0; j < num_changes; j++) {
+        free(changes[j].relpath);
+    }
+    free(changes);
+    free(files);
+    free(relpaths);
+}
+
+long long int now_ms(void) {
+    // A function that returns the time in milliseconds (from a clock that never jumps)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+void watch_directories(char **directories, int num_directories, Flags *flags) {
+    // A function that takes an array of directory names, the number of directories, and a flags struct, and syncs the files that change in them until the program is killed
+    VERBOSE_PRINT("Watching %d directories for changes\n", num_watches);
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event)))); // A buffer for reading events into
+    Watch *changes = NULL; // An array of the changes collected for the next batch
+    int num_changes = 0;
+    int capacity = 0;
+    long long int first_change = 0; // The time the first change of the batch arrived
+    long long int last_change = 0; // The time the latest change arrived
+    while (true) {
+        int timeout = -1; // Wait for an event forever if there are no changes waiting
+        if (num_changes > 0) {
+            // If there are changes waiting, wait until the debounce interval has passed since the latest one (or the batch has waited ten intervals in total, so a constant stream of changes can't hold it back forever)
+            long long int deadline = last_change + flags->debounce_ms;
+            if (deadline > first_change + 10LL * flags->debounce_ms) {
+                deadline = first_change + 10LL * flags->debounce_ms;
+            }
+            timeout = deadline - now_ms() > 0 ? deadline - now_ms() : 0;
+        }
+        struct pollfd poll_fd = {.fd = inotify_fd, .events = POLLIN};
+        int ready = poll(&poll_fd, 1, timeout);
+        if (ready == -1 && errno != EINTR) {
+            // If poll fails, print an error message and exit the program
+            fprintf(stderr, "Error: could not wait for changes\n");
+            exit(EXIT_FAILURE);
+        }
+        if (ready <= 0) {
+            // If the debounce interval passed with no new events, sync the batch
+            if (num_changes > 0) {
+                VERBOSE_PRINT("Syncing a batch of %d changes\n", num_changes);
+                sync_changes(changes, num_changes, directories, num_directories, flags);
+                changes = NULL;
+                num_changes = 0;
+                capacity = 0;
+            }
+            continue;
+        }
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer)); // Read as many events as are waiting
+        if (length <= 0) {
+            continue;
+        }
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            // Loop through the events
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // If events were lost, the only safe thing to do is a full sync (which also remembers the state of every file again)
+                VERBOSE_PRINT("Too many changes to track, syncing everything\n");
+                sync_directories(directories, num_directories, flags);
+                continue;
+            }
+            if (event->wd < 0 || event->wd >= watches_capacity || watches[event->wd].relpath == NULL) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // If the directory has gone, stop tracking its watch
+                free(watches[event->wd].relpath);
+                watches[event->wd].relpath = NULL;
+                num_watches--;
+                continue;
+            }
+            if (event->len == 0) {
+                // If the event is about the directory itself rather than an entry in it, there is nothing to sync
+                continue;
+            }
+            Watch *watch = &watches[event->wd];
+            char *relpath = malloc_data(strlen(watch->relpath) + strlen(event->name) + 2); // Allocate memory for the relative path of the entry
+            if (watch->relpath[0] == '\0') {
+                strcpy(relpath, event->name);
+            } else {
+                sprintf(relpath, "%s/%s", watch->relpath, event->name);
+            }
+            if (num_changes == 0) {
+                first_change = now_ms();
+            }
+            last_change = now_ms();
+            add_change(&changes, &num_changes, &capacity, watch->root_index, relpath);
+            free(relpath);
+        }
+    }
+}